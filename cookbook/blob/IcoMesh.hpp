@@ -0,0 +1,362 @@
+#pragma once
+#ifndef IcoMesh_H
+#define IcoMesh_H
+
+// Icosphere mesh with vertex adjacency, in text (.ico) and binary (.icob)
+// form.
+//
+// The .ico text files hold one "x,y,z" vertex per line, a "|" line, one
+// triangle index per line, a "|" line and then the 5 or 6 neighbors of each
+// vertex. Parsing that with streams takes seconds at 655362 vertices.
+//
+// The .icob binary layout is a 32 byte header followed by four arrays, each
+// of which can be used in place from a memory mapping:
+//
+//   Header    magic "ICOB", version, numVertices, numIndices, numNeighbors
+//   float     vertices[3 * numVertices]
+//   uint32_t  indices[numIndices]            triangle list
+//   uint32_t  neighborOffsets[numVertices + 1]
+//   uint32_t  neighbors[numNeighbors]        CSR: neighbors of vertex i are
+//                                            neighbors[offsets[i] ..
+//                                            offsets[i + 1])
+//
+// All values are little endian. The arrays are used without conversion, so
+// big endian hosts neither read nor write .icob files. Files are checked on
+// open: sizes, offsets that never decrease, and indices and neighbors that
+// are valid vertices. Convert text files with ico2icob.
+//
+// generateIcosphere() builds the same kind of mesh in memory, for vertex
+// counts 10 * 4^k + 2 (162, 642, ... 655362) that have no file.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+struct IcoMeshData {
+  std::vector<float> vertices; // x, y, z per vertex
+  std::vector<uint32_t> indices;
+  std::vector<uint32_t> neighborOffsets;
+  std::vector<uint32_t> neighbors;
+
+  size_t numVertices() const { return vertices.size() / 3; }
+};
+
+// Parse a text .ico file
+inline bool loadIcoText(const std::string &fileName, IcoMeshData &data) {
+  std::ifstream file(fileName);
+  if (!file.is_open())
+    return false;
+
+  data = IcoMeshData();
+  data.neighborOffsets.push_back(0);
+  std::string line;
+  int state = 0;
+  while (getline(file, line)) {
+    if (line == "|") {
+      state++;
+      continue;
+    }
+    switch (state) {
+    case 0: {
+      std::vector<float> v;
+      std::stringstream ss(line);
+      float f;
+      while (ss >> f) {
+        v.push_back(f);
+        if (ss.peek() == ',')
+          ss.ignore();
+      }
+      if (v.size() < 3)
+        return false;
+      data.vertices.insert(data.vertices.end(), v.begin(), v.begin() + 3);
+    } break;
+
+    case 1: {
+      std::stringstream ss(line);
+      uint32_t i;
+      if (ss >> i)
+        data.indices.push_back(i);
+      else
+        return false;
+    } break;
+
+    case 2: {
+      std::vector<uint32_t> v;
+      std::stringstream ss(line);
+      uint32_t i;
+      while (ss >> i) {
+        v.push_back(i);
+        if (ss.peek() == ',')
+          ss.ignore();
+      }
+      if ((v.size() != 5) && (v.size() != 6))
+        return false;
+      data.neighbors.insert(data.neighbors.end(), v.begin(), v.end());
+      data.neighborOffsets.push_back(data.neighbors.size());
+    } break;
+    }
+  }
+  return data.neighborOffsets.size() == data.numVertices() + 1;
+}
+
+// Number of subdivisions of an icosahedron that gives numVertices vertices,
+// or -1 if there is none
+inline int icosphereSubdivisions(size_t numVertices) {
+  size_t n = 12;
+  for (int k = 0; k < 16; k++) {
+    if (n == numVertices)
+      return k;
+    n = 4 * (n - 2) + 2;
+  }
+  return -1;
+}
+
+// Unit icosphere from an icosahedron subdivided the given number of times.
+// Vertices and triangles come out in the same order as in the .ico files,
+// neighbor lists are sorted.
+inline void generateIcosphere(int subdivisions, IcoMeshData &data) {
+  data = IcoMeshData();
+  const float t = (1.0f + std::sqrt(5.0f)) / 2.0f;
+  const float base[12][3] = {{-1, t, 0}, {1, t, 0},  {-1, -t, 0}, {1, -t, 0},
+                             {0, -1, t}, {0, 1, t},  {0, -1, -t}, {0, 1, -t},
+                             {t, 0, -1}, {t, 0, 1},  {-t, 0, -1}, {-t, 0, 1}};
+  auto addVertex = [&](float x, float y, float z) {
+    float s = 1.0f / std::sqrt(x * x + y * y + z * z);
+    data.vertices.insert(data.vertices.end(), {x * s, y * s, z * s});
+    return uint32_t(data.numVertices() - 1);
+  };
+  for (auto &v : base)
+    addVertex(v[0], v[1], v[2]);
+  data.indices = {0, 11, 5,  0, 5,  1, 0, 1, 7, 0, 7,  10, 0, 10, 11,
+                  1, 5,  9,  5, 11, 4, 11, 10, 2, 10, 7, 6, 7, 1,  8,
+                  3, 9,  4,  3, 4,  2, 3, 2, 6, 3, 6,  8,  3, 8,  9,
+                  4, 9,  5,  2, 4,  11, 6, 2, 10, 8, 6, 7, 9, 8,  1};
+
+  std::unordered_map<uint64_t, uint32_t> midpoints;
+  auto midpoint = [&](uint32_t a, uint32_t b) {
+    uint64_t key = (uint64_t(std::min(a, b)) << 32) | std::max(a, b);
+    auto it = midpoints.find(key);
+    if (it != midpoints.end())
+      return it->second;
+    const float *pa = &data.vertices[3 * a];
+    const float *pb = &data.vertices[3 * b];
+    uint32_t m = addVertex((pa[0] + pb[0]) / 2, (pa[1] + pb[1]) / 2,
+                           (pa[2] + pb[2]) / 2);
+    midpoints[key] = m;
+    return m;
+  };
+  for (int s = 0; s < subdivisions; s++) {
+    std::vector<uint32_t> indices;
+    indices.reserve(data.indices.size() * 4);
+    midpoints.clear();
+    for (size_t i = 0; i < data.indices.size(); i += 3) {
+      uint32_t v1 = data.indices[i], v2 = data.indices[i + 1],
+               v3 = data.indices[i + 2];
+      uint32_t a = midpoint(v1, v2), b = midpoint(v2, v3),
+               c = midpoint(v3, v1);
+      indices.insert(indices.end(),
+                     {v1, a, c, v2, b, a, v3, c, b, a, b, c});
+    }
+    data.indices.swap(indices);
+  }
+
+  // Each vertex has 5 or 6 neighbors. Collect them from the triangle edges,
+  // every edge is seen twice.
+  size_t numVertices = data.numVertices();
+  std::vector<uint32_t> count(numVertices, 0);
+  std::vector<uint32_t> edges(numVertices * 12);
+  auto addEdge = [&](uint32_t a, uint32_t b) {
+    if (count[a] < 12)
+      edges[a * 12 + count[a]++] = b;
+  };
+  for (size_t i = 0; i < data.indices.size(); i += 3) {
+    for (int e = 0; e < 3; e++) {
+      uint32_t a = data.indices[i + e], b = data.indices[i + (e + 1) % 3];
+      addEdge(a, b);
+      addEdge(b, a);
+    }
+  }
+  data.neighborOffsets.resize(numVertices + 1);
+  data.neighborOffsets[0] = 0;
+  for (size_t i = 0; i < numVertices; i++) {
+    auto begin = edges.begin() + i * 12;
+    std::sort(begin, begin + count[i]);
+    auto end = std::unique(begin, begin + count[i]);
+    data.neighbors.insert(data.neighbors.end(), begin, end);
+    data.neighborOffsets[i + 1] = data.neighbors.size();
+  }
+}
+
+inline bool icoHostIsLittleEndian() {
+  const uint32_t one = 1;
+  uint8_t first;
+  memcpy(&first, &one, 1);
+  return first == 1;
+}
+
+struct IcoBinaryHeader {
+  char magic[4];
+  uint32_t version;
+  uint32_t numVertices;
+  uint32_t numIndices;
+  uint32_t numNeighbors;
+  uint32_t reserved[3];
+};
+
+inline bool writeIcoBinary(const std::string &fileName,
+                           const IcoMeshData &data) {
+  if (!icoHostIsLittleEndian())
+    return false;
+  IcoBinaryHeader header;
+  memcpy(header.magic, "ICOB", 4);
+  header.version = 1;
+  header.numVertices = data.numVertices();
+  header.numIndices = data.indices.size();
+  header.numNeighbors = data.neighbors.size();
+  memset(header.reserved, 0, sizeof(header.reserved));
+
+  FILE *f = fopen(fileName.c_str(), "wb");
+  if (!f)
+    return false;
+  bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+  auto writeArray = [&](const void *p, size_t bytes) {
+    ok = ok && (bytes == 0 || fwrite(p, bytes, 1, f) == 1);
+  };
+  writeArray(data.vertices.data(), data.vertices.size() * sizeof(float));
+  writeArray(data.indices.data(), data.indices.size() * sizeof(uint32_t));
+  writeArray(data.neighborOffsets.data(),
+             data.neighborOffsets.size() * sizeof(uint32_t));
+  writeArray(data.neighbors.data(), data.neighbors.size() * sizeof(uint32_t));
+  return fclose(f) == 0 && ok;
+}
+
+// Read-only view of a .icob file, memory mapped where available
+class IcoMeshFile {
+public:
+  IcoMeshFile() = default;
+  IcoMeshFile(const IcoMeshFile &) = delete;
+  IcoMeshFile &operator=(const IcoMeshFile &) = delete;
+  ~IcoMeshFile() { close(); }
+
+  bool open(const std::string &fileName) {
+    close();
+#ifdef _WIN32
+    std::ifstream file(fileName, std::ios::binary | std::ios::ate);
+    if (!file.is_open())
+      return false;
+    mBuffer.resize(size_t(file.tellg()));
+    file.seekg(0);
+    if (!file.read(mBuffer.data(), mBuffer.size()))
+      return false;
+    mData = mBuffer.data();
+    mSize = mBuffer.size();
+#else
+    int fd = ::open(fileName.c_str(), O_RDONLY);
+    if (fd < 0)
+      return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(IcoBinaryHeader)) {
+      ::close(fd);
+      return false;
+    }
+    void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED)
+      return false;
+    mData = static_cast<const char *>(p);
+    mSize = st.st_size;
+    mMapped = true;
+#endif
+    if (!validate()) {
+      close();
+      return false;
+    }
+    return true;
+  }
+
+  void close() {
+#ifndef _WIN32
+    if (mMapped)
+      munmap(const_cast<char *>(mData), mSize);
+#endif
+    mBuffer.clear();
+    mData = nullptr;
+    mSize = 0;
+    mMapped = false;
+  }
+
+  bool isOpen() const { return mData != nullptr; }
+
+  size_t numVertices() const { return header().numVertices; }
+  size_t numIndices() const { return header().numIndices; }
+  size_t numNeighbors() const { return header().numNeighbors; }
+
+  const float *vertices() const {
+    return reinterpret_cast<const float *>(mData + sizeof(IcoBinaryHeader));
+  }
+  const uint32_t *indices() const {
+    return reinterpret_cast<const uint32_t *>(vertices() + 3 * numVertices());
+  }
+  const uint32_t *neighborOffsets() const { return indices() + numIndices(); }
+  const uint32_t *neighbors() const {
+    return neighborOffsets() + numVertices() + 1;
+  }
+
+private:
+  const IcoBinaryHeader &header() const {
+    return *reinterpret_cast<const IcoBinaryHeader *>(mData);
+  }
+
+  bool validate() const {
+    if (mSize < sizeof(IcoBinaryHeader) || !icoHostIsLittleEndian())
+      return false;
+    const auto &h = header();
+    if (memcmp(h.magic, "ICOB", 4) != 0 || h.version != 1)
+      return false;
+    size_t expected = sizeof(IcoBinaryHeader) +
+                      (3 * size_t(h.numVertices) + h.numIndices +
+                       h.numVertices + 1 + h.numNeighbors) *
+                          4;
+    if (mSize < expected)
+      return false;
+    // Offsets start at 0, never decrease and end at numNeighbors, so every
+    // neighbor range is inside the neighbors array
+    const uint32_t *offsets = neighborOffsets();
+    if (offsets[0] != 0 || offsets[h.numVertices] != h.numNeighbors)
+      return false;
+    for (size_t i = 0; i < h.numVertices; i++) {
+      if (offsets[i + 1] < offsets[i])
+        return false;
+    }
+    auto inRange = [&](const uint32_t *values, size_t count) {
+      for (size_t i = 0; i < count; i++) {
+        if (values[i] >= h.numVertices)
+          return false;
+      }
+      return true;
+    };
+    return inRange(indices(), h.numIndices) &&
+           inRange(neighbors(), h.numNeighbors);
+  }
+
+  const char *mData{nullptr};
+  size_t mSize{0};
+  bool mMapped{false};
+  std::vector<char> mBuffer; // Used where mmap is not available
+};
+
+#endif
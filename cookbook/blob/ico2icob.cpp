@@ -0,0 +1,66 @@
+// Converts blob icosphere text files (<N>.ico) to the binary .icob format
+// read by the blob app (see IcoMesh.hpp).
+//
+// Usage: ico2icob 162.ico 642.ico ...
+// Each input is written next to itself with the .icob extension, then read
+// back and checked. Load times for both formats are printed.
+
+#include <chrono>
+#include <iostream>
+
+#include "IcoMesh.hpp"
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    std::cout << "Usage: " << argv[0] << " file.ico [file.ico ...]"
+              << std::endl;
+    return 1;
+  }
+  int failures = 0;
+  for (int i = 1; i < argc; i++) {
+    std::string input = argv[i];
+    std::string output = input.substr(0, input.rfind('.')) + ".icob";
+
+    auto t0 = std::chrono::steady_clock::now();
+    IcoMeshData data;
+    if (!loadIcoText(input, data)) {
+      std::cerr << "Could not parse " << input << std::endl;
+      failures++;
+      continue;
+    }
+    auto t1 = std::chrono::steady_clock::now();
+    if (!writeIcoBinary(output, data)) {
+      std::cerr << "Could not write " << output << std::endl;
+      failures++;
+      continue;
+    }
+
+    auto t2 = std::chrono::steady_clock::now();
+    IcoMeshFile file;
+    bool ok = file.open(output) && file.numVertices() == data.numVertices() &&
+              file.numIndices() == data.indices.size() &&
+              file.numNeighbors() == data.neighbors.size();
+    auto t3 = std::chrono::steady_clock::now();
+    ok = ok &&
+         memcmp(file.vertices(), data.vertices.data(),
+                data.vertices.size() * sizeof(float)) == 0 &&
+         memcmp(file.indices(), data.indices.data(),
+                data.indices.size() * sizeof(uint32_t)) == 0 &&
+         memcmp(file.neighbors(), data.neighbors.data(),
+                data.neighbors.size() * sizeof(uint32_t)) == 0;
+    if (!ok) {
+      std::cerr << "Verification of " << output << " failed" << std::endl;
+      failures++;
+      continue;
+    }
+
+    auto ms = [](std::chrono::steady_clock::duration d) {
+      return std::chrono::duration<double, std::milli>(d).count();
+    };
+    std::cout << input << " -> " << output << ": " << data.numVertices()
+              << " vertices, " << data.indices.size() / 3 << " triangles. "
+              << "Text load " << ms(t1 - t0) << " ms, binary open "
+              << ms(t3 - t2) << " ms" << std::endl;
+  }
+  return failures;
+}
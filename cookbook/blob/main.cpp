@@ -9,14 +9,42 @@
 
 #include <Gamma/Noise.h>
 
+#include "../distributed/ChunkedState.hpp"
+#include "../distributed/NodeStats.hpp"
+#include "../distributed/StateCodec.hpp"
+#include "../distributed/StateSmoother.hpp"
+#include "../simulation/FixedStepSimulation.hpp"
+#include "../simulation/ParallelFor.hpp"
+#include "../../tools/graphics/StreamingMesh.hpp"
+#include "IcoMesh.hpp"
+
 using namespace al;
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
 #include <iostream> // cout
 #include <vector> // vector
 
 // This example demonstrates how to write a distributed application that
 // shares mesh vertices through cuttlebone.
 // Original by Karl Yerkes, adapted by Andres Cabrera
+//
+// The simulator steps the springs at a fixed 60 Hz on its own thread (see
+// FixedStepSimulation.hpp) and shares vertices interpolated between the last
+// two steps. Springs are solved in parallel over a CSR neighbor list (see
+// SpringSolver). With STATE_CODEC the positions are sent quantized (and delta
+// coded with CHUNKED_STATE), and each node prints the state size every 600
+// frames.
+// With CHUNKED_STATE the positions are broadcast in numbered chunks outside
+// of cuttlebone, and renderers keep the previous positions for lost chunks.
+// With SMOOTH_STATE renderers interpolate between received frames. Positions
+// are drawn from wherever they end up (see StreamingMesh.hpp), without copying
+// them into a Mesh.
+//
+// Press 'b' on the simulator to print steps per second for each N below.
+// Any other key pokes the blob.
 
 // State --------------------------
 #define N 162
@@ -27,8 +55,29 @@ using namespace al;
 //#define N 163842
 //#define N 655362
 
+// Send vertex positions quantized to 16 bits (see StateCodec.hpp) instead of
+// as Vec3f. Set to 0 to send them uncompressed. Cuttlebone sends the whole
+// State and drops frames, so there every frame decodes on its own; with
+// CHUNKED_STATE only the encoded bytes are sent and frames are delta coded.
+#define STATE_CODEC 1
+
+// Broadcast vertex positions in numbered chunks on their own UDP port (see
+// ChunkedState.hpp) instead of in the cuttlebone state, so a lost packet
+// only affects the vertices in it. Encoded positions can only be decoded
+// from complete frames, so on lossy networks use this with STATE_CODEC 0.
+#define CHUNKED_STATE 0
+#define CHUNKED_STATE_ADDRESS "255.255.255.255"
+#define CHUNKED_STATE_PORT 63060
+
+// Renderers show pose and positions from a fixed delay ago, interpolated
+// between received frames (see StateSmoother.hpp), which hides irregular
+// frame arrival.
+#define SMOOTH_STATE 1
+
 struct State {
   Pose pose; // for navigation
+  double time; // when the primary wrote this state
+  uint32_t frame; // numbers the states the primary wrote
 
   // this is how you might control renderering settings.
   double eyeSeparation;
@@ -48,67 +97,207 @@ struct State {
   // renderer, only interpreted.
   //
 
+#if CHUNKED_STATE
+  // Positions are broadcast separately
+#elif STATE_CODEC
+  // Encoded by QuantizedArrayCodec, at most 6 bytes per vertex
+  uint8_t p[QuantizedArrayCodec::maxEncodedSize(N)];
+#else
   Vec3f p[N];
+#endif
 };
 
-// Load file into mesh
-bool load(std::string fileName, Mesh &mesh, std::vector<std::vector<int>> &nn) {
-  std::ifstream file(fileName);
-  if (!file.is_open())
-    return false;
+// Simulation data, owned by the simulation thread
+struct BlobSim {
+  vector<Vec3f> p;
+  vector<Vec3f> pNext; // Positions being written by SpringSolver::step()
+  vector<Vec3f> velocity;
+};
 
-  std::string line;
-  int state = 0;
-  while (getline(file, line)) {
-    if (line == "|") {
-      state++;
-      continue;
-    }
-    switch (state) {
-    case 0: {
-      std::vector<float> v;
-      std::stringstream ss(line);
-      float f;
-      while (ss >> f) {
-        v.push_back(f);
-        if (ss.peek() == ',')
-          ss.ignore();
-      }
-      mesh.vertex(v[0], v[1], v[2]);
-      // cout << v[0] << "|" << v[1] << "|" << v[2] << endl;
-    } break;
-
-    case 1: {
-      std::stringstream ss(line);
-      int i;
-      if (ss >> i)
-        mesh.index(i);
-      else
+// Spring network over the icosphere: every vertex is pulled toward its rest
+// position (SK) and toward each of its neighbors (NK), with damping (D).
+//
+// Neighbor lists are stored as CSR (compressed sparse rows): the neighbors of
+// vertex i are neighbors[offsets[i] .. offsets[i + 1]), two flat arrays
+// instead of one allocation per vertex. step() computes force, velocity and
+// position of a vertex in a single pass, reading positions from p and writing
+// pNext, so the result is the same as computing all forces before moving any
+// vertex. Vertex ranges are stepped in parallel.
+struct SpringSolver {
+  vector<Vec3f> original;
+  vector<uint32_t> offsets; // numVertices + 1
+  vector<uint32_t> neighbors;
+
+  size_t size() const { return original.size(); }
+
+  void init(const IcoMeshData &data) {
+    init(data.vertices.data(), data.numVertices(), data.neighborOffsets.data(),
+         data.neighbors.data());
+  }
+
+  void init(const float *vertices, size_t numVertices,
+            const uint32_t *neighborOffsets, const uint32_t *neighborIndices) {
+    auto vec3 = reinterpret_cast<const Vec3f *>(vertices);
+    original.assign(vec3, vec3 + numVertices);
+    offsets.assign(neighborOffsets, neighborOffsets + numVertices + 1);
+    neighbors.assign(neighborIndices, neighborIndices + offsets.back());
+  }
+
+  void step(BlobSim &b, float sk, float nk, float d) const {
+    int n = size();
+    b.pNext.resize(n);
+    // Plain float arrays, so the per vertex arithmetic isn't hidden behind
+    // Vec3f temporaries. The operations are in the same order as the
+    // Vec3f version, which gives identical results.
+    const float *__restrict p = reinterpret_cast<const float *>(b.p.data());
+    const float *__restrict rest =
+        reinterpret_cast<const float *>(original.data());
+    float *__restrict vel = reinterpret_cast<float *>(b.velocity.data());
+    float *__restrict next = reinterpret_cast<float *>(b.pNext.data());
+    const uint32_t *off = offsets.data();
+    const uint32_t *nb = neighbors.data();
+
+    parallelFor(
+        n,
+        [=](int begin, int end) {
+          for (int i = begin; i < end; i++) {
+            const float x = p[3 * i], y = p[3 * i + 1], z = p[3 * i + 2];
+            float fx = (x - rest[3 * i]) * -sk;
+            float fy = (y - rest[3 * i + 1]) * -sk;
+            float fz = (z - rest[3 * i + 2]) * -sk;
+            const uint32_t kEnd = off[i + 1];
+            for (uint32_t k = off[i]; k < kEnd; k++) {
+              const float *q = p + 3 * nb[k];
+              fx += (x - q[0]) * -nk;
+              fy += (y - q[1]) * -nk;
+              fz += (z - q[2]) * -nk;
+            }
+            float vx = vel[3 * i], vy = vel[3 * i + 1], vz = vel[3 * i + 2];
+            fx -= vx * d;
+            fy -= vy * d;
+            fz -= vz * d;
+            vx += fx;
+            vy += fy;
+            vz += fz;
+            vel[3 * i] = vx;
+            vel[3 * i + 1] = vy;
+            vel[3 * i + 2] = vz;
+            next[3 * i] = x + vx;
+            next[3 * i + 1] = y + vy;
+            next[3 * i + 2] = z + vz;
+          }
+        },
+        4096);
+    b.p.swap(b.pNext);
+  }
+};
+
+// Load <N>.icob (memory mapped) if present, otherwise parse <N>.ico text, or
+// generate the icosphere if neither exists. Convert text files with ico2icob
+// for fast startup at large N.
+bool load(SearchPaths &searchPaths, int n, Mesh &mesh, SpringSolver &solver) {
+  IcoMeshFile file;
+  IcoMeshData text;
+  const float *vertices;
+  const uint32_t *indices, *offsets, *neighbors;
+  size_t numVertices, numIndices;
+
+  std::string binaryFile = std::to_string(n) + ".icob";
+  std::string textFile = std::to_string(n) + ".ico";
+  if (file.open(searchPaths.find(binaryFile).filepath())) {
+    vertices = file.vertices();
+    indices = file.indices();
+    offsets = file.neighborOffsets();
+    neighbors = file.neighbors();
+    numVertices = file.numVertices();
+    numIndices = file.numIndices();
+  } else {
+    if (!loadIcoText(searchPaths.find(textFile).filepath(), text)) {
+      if (icosphereSubdivisions(n) < 0) {
         return false;
-      // cout << i << endl;
-    } break;
-
-    case 2: {
-      std::vector<int> v;
-      std::stringstream ss(line);
-      int i;
-      while (ss >> i) {
-        v.push_back(i);
-        if (ss.peek() == ',')
-          ss.ignore();
       }
-      if ((v.size() != 5) && (v.size() != 6))
-        return false;
-      nn.push_back(v);
-      // cout << nn[nn.size() - 1].size() << endl;
-    } break;
+      generateIcosphere(icosphereSubdivisions(n), text);
     }
+    vertices = text.vertices.data();
+    indices = text.indices.data();
+    offsets = text.neighborOffsets.data();
+    neighbors = text.neighbors.data();
+    numVertices = text.numVertices();
+    numIndices = text.indices.size();
   }
-  file.close();
 
+  auto vec3 = reinterpret_cast<const Vec3f *>(vertices);
+  mesh.vertices().assign(vec3, vec3 + numVertices);
+  mesh.indices().assign(indices, indices + numIndices);
+  solver.init(vertices, numVertices, offsets, neighbors);
   return true;
 }
 
+// The previous solver: one neighbor vector per vertex, serial, forces and
+// positions in separate loops. Kept for comparison in benchmarkSprings().
+void stepNested(BlobSim &b, const vector<Vec3f> &original,
+                const vector<vector<int>> &nn, float SK, float NK, float D) {
+  auto &p = b.p;
+  auto &velocity = b.velocity;
+  for (int i = 0; i < (int)p.size(); i++) {
+    Vec3f &v = p[i];
+    Vec3f force = (v - original[i]) * -SK;
+    for (int k = 0; k < nn[i].size(); k++) {
+      Vec3f &n = p[nn[i][k]];
+      force += (v - n) * -NK;
+    }
+    force -= velocity[i] * D;
+    velocity[i] += force;
+  }
+  for (int i = 0; i < (int)p.size(); i++) {
+    p[i] += velocity[i];
+  }
+}
+
+// Steps per second of both solvers for every icosphere size, and the largest
+// difference between their positions after the same number of steps
+void benchmarkSprings(float SK, float NK, float D) {
+  const int sizes[] = {162, 642, 2562, 10242, 40962, 163842, 655362};
+  for (int numVertices : sizes) {
+    IcoMeshData data;
+    generateIcosphere(icosphereSubdivisions(numVertices), data);
+    SpringSolver solver;
+    solver.init(data);
+    vector<vector<int>> nn(numVertices);
+    for (int i = 0; i < numVertices; i++)
+      nn[i].assign(solver.neighbors.begin() + solver.offsets[i],
+                   solver.neighbors.begin() + solver.offsets[i + 1]);
+
+    BlobSim initial;
+    initial.p = solver.original;
+    initial.velocity.assign(numVertices, Vec3f(0, 0, 0));
+    for (auto &v : initial.p)
+      v += Vec3f(rnd::uniformS(), rnd::uniformS(), rnd::uniformS()) * 0.1f;
+
+    // Enough steps for about 20M vertex updates
+    int numSteps = std::max(10, 20000000 / numVertices);
+    BlobSim nested = initial, csr = initial;
+    auto t0 = std::chrono::steady_clock::now();
+    for (int s = 0; s < numSteps; s++)
+      stepNested(nested, solver.original, nn, SK, NK, D);
+    auto t1 = std::chrono::steady_clock::now();
+    for (int s = 0; s < numSteps; s++)
+      solver.step(csr, SK, NK, D);
+    auto t2 = std::chrono::steady_clock::now();
+
+    float maxDiff = 0;
+    for (int i = 0; i < numVertices; i++)
+      maxDiff = std::max(maxDiff, (nested.p[i] - csr.p[i]).mag());
+    double nestedRate =
+        numSteps / std::chrono::duration<double>(t1 - t0).count();
+    double csrRate = numSteps / std::chrono::duration<double>(t2 - t1).count();
+    std::cout << "N = " << numVertices << ": nested " << nestedRate
+              << " steps/s, CSR " << csrRate << " steps/s ("
+              << csrRate / nestedRate << "x), max difference " << maxDiff
+              << std::endl;
+  }
+}
+
 #ifdef AL_WINDOWS
 // Damn you Windows!
 #undef near
@@ -134,18 +323,56 @@ struct Blob : DistributedAppWithState<State> {
   // Internal computation data
   // This data will not be shared to remote nodes, so you should only use it on
   // the simulator machine
-  vector<vector<int>> nn;
-  vector<Vec3f> velocity;
-  vector<Vec3f> original;
+  SpringSolver solver;
 
   // a boolean value that is read and reset (false) by the simulation step and
   // written (true) by audio, keyboard and mouse callbacks.
-  bool shouldPoke;
-  unsigned pokedVertex;
-  Vec3f pokedVertexRest;
+  std::atomic<bool> shouldPoke{false};
+  std::atomic<unsigned> pokedVertex{0};
+
+  // Steps BlobSim, publishes vertex positions
+  FixedStepSimulation<BlobSim, vector<Vec3f>> sim;
 
-  // a mesh we use to do graphics rendering in this app
+  // icosphere loaded from file. Its vertices hold the positions on the
+  // primary and decoded positions on renderers.
   Mesh mesh;
+  // Draws positions from wherever they are (mesh, received state, smoothed
+  // frame) without copying them into a Mesh first
+  StreamingMesh drawMesh;
+
+#if STATE_CODEC
+  // Encodes positions on the primary, decodes them on renderers
+  QuantizedArrayCodec codec;
+#endif
+#if CHUNKED_STATE
+  UdpChannel channel;
+  ChunkedStateSender sender;
+  ChunkedStateReceiver receiver;
+  vector<uint8_t> encoded;
+  bool positionsDecoded{false}; // Since the last readPositions()
+#endif
+  unsigned frameCount{0};
+  // Printed when run by tools/cluster/local_cluster.py
+  NodeStats nodeStats;
+
+#if SMOOTH_STATE
+  // Pose and positions on renderers
+  struct Frame {
+    Pose pose;
+    vector<Vec3f> p;
+  };
+  Frame received;
+  Frame shown;
+  double receivedTime{0};
+  StateSmoother<Frame> smoother{
+      [](const Frame &a, const Frame &b, float t, Frame &out) {
+        out.pose = lerpPose(a.pose, b.pose, t);
+        out.p.resize(b.p.size());
+        lerpArray(reinterpret_cast<const float *>(a.p.data()),
+                  reinterpret_cast<const float *>(b.p.data()), t,
+                  reinterpret_cast<float *>(out.p.data()), 3 * b.p.size());
+      }};
+#endif
 
   gam::NoisePink<> pinkNoise;
 
@@ -158,23 +385,42 @@ struct Blob : DistributedAppWithState<State> {
     searchPaths.addSearchPath("/alloshare/blob", false);
     searchPaths.addAppPaths();
 
-    std::string icoSphereFile = std::to_string(N) + ".ico";
-
-    if (!load(searchPaths.find(icoSphereFile).filepath(), mesh, nn)) {
-      std::cout << "cannot find " << icoSphereFile << std::endl;
+    if (!load(searchPaths, N, mesh, solver)) {
+      std::cout << "cannot find " << N << ".icob or " << N << ".ico"
+                << std::endl;
       quit();
     }
+#if CHUNKED_STATE
+    bool channelOpen =
+        isPrimary() ? channel.openSender(CHUNKED_STATE_ADDRESS,
+                                         CHUNKED_STATE_PORT)
+                    : channel.openReceiver(CHUNKED_STATE_PORT);
+    if (!channelOpen) {
+      std::cerr << "ERROR: Could not open port " << CHUNKED_STATE_PORT
+                << std::endl;
+    }
+#if STATE_CODEC
+    encoded.resize(QuantizedArrayCodec::maxEncodedSize(N));
+    receiver.resize(encoded.size());
+#else
+    receiver.resize(sizeof(Vec3f) * N);
+#endif
+#elif STATE_CODEC
+    codec.deltas = false;
+#endif
     if (isPrimary()) {
       shouldPoke = true; // start with a poke
 
       // Initialize simulation data
-      velocity.resize(mesh.vertices().size(), Vec3f(0, 0, 0));
-      original.resize(mesh.vertices().size());
-      for (int i = 0; i < mesh.vertices().size(); i++)
-        original[i] = mesh.vertices()[i];
+      writePositions(solver.original.data());
+
+      BlobSim initial;
+      initial.p.assign(solver.original.begin(), solver.original.begin() + N);
+      initial.velocity.resize(N, Vec3f(0, 0, 0));
+      sim.start(
+          initial, 60, [this](BlobSim &b, double) { step(b); },
+          [](const BlobSim &b, vector<Vec3f> &p) { p = b.p; });
 
-      for (int i = 0; i < N; i++)
-        state().p[i] = original[i];
       state().eyeSeparation = 0.03;
       state().backgroundColor = Color(0.1f, 0.1f);
       state().wireFrame = true;
@@ -195,54 +441,201 @@ struct Blob : DistributedAppWithState<State> {
     }
   }
 
-  //  void onCreate() override {}
-
-  void onAnimate(double dt) override {
-
-    if (isPrimary()) {
-
-      if (shouldPoke) {
-        shouldPoke = false;
-        int n = al::rnd::uniform(N);
-        pokedVertex = n;
-        pokedVertexRest = original[n];
-        Vec3f v = Vec3f(rnd::uniformS(), rnd::uniformS(), rnd::uniformS());
-        for (unsigned k = 0; k < nn[n].size(); k++)
-          state().p[nn[n][k]] += v * 0.5;
-        state().p[n] += v;
-      }
+  void onCreate() override {
+    drawMesh.primitive(GL_TRIANGLES);
+    drawMesh.indices(mesh.indices());
+  }
 
-      // Compute new postions
-      for (int i = 0; i < N; i++) {
-        Vec3f &v = state().p[i];
-        Vec3f force = (v - original[i]) * -SK;
+  // Simulation thread
+  void step(BlobSim &b) {
+    auto &p = b.p;
+
+    if (shouldPoke.exchange(false)) {
+      int n = al::rnd::uniform(N);
+      pokedVertex = n;
+      Vec3f v = Vec3f(rnd::uniformS(), rnd::uniformS(), rnd::uniformS());
+      for (uint32_t k = solver.offsets[n]; k < solver.offsets[n + 1]; k++)
+        p[solver.neighbors[k]] += v * 0.5;
+      p[n] += v;
+    }
 
-        for (int k = 0; k < nn[i].size(); k++) {
-          Vec3f &n = state().p[nn[i][k]];
-          force += (v - n) * -NK;
-        }
+    // Compute new postions
+    solver.step(b, SK, NK, D);
+  }
 
-        force -= velocity[i] * D;
-        velocity[i] += force;
-      }
+  void onAnimate(double dt) override {
 
+    if (isPrimary()) {
+      // Interpolate between the last two simulation steps
+      sim.update();
+      const auto &prev = sim.previous();
+      const auto &curr = sim.current();
+      float alpha = sim.alpha();
+      auto &vertices = mesh.vertices();
       for (int i = 0; i < N; i++) {
-        state().p[i] += velocity[i];
+        vertices[i] = prev[i] + (curr[i] - prev[i]) * alpha;
       }
+      size_t positionBytes = writePositions(vertices.data());
+      drawMesh.positions(vertices.data(), N);
 
       // Update variables in state to send to nodes
       state().pose = nav();
+      state().time = stateTime();
+      state().frame = frameCount;
       state().backgroundColor = bgColor;
       state().wireFrame = wireFrame;
+      nodeStats.sent(sizeof(State) + positionBytes);
 
     } else {
       // For remote nodes, update pose and color from state
-      pose() = state().pose;
       bgColor = state().backgroundColor;
       wireFrame = state().wireFrame;
+      nodeStats.received(state().frame, state().time, sizeof(State));
+#if SMOOTH_STATE
+      // Encoded positions are decoded straight into the frame, which is
+      // then swapped into the smoother without another copy
+      received.p.resize(N);
+      Vec3f *decoded = received.p.data();
+#else
+      Vec3f *decoded = mesh.vertices().data();
+#endif
+#if CHUNKED_STATE
+      pollPositions(decoded);
+#endif
+#if SMOOTH_STATE
+      if (state().time != receivedTime) {
+        receivedTime = state().time;
+        received.pose = state().pose;
+        const Vec3f *positions = readPositions(decoded);
+        if (!positions && smoother.latest()) {
+          positions = smoother.latest()->p.data(); // Keep the previous ones
+        }
+        if (positions) {
+          if (positions != received.p.data()) {
+            received.p.assign(positions, positions + N);
+          }
+          smoother.receive(state().time, std::move(received));
+        }
+      }
+      if (smoother.sample(shown)) {
+        pose() = shown.pose;
+        drawMesh.positions(shown.p.data(), N);
+      }
+#else
+      pose() = state().pose;
+      if (const Vec3f *positions = readPositions(decoded)) {
+        drawMesh.positions(positions, N);
+      }
+#endif
+    }
+
+    if (++frameCount % 600 == 0) {
+      printStats();
     }
-    // Copy vertex positions from state to mesh
-    memcpy(&mesh.vertices()[0], &state().p[0], sizeof(Vec3f) * N);
+  }
+
+  // Vertex positions to state, on the primary. Returns the bytes sent
+  // outside the state, 0 if the positions are part of it.
+  size_t writePositions(const Vec3f *positions) {
+    auto values = reinterpret_cast<const float *>(positions);
+#if CHUNKED_STATE && STATE_CODEC
+    size_t bytes = codec.encode(values, N, encoded.data());
+    sender.send(encoded.data(), bytes, channel);
+    return sender.bytesSent();
+#elif CHUNKED_STATE
+    sender.send(values, sizeof(Vec3f) * N, channel);
+    return sender.bytesSent();
+#elif STATE_CODEC
+    codec.encode(values, N, state().p);
+    return 0;
+#else
+    memcpy(&state().p[0], values, sizeof(Vec3f) * N);
+    return 0;
+#endif
+  }
+
+#if CHUNKED_STATE
+  // Position chunks, on renderers every onAnimate(). Reading them only when
+  // the cuttlebone state changes would let the socket buffer overflow while
+  // cuttlebone stalls. Encoded frames are decoded into decoded as they
+  // complete, so delta frames are not skipped.
+  void pollPositions(Vec3f *decoded) {
+#if STATE_CODEC
+    if (receiver.poll(channel) && receiver.frameComplete() &&
+        codec.decode(receiver.data(), receiver.size(), N,
+                     reinterpret_cast<float *>(decoded))) {
+      positionsDecoded = true;
+    }
+#else
+    (void)decoded;
+    receiver.poll(channel);
+#endif
+  }
+#endif
+
+  // Vertex positions from state, on renderers. Uncompressed positions are
+  // used where they were received, encoded ones are decoded into decoded
+  // (with CHUNKED_STATE, the buffer last given to pollPositions()).
+  // Returns nullptr if there are no new positions that can be decoded.
+  const Vec3f *readPositions(Vec3f *decoded) {
+#if CHUNKED_STATE && STATE_CODEC
+    if (!positionsDecoded) {
+      return nullptr;
+    }
+    positionsDecoded = false;
+    return decoded;
+#elif CHUNKED_STATE
+    return reinterpret_cast<const Vec3f *>(receiver.data());
+#elif STATE_CODEC
+    if (codec.decode(state().p, sizeof(state().p), N,
+                     reinterpret_cast<float *>(decoded))) {
+      return decoded;
+    }
+    return nullptr;
+#else
+    return state().p;
+#endif
+  }
+
+  void printStats() {
+#if SMOOTH_STATE
+    if (!isPrimary()) {
+      const auto &stats = smoother.stats();
+      std::cout << "State latency " << stats.latency * 1000 << " ms, jitter "
+                << stats.jitter * 1000 << " ms, " << stats.framesLate
+                << " late frames, " << stats.samplesExtrapolated
+                << " extrapolated, " << stats.samplesHeld << " held"
+                << std::endl;
+      smoother.resetStats();
+    }
+#endif
+#if STATE_CODEC
+    std::cout << "State positions: " << codec.averageSize()
+              << " bytes/frame encoded, "
+#if CHUNKED_STATE
+              << codec.averageSize()
+#else
+              << sizeof(State)
+#endif
+              << " sent (" << sizeof(Vec3f) * N
+              << " uncompressed), error bound " << codec.errorBound();
+    if (!isPrimary()) {
+      std::cout << ", " << codec.missedFrames() << " frames missed";
+    }
+    std::cout << std::endl;
+    codec.resetStats();
+#endif
+#if CHUNKED_STATE
+    if (!isPrimary()) {
+      const auto &stats = receiver.stats();
+      std::cout << "Chunked positions: " << stats.framesComplete
+                << " complete frames, " << stats.framesPartial
+                << " partial frames, " << stats.chunksMissing
+                << " chunks kept from earlier frames, " << stats.packetsLate
+                << " late packets" << std::endl;
+      receiver.resetStats();
+    }
+#endif
   }
 
   void onDraw(Graphics &g) override {
@@ -258,7 +651,7 @@ struct Blob : DistributedAppWithState<State> {
     } else {
       g.polygonFill();
     }
-    g.draw(mesh);
+    drawMesh.draw(g);
     g.popMatrix();
   }
 
@@ -275,7 +668,10 @@ struct Blob : DistributedAppWithState<State> {
           }
         }
 
-        float f = (state().p[pokedVertex] - pokedVertexRest).mag() - 0.45;
+        float f =
+            (mesh.vertices()[pokedVertex] - solver.original[pokedVertex])
+                .mag() -
+            0.45;
 
         if (f > 0.99) {
           f = 0.99;
@@ -293,6 +689,12 @@ struct Blob : DistributedAppWithState<State> {
   }
 
   bool onKeyDown(const Keyboard &k) override {
+    if (k.key() == 'b' && isPrimary()) {
+      // Runs on the simulation thread, which pauses meanwhile
+      float sk = SK, nk = NK, d = D;
+      sim.post([=](BlobSim &) { benchmarkSprings(sk, nk, d); });
+      return false;
+    }
     shouldPoke = true;
     return false;
   }
@@ -301,6 +703,8 @@ struct Blob : DistributedAppWithState<State> {
     shouldPoke = true;
     return false;
   }
+
+  void onExit() override { sim.stop(); }
 };
 
 int main() {
@@ -0,0 +1,447 @@
+#pragma once
+#ifndef ChunkedState_H
+#define ChunkedState_H
+
+// State broadcast in numbered chunks, with partial frame recovery.
+//
+// Sending a large State as one frame means a single lost UDP packet loses
+// the whole frame on a renderer, which then stalls until a frame arrives
+// intact. At 7.8 MB (5600 packets) and 0.1% packet loss, almost no frame
+// arrives complete.
+//
+// ChunkedStateSender splits each frame into chunks of at most chunkSize
+// bytes. Every packet carries the frame number and the chunk index, so it
+// can be placed on its own. ChunkedStateReceiver assembles chunks into the
+// back buffer of a double buffer. A frame is published when all its chunks
+// have arrived, or when chunks of a newer frame arrive. Chunks that never
+// arrived keep the value from the previously published frame, so loss
+// shows as parts of the state being one or more frames old instead of a
+// stall. Packets of frames older than the one being assembled are dropped.
+//
+// This is only safe for state that stays meaningful when mixed at chunk
+// granularity, e.g. arrays of positions. Check frameComplete() before using
+// data that must be consistent as a whole (such as QuantizedArrayCodec
+// output).
+//
+// Packets go through a PacketChannel: UdpChannel for the network, or
+// LoopbackChannel, an in-process stand-in with configurable loss, latency
+// and jitter for testing.
+//
+// Receivers should poll() every frame, independent of any other state
+// transport: packets that arrive between polls wait in the socket's receive
+// buffer, and are dropped once it is full.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+class PacketChannel {
+public:
+  virtual ~PacketChannel() = default;
+  virtual bool send(const void *data, size_t bytes) = 0;
+  // Copies the next pending packet into buffer. Returns its size, or 0 if
+  // there is none. Doesn't block.
+  virtual size_t receive(void *buffer, size_t maxBytes) = 0;
+};
+
+struct ChunkHeader {
+  uint32_t magic;      // kChunkMagic
+  uint32_t frame;      // Frame number
+  uint32_t chunk;      // Chunk index
+  uint32_t numChunks;  // Chunks sent for this frame
+  uint32_t chunkSize;  // Bytes per chunk, all but the last are full
+  uint32_t frameBytes; // Bytes sent for this frame
+};
+
+static const uint32_t kChunkMagic = 0x54534843; // "CHST"
+
+class ChunkedStateSender {
+public:
+  // Payload per packet. 1400 keeps packets within a 1500 byte MTU.
+  size_t chunkSize = 1400;
+
+  // Send the first bytes of state as one frame. bytes can change from frame
+  // to frame (e.g. only the used part of an encoded array), the rest keeps
+  // its previous value on the receivers. Returns the number of packets sent.
+  size_t send(const void *state, size_t bytes, PacketChannel &channel) {
+    const uint8_t *data = static_cast<const uint8_t *>(state);
+    ChunkHeader header;
+    header.magic = kChunkMagic;
+    header.frame = mFrame++;
+    header.numChunks = uint32_t((bytes + chunkSize - 1) / chunkSize);
+    header.chunkSize = uint32_t(chunkSize);
+    header.frameBytes = uint32_t(bytes);
+    mPacket.resize(sizeof(ChunkHeader) + chunkSize);
+    size_t sent = 0;
+    mBytesSent = 0;
+    for (uint32_t c = 0; c < header.numChunks; c++) {
+      size_t offset = c * chunkSize;
+      size_t len = std::min(chunkSize, bytes - offset);
+      header.chunk = c;
+      memcpy(mPacket.data(), &header, sizeof(ChunkHeader));
+      memcpy(mPacket.data() + sizeof(ChunkHeader), data + offset, len);
+      if (channel.send(mPacket.data(), sizeof(ChunkHeader) + len)) {
+        sent++;
+        mBytesSent += sizeof(ChunkHeader) + len;
+      }
+    }
+    return sent;
+  }
+
+  uint32_t frame() const { return mFrame; }
+  // Bytes the last send() put on the network, chunk headers included
+  size_t bytesSent() const { return mBytesSent; }
+
+private:
+  uint32_t mFrame{0};
+  size_t mBytesSent{0};
+  std::vector<uint8_t> mPacket;
+};
+
+class ChunkedStateReceiver {
+public:
+  struct Stats {
+    uint64_t framesComplete{0};
+    uint64_t framesPartial{0};  // Published with chunks missing
+    uint64_t chunksReceived{0};
+    uint64_t chunksMissing{0};  // Kept from a previous frame
+    uint64_t packetsLate{0};    // For a frame already published
+    uint64_t packetsInvalid{0};
+  };
+
+  // bytes is the size of the state. The initial state is all zeros.
+  explicit ChunkedStateReceiver(size_t bytes = 0) { resize(bytes); }
+
+  void resize(size_t bytes) {
+    mBuffers[0].assign(bytes, 0);
+    mBuffers[1].assign(bytes, 0);
+    mFront = 0;
+    mAssembling = false;
+    mPublished = false;
+    mFrameComplete = false;
+    mChunkSize = 0;
+    mChunkFrame[0].clear();
+    mChunkFrame[1].clear();
+  }
+
+  size_t size() const { return mBuffers[0].size(); }
+
+  // Latest published frame
+  const uint8_t *data() const { return mBuffers[mFront].data(); }
+  uint32_t frame() const { return mFrontFrame; }
+  // True if no chunk of the latest frame was missing
+  bool frameComplete() const { return mFrameComplete; }
+
+  // Read all pending packets. Returns true if a new frame was published.
+  bool poll(PacketChannel &channel) {
+    bool published = false;
+    mPacket.resize(65536);
+    size_t bytes;
+    while ((bytes = channel.receive(mPacket.data(), mPacket.size())) > 0) {
+      published |= receive(mPacket.data(), bytes);
+    }
+    return published;
+  }
+
+  // Handle one packet. Returns true if a frame was published.
+  bool receive(const uint8_t *packet, size_t bytes) {
+    ChunkHeader header;
+    if (bytes < sizeof(ChunkHeader)) {
+      mStats.packetsInvalid++;
+      return false;
+    }
+    memcpy(&header, packet, sizeof(ChunkHeader));
+    size_t offset = size_t(header.chunk) * header.chunkSize;
+    size_t len = bytes - sizeof(ChunkHeader);
+    if (header.magic != kChunkMagic || header.chunkSize == 0 || len == 0 ||
+        header.chunk >= header.numChunks || offset + len > size() ||
+        header.frameBytes > size()) {
+      mStats.packetsInvalid++;
+      return false;
+    }
+
+    bool published = false;
+    if (mPublished && int32_t(header.frame - mFrontFrame) <= 0) {
+      if (int32_t(header.frame - mFrontFrame) > -kRestartFrames) {
+        mStats.packetsLate++;
+        return false;
+      }
+      // Far in the past, the sender was restarted
+      mPublished = false;
+      mAssembling = false;
+    }
+    if (mAssembling && header.frame != mBackFrame) {
+      if (int32_t(header.frame - mBackFrame) < 0) {
+        mStats.packetsLate++;
+        return false;
+      }
+      publish(); // Newer frame started, give up on the missing chunks
+      published = true;
+    }
+    if (header.chunkSize != mChunkSize) {
+      // New layout. Mark all chunks as differing between the buffers, so
+      // the next publish() copies whatever wasn't received.
+      mChunkSize = header.chunkSize;
+      size_t numChunks = (size() + mChunkSize - 1) / mChunkSize;
+      mChunkFrame[mFront].assign(numChunks, uint32_t(kNoFrame));
+      mChunkFrame[1 - mFront].assign(numChunks, uint32_t(kNoFrame - 1));
+      mAssembling = false;
+    }
+    if (header.chunk >= mChunkFrame[1 - mFront].size()) {
+      mStats.packetsInvalid++;
+      return published;
+    }
+    if (!mAssembling) {
+      mAssembling = true;
+      mBackFrame = header.frame;
+      mBackChunks = header.numChunks;
+      mBackReceived = 0;
+    }
+
+    uint32_t &chunkFrame = mChunkFrame[1 - mFront][header.chunk];
+    if (chunkFrame != header.frame) {
+      chunkFrame = header.frame;
+      memcpy(mBuffers[1 - mFront].data() + offset,
+             packet + sizeof(ChunkHeader), len);
+      mBackReceived++;
+      mStats.chunksReceived++;
+    }
+    if (mBackReceived == mBackChunks) {
+      publish();
+      published = true;
+    }
+    return published;
+  }
+
+  const Stats &stats() const { return mStats; }
+  void resetStats() { mStats = Stats(); }
+
+private:
+  static const uint32_t kNoFrame = 0xffffffff;
+  static const int32_t kRestartFrames = 600;
+
+  // Fill chunks missing from the back buffer from the front one, then swap.
+  // Each buffer records which frame every chunk came from, so chunks that
+  // already hold the same data (e.g. an unused tail) aren't copied.
+  void publish() {
+    const uint8_t *front = mBuffers[mFront].data();
+    uint8_t *back = mBuffers[1 - mFront].data();
+    const auto &frontFrames = mChunkFrame[mFront];
+    auto &backFrames = mChunkFrame[1 - mFront];
+    for (size_t c = 0; c < backFrames.size(); c++) {
+      if (backFrames[c] != mBackFrame && backFrames[c] != frontFrames[c]) {
+        size_t offset = c * mChunkSize;
+        size_t len = std::min(size_t(mChunkSize), size() - offset);
+        memcpy(back + offset, front + offset, len);
+        backFrames[c] = frontFrames[c];
+      }
+    }
+    mFrameComplete = mBackReceived == mBackChunks;
+    if (mFrameComplete) {
+      mStats.framesComplete++;
+    } else {
+      mStats.framesPartial++;
+      mStats.chunksMissing += mBackChunks - mBackReceived;
+    }
+    mFront = 1 - mFront;
+    mFrontFrame = mBackFrame;
+    mPublished = true;
+    mAssembling = false;
+  }
+
+  std::vector<uint8_t> mBuffers[2];
+  int mFront{0};
+  uint32_t mFrontFrame{0};
+  bool mPublished{false};
+  bool mFrameComplete{false};
+
+  bool mAssembling{false};
+  uint32_t mBackFrame{0};
+  uint32_t mBackChunks{0};
+  uint32_t mBackReceived{0};
+  uint32_t mChunkSize{0};
+  std::vector<uint32_t> mChunkFrame[2]; // Frame each chunk's data is from
+
+  std::vector<uint8_t> mPacket;
+  Stats mStats;
+};
+
+// In-process channel that drops, delays and reorders packets. Thread safe,
+// so sender and receiver can run on different threads.
+class LoopbackChannel : public PacketChannel {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  float lossRate = 0;   // Probability of dropping a packet
+  double latency = 0;   // Seconds
+  double jitter = 0;    // Extra random delay up to this many seconds
+  size_t capacity = 1 << 20; // Packets queued beyond this are dropped
+
+  explicit LoopbackChannel(unsigned seed = 1) : mRandom(seed) {}
+
+  bool send(const void *data, size_t bytes) override {
+    std::lock_guard<std::mutex> lock(mMutex);
+    std::uniform_real_distribution<double> uniform(0, 1);
+    if (uniform(mRandom) < lossRate || mQueue.size() >= capacity) {
+      mDropped++;
+      return true; // Lost on the way, the sender can't tell
+    }
+    Packet p;
+    p.due = Clock::now() + std::chrono::duration_cast<Clock::duration>(
+                               std::chrono::duration<double>(
+                                   latency + jitter * uniform(mRandom)));
+    const uint8_t *bytesIn = static_cast<const uint8_t *>(data);
+    p.data.assign(bytesIn, bytesIn + bytes);
+    // Keep the queue sorted by due time, jitter reorders packets
+    auto it = mQueue.end();
+    while (it != mQueue.begin() && (it - 1)->due > p.due) {
+      --it;
+    }
+    mQueue.insert(it, std::move(p));
+    return true;
+  }
+
+  size_t receive(void *buffer, size_t maxBytes) override {
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (mQueue.empty() || mQueue.front().due > Clock::now()) {
+      return 0;
+    }
+    Packet &p = mQueue.front();
+    size_t bytes = std::min(maxBytes, p.data.size());
+    memcpy(buffer, p.data.data(), bytes);
+    mQueue.pop_front();
+    return bytes;
+  }
+
+  uint64_t dropped() const { return mDropped; }
+
+private:
+  struct Packet {
+    Clock::time_point due;
+    std::vector<uint8_t> data;
+  };
+
+  std::deque<Packet> mQueue;
+  std::mutex mMutex;
+  std::mt19937 mRandom;
+  uint64_t mDropped{0};
+};
+
+#ifndef _WIN32
+// UDP broadcast. The sender sends to address:port, receivers listen on port.
+class UdpChannel : public PacketChannel {
+public:
+  ~UdpChannel() { close(); }
+
+  bool openSender(const std::string &address = "255.255.255.255",
+                  uint16_t port = 63060) {
+    close();
+    mSocket = socket(AF_INET, SOCK_DGRAM, 0);
+    if (mSocket < 0) {
+      return false;
+    }
+    int on = 1;
+    setsockopt(mSocket, SOL_SOCKET, SO_BROADCAST, &on, sizeof(on));
+    int bufferSize = 8 << 20;
+    setsockopt(mSocket, SOL_SOCKET, SO_SNDBUF, &bufferSize,
+               sizeof(bufferSize));
+    memset(&mDestination, 0, sizeof(mDestination));
+    mDestination.sin_family = AF_INET;
+    mDestination.sin_port = htons(port);
+    if (inet_pton(AF_INET, address.c_str(), &mDestination.sin_addr) != 1) {
+      close();
+      return false;
+    }
+    return true;
+  }
+
+  bool openReceiver(uint16_t port = 63060) {
+    close();
+    mSocket = socket(AF_INET, SOCK_DGRAM, 0);
+    if (mSocket < 0) {
+      return false;
+    }
+    int on = 1;
+    setsockopt(mSocket, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    // Room for a few large frames, so a slow frame doesn't overflow the
+    // socket buffer. Linux silently caps SO_RCVBUF at net.core.rmem_max
+    // (usually ~208 KB), so check what was granted.
+    int bufferSize = 32 << 20;
+    setsockopt(mSocket, SOL_SOCKET, SO_RCVBUF, &bufferSize,
+               sizeof(bufferSize));
+#ifdef SO_RCVBUFFORCE
+    if (receiveBufferSize() < bufferSize) {
+      // Ignores the limit, but needs CAP_NET_ADMIN
+      setsockopt(mSocket, SOL_SOCKET, SO_RCVBUFFORCE, &bufferSize,
+                 sizeof(bufferSize));
+    }
+#endif
+    if (receiveBufferSize() < bufferSize) {
+      std::cerr << "WARNING: UDP receive buffer is "
+                << receiveBufferSize() / 1024 << " KB instead of "
+                << bufferSize / 1024 << " KB, large frames will lose "
+                << "packets. Raise it with sysctl -w net.core.rmem_max="
+                << bufferSize << std::endl;
+    }
+    sockaddr_in local;
+    memset(&local, 0, sizeof(local));
+    local.sin_family = AF_INET;
+    local.sin_port = htons(port);
+    local.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(mSocket, (sockaddr *)&local, sizeof(local)) != 0) {
+      close();
+      return false;
+    }
+    fcntl(mSocket, F_SETFL, fcntl(mSocket, F_GETFL, 0) | O_NONBLOCK);
+    return true;
+  }
+
+  void close() {
+    if (mSocket >= 0) {
+      ::close(mSocket);
+      mSocket = -1;
+    }
+  }
+
+  bool isOpen() const { return mSocket >= 0; }
+
+  // Bytes the kernel actually gave the socket for received packets
+  int receiveBufferSize() const {
+    int size = 0;
+    socklen_t length = sizeof(size);
+    getsockopt(mSocket, SOL_SOCKET, SO_RCVBUF, &size, &length);
+    return size;
+  }
+
+  bool send(const void *data, size_t bytes) override {
+    return sendto(mSocket, data, bytes, 0, (sockaddr *)&mDestination,
+                  sizeof(mDestination)) == (ssize_t)bytes;
+  }
+
+  size_t receive(void *buffer, size_t maxBytes) override {
+    ssize_t n = recv(mSocket, buffer, maxBytes, 0);
+    return n > 0 ? size_t(n) : 0;
+  }
+
+private:
+  int mSocket{-1};
+  sockaddr_in mDestination;
+};
+#endif
+
+#endif
@@ -0,0 +1,130 @@
+#pragma once
+#ifndef NodeStats_H
+#define NodeStats_H
+
+// Per node state distribution statistics, printed as one line per interval
+// for tools/cluster/local_cluster.py to collect.
+//
+// The primary numbers its state frames and stamps them with stateTime()
+// (see StateSmoother.hpp), and calls sent() once per frame. Renderers call
+// received() once per onAnimate() with the frame number and time found in
+// their state. From those a renderer counts distinct frames, frames that
+// never showed up (gaps in the numbering) and the latency from the primary
+// writing a frame to the renderer seeing it. Latency is only meaningful
+// when both clocks agree, e.g. for processes on the same machine.
+//
+// Nothing is printed unless enabled with enable() or the AL_NODE_STATS
+// environment variable. Lines look like
+//
+//   NODESTATS role=renderer pid=1234 time=5.00 fps=59.9 frames=60 dropped=0
+//     bytes_per_s=4718592 latency_ms=1.21 latency_max_ms=3.05
+//
+// (on one line).
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+class NodeStats {
+public:
+  explicit NodeStats(double interval = 1.0) : mInterval(interval) {
+    mEnabled = getenv("AL_NODE_STATS") != nullptr;
+  }
+
+  void enable(bool on = true) { mEnabled = on; }
+  bool enabled() const { return mEnabled; }
+
+  // Primary, once per state frame
+  void sent(size_t bytes) {
+    if (!mEnabled) {
+      return;
+    }
+    mRole = "primary";
+    mFrames++;
+    mBytes += bytes;
+    report();
+  }
+
+  // Renderer, once per onAnimate(). sendTime is the stateTime() the primary
+  // stamped on the frame, 0 if nothing was received yet.
+  void received(uint32_t frame, double sendTime, size_t bytes) {
+    if (!mEnabled) {
+      return;
+    }
+    mRole = "renderer";
+    if (sendTime > 0 && (!mHasFrame || frame != mLastFrame)) {
+      if (mHasFrame && int32_t(frame - mLastFrame) > 1) {
+        mDropped += frame - mLastFrame - 1;
+      }
+      mHasFrame = true;
+      mLastFrame = frame;
+      mFrames++;
+      mBytes += bytes;
+      double latency = now() - sendTime;
+      mLatencySum += latency;
+      mLatencyMax = std::max(mLatencyMax, latency);
+    }
+    report();
+  }
+
+private:
+  static double now() {
+    return std::chrono::duration<double>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+  }
+
+  void report() {
+    double t = now();
+    if (mStart == 0) {
+      mStart = mIntervalStart = t;
+      return;
+    }
+    double elapsed = t - mIntervalStart;
+    if (elapsed < mInterval) {
+      return;
+    }
+    int pid = 0;
+#ifndef _WIN32
+    pid = int(getpid());
+#endif
+    printf("NODESTATS role=%s pid=%d time=%.2f fps=%.1f frames=%llu "
+           "dropped=%llu bytes_per_s=%.0f latency_ms=%.3f "
+           "latency_max_ms=%.3f\n",
+           mRole.c_str(), pid, t - mStart, mFrames / elapsed,
+           (unsigned long long)mFrames, (unsigned long long)mDropped,
+           mBytes / elapsed, mFrames ? 1000 * mLatencySum / mFrames : 0.0,
+           1000 * mLatencyMax);
+    fflush(stdout);
+    mIntervalStart = t;
+    mFrames = 0;
+    mDropped = 0;
+    mBytes = 0;
+    mLatencySum = 0;
+    mLatencyMax = 0;
+  }
+
+  double mInterval;
+  bool mEnabled{false};
+  std::string mRole{"unknown"};
+
+  double mStart{0};
+  double mIntervalStart{0};
+  uint64_t mFrames{0};
+  uint64_t mDropped{0};
+  double mBytes{0};
+  double mLatencySum{0};
+  double mLatencyMax{0};
+
+  bool mHasFrame{false};
+  uint32_t mLastFrame{0};
+};
+
+#endif
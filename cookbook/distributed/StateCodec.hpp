@@ -0,0 +1,399 @@
+#pragma once
+#ifndef StateCodec_H
+#define StateCodec_H
+
+// Quantized delta codec for large float arrays in distributed state, e.g.
+// vertex positions in a DistributedAppWithState State struct.
+//
+// A State with Vec3f p[655362] is 7.8 MB per frame. The codec reduces that in
+// three steps:
+//
+//  1. Quantization. Each component is stored as a 16 bit integer relative to
+//     a bounding box, so a frame is at most 6 bytes per Vec3f. The
+//     reconstruction error is at most half a quantization step, reported by
+//     errorBound().
+//  2. Delta. Frames are sent as differences to the last keyframe. Keyframes
+//     are sent every keyframeInterval frames, or as soon as a value leaves
+//     the keyframe's bounding box. Deltas are taken against the keyframe
+//     rather than the previous frame, so a renderer that misses frames can
+//     decode deltas again as soon as it has the keyframe, but not before:
+//     one that misses a keyframe drops every frame up to the next one.
+//  3. Bit packing. Zigzag coded deltas are packed in blocks of 16 values with
+//     the bit width of the largest one, one byte per block for the width.
+//     Slowly changing data packs to a few bits per value, unchanged data to
+//     one byte per block. If packing doesn't pay off, the frame is sent as
+//     plain 16 bit values instead.
+//
+// Encoded frames fit in maxEncodedSize(count, dimensions) bytes, which can be
+// used to size a byte array in the State struct. Only encodedSize() of it
+// carries data, so deltas only save bandwidth if the transport sends just
+// encodedSize() bytes. Cuttlebone sends the whole State every frame and only
+// delivers the newest one, so with it set deltas to false: every frame is
+// then quantized 16 bit values that decode on their own.
+//
+// The primary calls encode() into the state before it is sent, renderers call
+// decode() from the state before using the values (at the start of
+// onAnimate()). An instance keeps the keyframe it encoded or decoded last, so
+// use separate instances for encoding and decoding.
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+class QuantizedArrayCodec {
+public:
+  int keyframeInterval = 120;
+  // Send deltas to the keyframe. If false, every frame decodes on its own.
+  bool deltas = true;
+  // Fraction of the extent added on each side of the keyframe bounding box,
+  // room for motion before a new keyframe is needed
+  float boxMargin = 0.25f;
+
+  static const int kMaxDimensions = 4;
+
+  // Layout of the start of every encoded frame
+  struct Header {
+    uint32_t frame;    // Sequence number
+    uint32_t keyframe; // Frame the deltas refer to
+    uint32_t count;    // Number of elements
+    uint32_t bytes;    // Encoded size including this header
+    uint8_t dimensions;
+    uint8_t mode; // Mode below
+    uint8_t reserved[2];
+    float min[kMaxDimensions];  // Bounding box origin
+    float step[kMaxDimensions]; // Quantization step
+  };
+
+  enum Mode : uint8_t {
+    KEYFRAME = 0, // 16 bit values, becomes the reference for deltas
+    RAW = 1,      // 16 bit values, not a reference
+    DELTA = 2     // Bit packed deltas to the keyframe
+  };
+
+  static constexpr size_t maxEncodedSize(size_t count, int dimensions = 3) {
+    return sizeof(Header) + count * dimensions * sizeof(uint16_t);
+  }
+
+  explicit QuantizedArrayCodec(int dimensions = 3)
+      : mDimensions(std::min(std::max(dimensions, 1), int(kMaxDimensions))) {}
+
+  int dimensions() const { return mDimensions; }
+
+  // Force the next encoded frame to be a keyframe
+  void requestKeyframe() { mNeedKeyframe = true; }
+
+  // Encode count elements of dimensions() interleaved floats. out must hold
+  // maxEncodedSize(count, dimensions()) bytes. Returns the encoded size.
+  size_t encode(const float *values, size_t count, uint8_t *out) {
+    const int dims = mDimensions;
+    const size_t n = count * dims;
+    Header header;
+    memset(&header, 0, sizeof(header));
+    header.frame = mFrame++;
+    header.count = uint32_t(count);
+    header.dimensions = uint8_t(dims);
+
+    bool keyframe = mNeedKeyframe || mKeyQuantized.size() != n ||
+                    header.frame - mKeyframe >= uint32_t(keyframeInterval) ||
+                    !insideBox(values, count);
+    if (keyframe) {
+      fitBox(values, count);
+      mKeyframe = header.frame;
+      mNeedKeyframe = false;
+    }
+    header.keyframe = mKeyframe;
+    for (int d = 0; d < dims; d++) {
+      header.min[d] = mMin[d];
+      header.step[d] = mStep[d];
+    }
+
+    mQuantized.resize(n);
+    quantize(values, count, mMin, mStep, mQuantized.data());
+    if (keyframe) {
+      mKeyQuantized = mQuantized;
+    }
+
+    uint8_t *payload = out + sizeof(Header);
+    size_t rawBytes = n * sizeof(uint16_t);
+    size_t payloadBytes = 0;
+    if (!keyframe && deltas) {
+      // Planar deltas: all x, then all y, ... so each block holds values of
+      // one component
+      mDeltas.resize(n);
+      for (int d = 0; d < dims; d++) {
+        uint32_t *plane = mDeltas.data() + d * count;
+        for (size_t i = 0; i < count; i++) {
+          int32_t delta = int32_t(mQuantized[i * dims + d]) -
+                          int32_t(mKeyQuantized[i * dims + d]);
+          plane[i] = zigzag(delta);
+        }
+      }
+      payloadBytes = pack(mDeltas.data(), n, payload, rawBytes);
+    }
+    if (payloadBytes == 0) {
+      header.mode = keyframe ? KEYFRAME : RAW;
+      memcpy(payload, mQuantized.data(), rawBytes);
+      payloadBytes = rawBytes;
+    } else {
+      header.mode = DELTA;
+    }
+    header.bytes = uint32_t(sizeof(Header) + payloadBytes);
+    memcpy(out, &header, sizeof(Header));
+
+    mLastBytes = header.bytes;
+    mTotalBytes += header.bytes;
+    mNumFrames++;
+    return header.bytes;
+  }
+
+  // Decode a frame of at most inBytes bytes into count elements. Returns
+  // false, leaving values untouched, if the frame is malformed, refers to a
+  // keyframe that was not received or is the frame decoded last (state is
+  // resent every frame), so true always means values holds a new frame.
+  bool decode(const uint8_t *in, size_t inBytes, size_t count,
+              float *values) {
+    if (inBytes < sizeof(Header)) {
+      return false;
+    }
+    Header header;
+    memcpy(&header, in, sizeof(Header));
+    const int dims = header.dimensions;
+    const size_t n = count * dims;
+    if (header.count != count || dims != mDimensions ||
+        header.bytes < sizeof(Header) || header.bytes > inBytes) {
+      return false;
+    }
+    if (header.frame == mDecodedFrame && mHasDecoded) {
+      return false;
+    }
+
+    const uint8_t *payload = in + sizeof(Header);
+    size_t payloadBytes = header.bytes - sizeof(Header);
+    mQuantized.resize(n);
+    if (header.mode == KEYFRAME || header.mode == RAW) {
+      if (payloadBytes != n * sizeof(uint16_t)) {
+        return false;
+      }
+      memcpy(mQuantized.data(), payload, payloadBytes);
+      if (header.mode == KEYFRAME) {
+        mKeyQuantized = mQuantized;
+        mKeyframe = header.keyframe;
+        mHasKeyframe = true;
+      }
+    } else if (header.mode == DELTA) {
+      if (!mHasKeyframe || header.keyframe != mKeyframe ||
+          mKeyQuantized.size() != n) {
+        mMissedFrames++;
+        return false;
+      }
+      mDeltas.resize(n);
+      if (!unpack(payload, payloadBytes, mDeltas.data(), n)) {
+        return false;
+      }
+      for (int d = 0; d < dims; d++) {
+        const uint32_t *plane = mDeltas.data() + d * count;
+        for (size_t i = 0; i < count; i++) {
+          mQuantized[i * dims + d] = uint16_t(
+              int32_t(mKeyQuantized[i * dims + d]) + unzigzag(plane[i]));
+        }
+      }
+    } else {
+      return false;
+    }
+
+    for (int d = 0; d < dims; d++) {
+      mMin[d] = header.min[d];
+      mStep[d] = header.step[d];
+    }
+    dequantize(mQuantized.data(), count, mMin, mStep, values);
+    mDecodedFrame = header.frame;
+    mHasDecoded = true;
+    mLastBytes = header.bytes;
+    mTotalBytes += header.bytes;
+    mNumFrames++;
+    return true;
+  }
+
+  // Largest absolute error of any component in the last frame
+  float errorBound() const {
+    float e = 0;
+    for (int d = 0; d < mDimensions; d++) {
+      // Half a step, plus float rounding in (de)quantization relative to the
+      // largest magnitude in the box
+      float magnitude = std::fabs(mMin[d]) + mStep[d] * 65535.0f;
+      e = std::max(e, mStep[d] * 0.5f + magnitude * 4 * FLT_EPSILON);
+    }
+    return e;
+  }
+
+  size_t encodedSize() const { return mLastBytes; }
+  double averageSize() const {
+    return mNumFrames ? double(mTotalBytes) / mNumFrames : 0.0;
+  }
+  uint64_t numFrames() const { return mNumFrames; }
+  // Delta frames that could not be decoded for lack of their keyframe
+  uint64_t missedFrames() const { return mMissedFrames; }
+
+  void resetStats() {
+    mTotalBytes = 0;
+    mNumFrames = 0;
+    mMissedFrames = 0;
+  }
+
+private:
+  static const int kBlockSize = 16;
+
+  static uint32_t zigzag(int32_t v) {
+    return (uint32_t(v) << 1) ^ uint32_t(v >> 31);
+  }
+  static int32_t unzigzag(uint32_t v) {
+    return int32_t(v >> 1) ^ -int32_t(v & 1);
+  }
+
+  bool insideBox(const float *values, size_t count) const {
+    const int dims = mDimensions;
+    for (int d = 0; d < dims; d++) {
+      float lo = mMin[d];
+      float hi = mMin[d] + mStep[d] * 65535.0f;
+      for (size_t i = 0; i < count; i++) {
+        float v = values[i * dims + d];
+        if (!(v >= lo && v <= hi)) {
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+
+  void fitBox(const float *values, size_t count) {
+    const int dims = mDimensions;
+    for (int d = 0; d < dims; d++) {
+      float lo = count ? values[d] : 0.0f, hi = lo;
+      for (size_t i = 1; i < count; i++) {
+        float v = values[i * dims + d];
+        lo = std::min(lo, v);
+        hi = std::max(hi, v);
+      }
+      float margin = std::max((hi - lo) * boxMargin, 1e-6f);
+      mMin[d] = lo - margin;
+      mStep[d] = (hi - lo + 2 * margin) / 65535.0f;
+    }
+  }
+
+  void quantize(const float *values, size_t count, const float *min,
+                const float *step, uint16_t *q) const {
+    const int dims = mDimensions;
+    for (int d = 0; d < dims; d++) {
+      const float lo = min[d], inv = 1.0f / step[d];
+      for (size_t i = 0; i < count; i++) {
+        float v = (values[i * dims + d] - lo) * inv + 0.5f;
+        v = std::min(std::max(v, 0.0f), 65535.0f);
+        q[i * dims + d] = uint16_t(v);
+      }
+    }
+  }
+
+  void dequantize(const uint16_t *q, size_t count, const float *min,
+                  const float *step, float *values) const {
+    const int dims = mDimensions;
+    for (int d = 0; d < dims; d++) {
+      for (size_t i = 0; i < count; i++) {
+        values[i * dims + d] = min[d] + q[i * dims + d] * step[d];
+      }
+    }
+  }
+
+  // Bit packs n values into out. Returns the size, or 0 if it would exceed
+  // limit bytes.
+  static size_t pack(const uint32_t *in, size_t n, uint8_t *out,
+                     size_t limit) {
+    size_t pos = 0;
+    for (size_t b = 0; b < n; b += kBlockSize) {
+      size_t len = std::min(size_t(kBlockSize), n - b);
+      uint32_t bits = 0;
+      for (size_t i = 0; i < len; i++) {
+        bits |= in[b + i];
+      }
+      int width = 0;
+      while (bits >> width) {
+        width++;
+      }
+      size_t blockBytes = 1 + (len * width + 7) / 8;
+      if (pos + blockBytes > limit) {
+        return 0;
+      }
+      out[pos++] = uint8_t(width);
+      uint64_t acc = 0;
+      int accBits = 0;
+      for (size_t i = 0; i < len; i++) {
+        acc |= uint64_t(in[b + i]) << accBits;
+        accBits += width;
+        while (accBits >= 8) {
+          out[pos++] = uint8_t(acc);
+          acc >>= 8;
+          accBits -= 8;
+        }
+      }
+      if (accBits > 0) {
+        out[pos++] = uint8_t(acc);
+      }
+    }
+    return pos;
+  }
+
+  static bool unpack(const uint8_t *in, size_t bytes, uint32_t *out,
+                     size_t n) {
+    size_t pos = 0;
+    for (size_t b = 0; b < n; b += kBlockSize) {
+      size_t len = std::min(size_t(kBlockSize), n - b);
+      if (pos >= bytes) {
+        return false;
+      }
+      int width = in[pos++];
+      if (width > 32 || pos + (len * width + 7) / 8 > bytes) {
+        return false;
+      }
+      const uint64_t mask = (uint64_t(1) << width) - 1;
+      uint64_t acc = 0;
+      int accBits = 0;
+      for (size_t i = 0; i < len; i++) {
+        while (accBits < width) {
+          acc |= uint64_t(in[pos++]) << accBits;
+          accBits += 8;
+        }
+        out[b + i] = uint32_t(acc & mask);
+        acc >>= width;
+        accBits -= width;
+      }
+    }
+    return pos == bytes;
+  }
+
+  int mDimensions;
+  float mMin[kMaxDimensions] = {0};
+  float mStep[kMaxDimensions] = {0};
+
+  // Encoder
+  uint32_t mFrame{0};
+  bool mNeedKeyframe{true};
+
+  // Decoder
+  uint32_t mDecodedFrame{0};
+  bool mHasDecoded{false};
+  bool mHasKeyframe{false};
+
+  uint32_t mKeyframe{0};
+  std::vector<uint16_t> mKeyQuantized;
+  std::vector<uint16_t> mQuantized;
+  std::vector<uint32_t> mDeltas;
+
+  size_t mLastBytes{0};
+  uint64_t mTotalBytes{0};
+  uint64_t mNumFrames{0};
+  uint64_t mMissedFrames{0};
+};
+
+#endif
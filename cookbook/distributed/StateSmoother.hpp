@@ -0,0 +1,210 @@
+#pragma once
+#ifndef StateSmoother_H
+#define StateSmoother_H
+
+// Renderer side smoothing of distributed state.
+//
+// Copying state() into the pose or a mesh in onAnimate() shows every
+// irregularity in network delivery: a frame that arrives late repeats the
+// previous one, and then two frames land on the same render frame. Instead,
+// StateSmoother keeps the last few received frames with the time they were
+// sent and renders the state as it was a fixed delay ago, interpolating
+// between the two frames around that time. If the next frame is late, it
+// extrapolates from the last two for at most maxExtrapolation seconds and
+// then holds the newest frame.
+//
+// The primary stamps each frame with stateTime(). Renderers map
+// sender time to their own clock with the smallest transit time seen (which
+// absorbs the clock offset between machines), so the frames are placed by
+// when they were sent, not by when they arrived.
+//
+// Typical use on a renderer:
+//
+//   smoother.receive(state().time, snapshotOf(state())); // every onAnimate
+//   if (smoother.sample(smoothed)) { ... use smoothed ... }
+//
+// The snapshot type and how to interpolate it are up to the app, see
+// lerpPose() and lerpArray() below. For large snapshots, fill one in place
+// and pass it with std::move(): it is swapped in instead of copied.
+
+#include "al/spatial/al_Pose.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <utility>
+#include <vector>
+
+// Seconds on a monotonic clock, for stamping frames on the primary
+inline double stateTime() {
+  return std::chrono::duration<double>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+template <class Snapshot> class StateSmoother {
+public:
+  // out = a + (b - a) * t. t is above 1 when extrapolating.
+  using LerpFunction = std::function<void(const Snapshot &a, const Snapshot &b,
+                                          float t, Snapshot &out)>;
+
+  // Seconds added to the smallest transit time. Must cover the jitter, and
+  // capacity frames must span more than the delay.
+  double delay = 0.05;
+  double maxExtrapolation = 0.05; // Seconds past the newest frame
+
+  struct Stats {
+    uint64_t framesReceived{0};
+    uint64_t framesLate{0};   // Arrived after the time they were needed
+    uint64_t samplesExtrapolated{0};
+    uint64_t samplesHeld{0};  // Past maxExtrapolation, newest frame shown
+    double latency{0};        // Mean transit time. Includes the clock offset
+                              // if sender and renderer clocks differ.
+    double jitter{0};         // Mean deviation of transit times (RFC 3550)
+  };
+
+  explicit StateSmoother(LerpFunction lerp, size_t capacity = 6)
+      : mLerp(lerp), mFrames(std::max(size_t(2), capacity)) {}
+
+  // Offer the current state, sent at sendTime. Copied only if it is a new
+  // frame. A sendTime of 0 is a state that was never written.
+  void receive(double sendTime, const Snapshot &snapshot) {
+    if (Frame *slot = accept(sendTime)) {
+      slot->snapshot = snapshot;
+    }
+  }
+
+  // Same without the copy: a new frame is swapped into the buffer, leaving
+  // snapshot with the storage of the oldest frame (e.g. vectors of the right
+  // size) to fill with the next one.
+  void receive(double sendTime, Snapshot &&snapshot) {
+    if (Frame *slot = accept(sendTime)) {
+      using std::swap;
+      swap(slot->snapshot, snapshot);
+    }
+  }
+
+  // Newest received frame, or nullptr
+  const Snapshot *latest() const {
+    return mCount > 0 ? &newest().snapshot : nullptr;
+  }
+
+  // State at the present time minus delay. Returns false if no frame was received yet.
+  bool sample(Snapshot &out) {
+    if (mCount == 0) {
+      return false;
+    }
+    double t = renderTime(stateTime());
+    const Frame &last = newest();
+    if (mCount == 1 || t >= last.sendTime) {
+      if (mCount == 1 || t > last.sendTime + maxExtrapolation) {
+        if (mCount > 1) {
+          mStats.samplesHeld++;
+        }
+        out = last.snapshot;
+        return true;
+      }
+      // Extrapolate along the last two frames
+      const Frame &prev = frame(1);
+      float alpha =
+          float((t - prev.sendTime) / (last.sendTime - prev.sendTime));
+      mLerp(prev.snapshot, last.snapshot, alpha, out);
+      mStats.samplesExtrapolated++;
+      return true;
+    }
+    for (size_t i = 1; i < mCount; i++) {
+      const Frame &a = frame(i);
+      const Frame &b = frame(i - 1);
+      if (t >= a.sendTime || i == mCount - 1) {
+        float alpha = float((t - a.sendTime) / (b.sendTime - a.sendTime));
+        mLerp(a.snapshot, b.snapshot, std::max(alpha, 0.0f), out);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  const Stats &stats() const { return mStats; }
+  void resetStats() {
+    mStats.framesReceived = 0;
+    mStats.framesLate = 0;
+    mStats.samplesExtrapolated = 0;
+    mStats.samplesHeld = 0;
+  }
+
+private:
+  struct Frame {
+    double sendTime{0};
+    Snapshot snapshot;
+  };
+
+  // Slot for a frame sent at sendTime, or nullptr if it isn't new
+  Frame *accept(double sendTime) {
+    if (sendTime <= 0 || (mCount > 0 && sendTime <= newest().sendTime)) {
+      return nullptr;
+    }
+    double arrival = stateTime();
+    double transit = arrival - sendTime;
+    if (mCount == 0) {
+      mOffset = transit;
+      mStats.latency = transit;
+    } else {
+      // Let the offset creep up slowly, in case the clocks drift apart
+      mOffset = std::min(mOffset + 0.001 * (arrival - mLastArrival), transit);
+      double d = std::fabs(transit - mLastTransit);
+      mStats.jitter += (d - mStats.jitter) / 16.0;
+      mStats.latency += (transit - mStats.latency) / 16.0;
+      if (sendTime < renderTime(arrival)) {
+        mStats.framesLate++;
+      }
+    }
+    mLastTransit = transit;
+    mLastArrival = arrival;
+
+    mNewest = (mNewest + 1) % mFrames.size();
+    mFrames[mNewest].sendTime = sendTime;
+    mCount = std::min(mCount + 1, mFrames.size());
+    mStats.framesReceived++;
+    return &mFrames[mNewest];
+  }
+
+  // Sender time to render at local time
+  double renderTime(double localTime) const {
+    return localTime - mOffset - delay;
+  }
+
+  // age 0 is the newest frame
+  const Frame &frame(size_t age) const {
+    return mFrames[(mNewest + mFrames.size() - age) % mFrames.size()];
+  }
+  const Frame &newest() const { return mFrames[mNewest]; }
+
+  LerpFunction mLerp;
+  std::vector<Frame> mFrames;
+  size_t mNewest{0};
+  size_t mCount{0};
+
+  double mOffset{0}; // Smallest transit time
+  double mLastTransit{0};
+  double mLastArrival{0};
+  Stats mStats;
+};
+
+// Position lerp and rotation slerp. Also extrapolates for t > 1.
+inline al::Pose lerpPose(const al::Pose &a, const al::Pose &b, float t) {
+  al::Vec3d pos = a.pos() + (b.pos() - a.pos()) * double(t);
+  al::Quatd q = al::Quatd::slerp(a.quat(), b.quat(), t);
+  return al::Pose(pos, q);
+}
+
+inline void lerpArray(const float *a, const float *b, float t, float *out,
+                      size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    out[i] = a[i] + (b[i] - a[i]) * t;
+  }
+}
+
+#endif
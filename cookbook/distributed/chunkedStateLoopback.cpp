@@ -0,0 +1,86 @@
+/*
+Chunked state over a lossy loopback
+
+Description:
+Sends a blob-sized state (655362 vertices) at 60 Hz through
+ChunkedStateSender and a LoopbackChannel that drops and delays packets, and
+assembles it with ChunkedStateReceiver (see ChunkedState.hpp).
+
+Every float of the state holds the number of the frame it was sent in, so
+the receiver can tell how old each part of the state it shows is. For each
+packet loss rate it prints how many frames were complete, how many chunks
+were filled in from earlier frames and how old the oldest data got. As a
+comparison it also prints how many frames would have been lost if any
+missing packet dropped the whole frame.
+
+Usage:
+    chunkedStateLoopback [latency ms] [jitter ms] [frames]
+*/
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "ChunkedState.hpp"
+
+int main(int argc, char *argv[]) {
+  double latency = argc > 1 ? atof(argv[1]) / 1000.0 : 0.005;
+  double jitter = argc > 2 ? atof(argv[2]) / 1000.0 : 0.004;
+  int numFrames = argc > 3 ? atoi(argv[3]) : 120;
+
+  const size_t numFloats = 655362 * 3;
+  const size_t bytes = numFloats * sizeof(float);
+  std::vector<float> state(numFloats);
+
+  for (float loss : {0.0f, 0.0001f, 0.001f, 0.01f, 0.05f}) {
+    LoopbackChannel channel;
+    channel.lossRate = loss;
+    channel.latency = latency;
+    channel.jitter = jitter;
+    ChunkedStateSender sender;
+    ChunkedStateReceiver receiver(bytes);
+
+    uint64_t framesShown = 0, framesWholeLost = 0;
+    float maxAge = 0;
+    double staleFraction = 0;
+    auto frameTime = std::chrono::microseconds(16667);
+    auto next = std::chrono::steady_clock::now();
+    for (int frame = 1; frame <= numFrames; frame++) {
+      std::fill(state.begin(), state.end(), float(frame));
+      uint64_t dropped = channel.dropped();
+      sender.send(state.data(), bytes, channel);
+      if (channel.dropped() != dropped) {
+        framesWholeLost++;
+      }
+
+      next += frameTime;
+      std::this_thread::sleep_until(next);
+      if (receiver.poll(channel)) {
+        framesShown++;
+        auto data = reinterpret_cast<const float *>(receiver.data());
+        float newest = *std::max_element(data, data + numFloats);
+        size_t stale = 0;
+        for (size_t i = 0; i < numFloats; i++) {
+          float age = newest - data[i];
+          maxAge = std::max(maxAge, age);
+          stale += age > 0;
+        }
+        staleFraction += double(stale) / numFloats;
+      }
+    }
+
+    const auto &stats = receiver.stats();
+    std::cout << "Loss " << loss * 100 << "%: " << stats.framesComplete
+              << " complete, " << stats.framesPartial << " partial ("
+              << stats.chunksMissing << " chunks kept from earlier frames, "
+              << stats.packetsLate << " late packets), oldest data "
+              << maxAge << " frames, "
+              << (framesShown ? 100 * staleFraction / framesShown : 0)
+              << "% stale on average. Whole frames would lose "
+              << framesWholeLost << " of " << numFrames << std::endl;
+  }
+  return 0;
+}
@@ -0,0 +1,178 @@
+#pragma once
+#ifndef FixedStepSimulation_H
+#define FixedStepSimulation_H
+
+// Runs a simulation at a fixed rate on its own thread, independent of the
+// display refresh.
+//
+// Integrating with the variable dt of onAnimate() makes the physics depend on
+// the frame rate: a hitch produces one large step, and a fast display takes
+// more (smaller) steps than needed. Here the simulation thread advances the
+// state in steps of exactly 1/rate seconds. After a stall it catches up with
+// at most maxSubsteps steps and drops the remaining time, so a slow simulation
+// slows down instead of spiraling.
+//
+// After each batch of steps the thread publishes a View of the last two
+// states, as (previous, current) pairs in a triple buffer. The graphics
+// thread calls update() to take the newest pair, then draws
+// previous + (current - previous) * alpha(). That is one step of latency, but
+// the motion stays smooth at any display rate.
+//
+// View defaults to the full State. A capture function can publish only what
+// is drawn, e.g. positions. Changes to the state from other threads (reset,
+// key presses) go through post() and run on the simulation thread between
+// steps.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+template <class State, class View = State> class FixedStepSimulation {
+public:
+  using StepFunction = std::function<void(State &, double dt)>;
+  using CaptureFunction = std::function<void(const State &, View &)>;
+  using Clock = std::chrono::steady_clock;
+
+  ~FixedStepSimulation() { stop(); }
+
+  // Step a copy of initial rate times per second. capture copies the state
+  // into the published view (assignment by default).
+  void start(const State &initial, double rate, StepFunction step,
+             CaptureFunction capture = nullptr, int maxSubsteps = 4) {
+    stop();
+    mState = initial;
+    mDt = 1.0 / rate;
+    mStep = step;
+    mCapture = capture;
+    if (!mCapture) {
+      mCapture = [](const State &s, View &v) { v = s; };
+    }
+    mMaxSubsteps = std::max(1, maxSubsteps);
+    mSteps = 0;
+    for (auto &snapshot : mSnapshots) {
+      mCapture(mState, snapshot.previous);
+      mCapture(mState, snapshot.current);
+      snapshot.time = Clock::now();
+    }
+    mFresh = false;
+    mRunning = true;
+    mThread = std::thread([this]() { run(); });
+  }
+
+  void stop() {
+    mRunning = false;
+    if (mThread.joinable()) {
+      mThread.join();
+    }
+  }
+
+  bool running() const { return mRunning; }
+
+  // Run func on the state from the simulation thread before the next step
+  void post(std::function<void(State &)> func) {
+    std::lock_guard<std::mutex> lock(mPostMutex);
+    mPosted.push_back(func);
+  }
+
+  // Graphics thread. Takes the newest published states, returns true if they
+  // changed.
+  bool update() {
+    std::lock_guard<std::mutex> lock(mSwapMutex);
+    if (!mFresh) {
+      return false;
+    }
+    std::swap(mFront, mReady);
+    mFresh = false;
+    return true;
+  }
+
+  const View &previous() const { return mSnapshots[mFront].previous; }
+  const View &current() const { return mSnapshots[mFront].current; }
+
+  // Interpolation weight of current() for the present time, in [0, 1]
+  float alpha() const {
+    double elapsed =
+        std::chrono::duration<double>(Clock::now() - mSnapshots[mFront].time)
+            .count();
+    return float(std::min(std::max(elapsed / mDt, 0.0), 1.0));
+  }
+
+  double stepSize() const { return mDt; }
+
+  // Total number of steps taken
+  uint64_t steps() const { return mSteps; }
+
+private:
+  struct Snapshot {
+    View previous;
+    View current;
+    Clock::time_point time; // When current became valid
+  };
+
+  void run() {
+    auto dt = std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double>(mDt));
+    auto next = Clock::now();
+    std::vector<std::function<void(State &)>> posted;
+    while (mRunning) {
+      {
+        std::lock_guard<std::mutex> lock(mPostMutex);
+        posted.swap(mPosted);
+      }
+      for (auto &func : posted) {
+        func(mState);
+      }
+      posted.clear();
+
+      auto now = Clock::now();
+      if (next <= now) {
+        int numSteps = std::min(mMaxSubsteps, int((now - next) / dt) + 1);
+        Snapshot &back = mSnapshots[mBack];
+        for (int i = 0; i < numSteps; ++i) {
+          if (i == numSteps - 1) {
+            mCapture(mState, back.previous);
+          }
+          mStep(mState, mDt);
+        }
+        mSteps += numSteps;
+        next += dt * numSteps;
+        if (next <= now) {
+          // Too far behind, drop the time we couldn't catch up on
+          next = now + dt;
+        }
+        mCapture(mState, back.current);
+        back.time = next - dt;
+
+        std::lock_guard<std::mutex> lock(mSwapMutex);
+        std::swap(mBack, mReady);
+        mFresh = true;
+      }
+      std::this_thread::sleep_until(next);
+    }
+  }
+
+  State mState; // Simulation thread only
+  double mDt{1.0 / 60};
+  int mMaxSubsteps{4};
+  StepFunction mStep;
+  CaptureFunction mCapture;
+
+  Snapshot mSnapshots[3];
+  int mBack{0}, mReady{1}, mFront{2};
+  bool mFresh{false};
+  std::mutex mSwapMutex;
+
+  std::vector<std::function<void(State &)>> mPosted;
+  std::mutex mPostMutex;
+
+  std::atomic<bool> mRunning{false};
+  std::atomic<uint64_t> mSteps{0};
+  std::thread mThread;
+};
+
+#endif
@@ -0,0 +1,163 @@
+#pragma once
+#ifndef HeightFieldMesh_H
+#define HeightFieldMesh_H
+
+// Lit height field on a regular grid.
+//
+// The grid (x, y positions, texture coordinates and indices) is uploaded once.
+// Per frame only the heights are uploaded, as a single channel float texture.
+// The vertex shader displaces the grid by the height and computes the normal
+// from central differences of the neighboring samples, so there is no CPU
+// normal pass and positions and normals are never re-uploaded.
+//
+// The displayed grid can be coarser than the height field (see create()), in
+// which case heights are linearly interpolated. The texture wraps, which
+// matches a toroidal simulation domain.
+
+#include "al/graphics/al_Graphics.hpp"
+#include "al/graphics/al_Shader.hpp"
+#include "al/graphics/al_Texture.hpp"
+#include "al/graphics/al_VAOMesh.hpp"
+
+#include <algorithm>
+#include <string>
+
+class HeightFieldMesh {
+public:
+  // Height field of fieldNx by fieldNy samples (row-major) displayed on a
+  // surface of size width by height centered at the origin, using at most
+  // maxRes by maxRes vertices. Requires a graphics context.
+  void create(int fieldNx, int fieldNy, int maxRes = 1024, float width = 2,
+              float height = 2) {
+    mFieldNx = fieldNx;
+    mFieldNy = fieldNy;
+    mWidth = width;
+    mHeight = height;
+
+    if (!mShaderCompiled) {
+      mShaderCompiled = mShader.compile(vertexCode(), fragmentCode());
+    }
+
+    if (mTexture.created()) {
+      mTexture.destroy();
+    }
+    mTexture.filterMag(al::Texture::LINEAR);
+    mTexture.filterMin(al::Texture::LINEAR);
+    mTexture.wrap(al::Texture::REPEAT);
+    mTexture.create2D(fieldNx, fieldNy, GL_R32F, GL_RED, GL_FLOAT);
+
+    // Vertices sit on texel centers when the grid matches the field
+    int nx = std::min(fieldNx, maxRes);
+    int ny = std::min(fieldNy, maxRes);
+    mMesh.reset();
+    mMesh.primitive(al::Mesh::TRIANGLES);
+    for (int j = 0; j < ny; ++j) {
+      float v = (j + 0.5f) / ny;
+      for (int i = 0; i < nx; ++i) {
+        float u = (i + 0.5f) / nx;
+        mMesh.vertex((u - 0.5f) * width, (v - 0.5f) * height);
+        mMesh.texCoord(u, v);
+      }
+    }
+    for (int j = 0; j < ny - 1; ++j) {
+      for (int i = 0; i < nx - 1; ++i) {
+        unsigned int a = j * nx + i;
+        unsigned int b = a + 1;
+        unsigned int c = a + nx;
+        unsigned int d = c + 1;
+        mMesh.index(a, b, d);
+        mMesh.index(a, d, c);
+      }
+    }
+    mMesh.update();
+  }
+
+  // Upload fieldNx * fieldNy heights
+  void update(const float *heights) {
+    mTexture.bind();
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, mFieldNx, mFieldNy, GL_RED,
+                    GL_FLOAT, heights);
+    mTexture.unbind();
+  }
+
+  // Blinn-Phong lighting computed in model space. lightDir points toward the
+  // light and eye is the camera position in model space.
+  void draw(al::Graphics &g, const al::Vec3f &lightDir, const al::Vec3f &eye,
+            const al::Color &color, float shininess = 30) {
+    g.shader(mShader);
+    g.shader().uniform("heightMap", 0);
+    g.shader().uniform("texelSize",
+                       al::Vec2f(1.f / mFieldNx, 1.f / mFieldNy));
+    g.shader().uniform("cellSize",
+                       al::Vec2f(mWidth / mFieldNx, mHeight / mFieldNy));
+    g.shader().uniform("lightDir", lightDir.normalized());
+    g.shader().uniform("eyePos", eye);
+    g.shader().uniform("color", al::Vec3f(color.r, color.g, color.b));
+    g.shader().uniform("shininess", shininess);
+    mTexture.bind(0);
+    g.draw(mMesh);
+    mTexture.unbind(0);
+  }
+
+private:
+  static std::string vertexCode() {
+    return R"(
+#version 330
+uniform mat4 al_ModelViewMatrix;
+uniform mat4 al_ProjectionMatrix;
+uniform sampler2D heightMap;
+uniform vec2 texelSize;
+uniform vec2 cellSize;
+
+layout (location = 0) in vec3 position;
+layout (location = 2) in vec2 texcoord;
+
+out vec3 P;
+out vec3 N;
+
+void main() {
+  float h = texture(heightMap, texcoord).r;
+  float hl = texture(heightMap, texcoord - vec2(texelSize.x, 0.)).r;
+  float hr = texture(heightMap, texcoord + vec2(texelSize.x, 0.)).r;
+  float hd = texture(heightMap, texcoord - vec2(0., texelSize.y)).r;
+  float hu = texture(heightMap, texcoord + vec2(0., texelSize.y)).r;
+  N = vec3((hl - hr) / (2. * cellSize.x), (hd - hu) / (2. * cellSize.y), 1.);
+  P = vec3(position.xy, h);
+  gl_Position = al_ProjectionMatrix * al_ModelViewMatrix * vec4(P, 1.);
+}
+)";
+  }
+
+  static std::string fragmentCode() {
+    return R"(
+#version 330
+uniform vec3 lightDir;
+uniform vec3 eyePos;
+uniform vec3 color;
+uniform float shininess;
+
+in vec3 P;
+in vec3 N;
+
+layout (location = 0) out vec4 fragColor;
+
+void main() {
+  vec3 n = normalize(N);
+  if (!gl_FrontFacing) n = -n;
+  float diffuse = max(dot(n, lightDir), 0.);
+  vec3 h = normalize(lightDir + normalize(eyePos - P));
+  float specular = diffuse > 0. ? pow(max(dot(n, h), 0.), shininess) : 0.;
+  fragColor = vec4(color * (0.2 + 0.8 * diffuse) + vec3(specular), 1.);
+}
+)";
+  }
+
+  int mFieldNx{0}, mFieldNy{0};
+  float mWidth{2}, mHeight{2};
+  al::VAOMesh mMesh;
+  al::Texture mTexture;
+  al::ShaderProgram mShader;
+  bool mShaderCompiled{false};
+};
+
+#endif
@@ -0,0 +1,135 @@
+#pragma once
+#ifndef ParallelFor_H
+#define ParallelFor_H
+
+// Splits a loop over [0, n) into contiguous ranges, one per core, and runs
+// func(begin, end) for each range in parallel. Small loops (under
+// minPerThread items per thread) run on the calling thread.
+//
+// The ranges run on a pool of worker threads started on first use and kept
+// for the life of the program, plus the calling thread, so a simulation
+// step doesn't pay for creating and joining threads. Calls made while the
+// pool is busy (from inside a range, or from another thread) run on the
+// calling thread.
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ParallelForPool {
+public:
+  static ParallelForPool &shared() {
+    static ParallelForPool pool;
+    return pool;
+  }
+
+  ~ParallelForPool() {
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      mStop = true;
+    }
+    mWake.notify_all();
+    for (auto &worker : mWorkers) {
+      worker.join();
+    }
+  }
+
+  // Workers plus the calling thread
+  int numThreads() const { return int(mWorkers.size()) + 1; }
+
+  // Calls task(t) for every t in [0, numTasks) and returns when all are done
+  void run(int numTasks, const std::function<void(int)> &task) {
+    bool idle = false;
+    if (!mBusy.compare_exchange_strong(idle, true)) {
+      for (int t = 0; t < numTasks; ++t) {
+        task(t);
+      }
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      mTask = &task;
+      mNumTasks = numTasks;
+      mNextTask = 0;
+      mWorking = int(mWorkers.size());
+      mGeneration++;
+    }
+    mWake.notify_all();
+    work();
+    {
+      // Every worker leaves work() before the task goes out of scope
+      std::unique_lock<std::mutex> lock(mMutex);
+      mDone.wait(lock, [this] { return mWorking == 0; });
+      mTask = nullptr;
+    }
+    mBusy = false;
+  }
+
+private:
+  ParallelForPool() {
+    // hardware_concurrency() can read from /proc on every call
+    int numCores = std::max(1u, std::thread::hardware_concurrency());
+    for (int i = 1; i < numCores; ++i) {
+      mWorkers.emplace_back([this] { workerLoop(); });
+    }
+  }
+
+  void workerLoop() {
+    unsigned generation = 0;
+    std::unique_lock<std::mutex> lock(mMutex);
+    while (true) {
+      mWake.wait(lock, [&] { return mStop || mGeneration != generation; });
+      if (mStop) {
+        return;
+      }
+      generation = mGeneration;
+      lock.unlock();
+      work();
+      lock.lock();
+      if (--mWorking == 0) {
+        mDone.notify_one();
+      }
+    }
+  }
+
+  void work() {
+    int t;
+    while ((t = mNextTask.fetch_add(1)) < mNumTasks) {
+      (*mTask)(t);
+    }
+  }
+
+  std::vector<std::thread> mWorkers;
+  std::atomic<bool> mBusy{false};
+
+  std::mutex mMutex;
+  std::condition_variable mWake;
+  std::condition_variable mDone;
+  bool mStop{false};
+  unsigned mGeneration{0};
+  int mWorking{0}; // Workers that haven't finished the current run
+
+  // Current run, written under mMutex before workers are woken
+  const std::function<void(int)> *mTask{nullptr};
+  int mNumTasks{0};
+  std::atomic<int> mNextTask{0};
+};
+
+template <class Func>
+void parallelFor(int n, Func func, int minPerThread = 1024) {
+  ParallelForPool &pool = ParallelForPool::shared();
+  int numThreads = std::min(pool.numThreads(), std::max(1, n / minPerThread));
+  if (numThreads <= 1) {
+    func(0, n);
+    return;
+  }
+  pool.run(numThreads, [&](int t) {
+    func(t * n / numThreads, (t + 1) * n / numThreads);
+  });
+}
+
+#endif
@@ -9,11 +9,26 @@ algorithm [1] consists of three main interactions between flockmates ("boids"):
     2) Velocity matching (of nearby flockmates)
     3) Flock centering (of nearby flockmates)
 
-Here, we implement 1) and 2) only. Another change from the reference source is
-the use of Gaussian functions rather than inverse-squared functions for
-calculating the "nearness" of flockmates. This is done primarily to avoid
-infinities, but also to give smoother motions. Lastly, we give each boid a
-random walk motion which helps both dissolve and redirect the flocks.
+Another change from the reference source is the use of Gaussian functions
+rather than inverse-squared functions for calculating the "nearness" of
+flockmates. This is done primarily to avoid infinities, but also to give
+smoother motions. Lastly, we give each boid a random walk motion which helps
+both dissolve and redirect the flocks.
+
+Since the Gaussians are negligible beyond three radii, only nearby boids need
+to be checked. Boids are binned into a uniform grid of cells (rebuilt every
+step with a counting sort) and each boid only looks at the 3x3 block of cells
+around it. The interaction radii shrink as the flock grows so that the
+average number of neighbours stays the same as with 32 boids.
+
+The flock is stepped at a fixed 60 Hz on its own thread (see
+FixedStepSimulation.hpp) and drawn interpolated between the last two steps.
+
+Keys:
+    r       reset boids
+    1-4     32, 1000, 10000 or 100000 boids
+    g       toggle grid / all-pairs neighbour search
+    b       benchmark grid against all-pairs
 
 [1] Reynolds, C. W. (1987). Flocks, herds, and schools: A distributed behavioral
     model. Computer Graphics, 21(4):25–34.
@@ -22,13 +37,19 @@ Author:
 Lance Putnam, Oct. 2014
 */
 
+#include <algorithm>
+#include <chrono>
 #include <cmath>
+#include <iostream>
+#include <vector>
 
 #include "al/app/al_App.hpp"
 #include "al/graphics/al_Shapes.hpp"
 #include "al/math/al_Functions.hpp"
 #include "al/math/al_Random.hpp"
 
+#include "FixedStepSimulation.hpp"
+
 using namespace al;
 
 // A "boid" (play on bird) is one member of a flock.
@@ -41,69 +62,162 @@ class Boid {
   void update(double dt) { pos += vel * dt; }
 };
 
-struct MyApp : public App {
-  static const int Nb = 32;  // Number of boids
-  Boid boids[Nb];
-  Mesh heads, tails;
-  Mesh box;
+// Uniform grid of square cells over the [-1, 1] box. Boid indices are
+// counting-sorted by cell so the boids of a cell are contiguous.
+struct BoidGrid {
+  double cellSize = 1;
+  int dim = 1;                 // cells per side
+  std::vector<int> cellStart;  // first sorted index of each cell (+1 sentinel)
+  std::vector<int> cellOf;     // cell of each boid
+  std::vector<int> sorted;     // boid indices ordered by cell
+
+  int cellCoord(double x) const {
+    int c = int((x + 1) / cellSize);
+    return std::min(std::max(c, 0), dim - 1);
+  }
 
-  void onCreate() {
-    box.primitive(Mesh::LINE_LOOP);
-    box.vertex(-1, -1);
-    box.vertex(1, -1);
-    box.vertex(1, 1);
-    box.vertex(-1, 1);
-    nav().pullBack(4);
+  void build(const std::vector<Boid>& boids, double minCellSize) {
+    dim = std::max(1, std::min(1024, int(2. / minCellSize)));
+    cellSize = 2. / dim;
+    int numCells = dim * dim;
+    int n = boids.size();
+    cellStart.assign(numCells + 1, 0);
+    cellOf.resize(n);
+    sorted.resize(n);
+
+    for (int i = 0; i < n; ++i) {
+      int c = cellCoord(boids[i].pos.y) * dim + cellCoord(boids[i].pos.x);
+      cellOf[i] = c;
+      ++cellStart[c + 1];
+    }
+    for (int c = 0; c < numCells; ++c) cellStart[c + 1] += cellStart[c];
+    std::vector<int>& fill = cursor;
+    fill.assign(cellStart.begin(), cellStart.end() - 1);
+    for (int i = 0; i < n; ++i) sorted[fill[cellOf[i]]++] = i;
+  }
+
+  // Call f(j) for every boid j in the 3x3 cells around boid i (including i)
+  template <class F>
+  void forNeighbors(int i, F&& f) const {
+    int cx = cellOf[i] % dim;
+    int cy = cellOf[i] / dim;
+    for (int y = std::max(cy - 1, 0); y <= std::min(cy + 1, dim - 1); ++y) {
+      for (int x = std::max(cx - 1, 0); x <= std::min(cx + 1, dim - 1); ++x) {
+        int c = y * dim + x;
+        for (int k = cellStart[c]; k < cellStart[c + 1]; ++k) f(sorted[k]);
+      }
+    }
+  }
+
+ private:
+  std::vector<int> cursor;
+};
 
-    resetBoids();
+struct Flock {
+  std::vector<Boid> boids;
+  BoidGrid grid;
+  bool useGrid = true;
+
+  // Interaction parameters for a flock of 32 boids
+  double pushRadius = 0.05;
+  double pushStrength = 1;
+  double matchRadius = 0.125;
+  double centerUrge = 0.05;
+  float huntUrge = 0.2f;
+
+  // Per boid accumulators from neighbour interactions
+  std::vector<Vec2d> pushSum, velSum, posSum;
+  std::vector<double> nearSum;
+
+  void resize(int n) {
+    boids.resize(n);
+    reset();
   }
 
   // Randomize boid positions/velocities uniformly inside unit disc
-  void resetBoids() {
+  void reset() {
     for (auto& b : boids) {
       b.pos = rnd::ball<Vec2f>();
       b.vel = rnd::ball<Vec2f>();
     }
   }
 
-  void onAnimate(double dt_ms) {
-    double dt = dt_ms;
+  // Keep the expected number of neighbours constant as the flock grows
+  double radiusScale() const { return std::sqrt(32. / boids.size()); }
 
-    // Compute boid-boid interactions
-    for (int i = 0; i < Nb - 1; ++i) {
-      for (int j = i + 1; j < Nb; ++j) {
-        // printf("checking boids %d and %d\n", i,j);
+  void clearSums() {
+    int n = boids.size();
+    pushSum.assign(n, Vec2d(0));
+    velSum.assign(n, Vec2d(0));
+    posSum.assign(n, Vec2d(0));
+    nearSum.assign(n, 0);
+  }
+
+  // Interaction of boid j on boid i
+  void interact(int i, int j, double pushR, double matchR) {
+    auto ds = boids[i].pos - boids[j].pos;
+    double distSqr = ds.magSqr();
+    // Gaussians are below 1e-4 beyond three radii
+    if (distSqr > 9 * matchR * matchR) return;
+    double dist = std::sqrt(distSqr);
+
+    // Collision avoidance
+    if (distSqr < 9 * pushR * pushR && dist > 0) {
+      double push = exp(-al::pow2(dist / pushR)) * pushStrength;
+      pushSum[i] += ds * (push / dist);
+    }
 
-        auto ds = boids[i].pos - boids[j].pos;
-        auto dist = ds.mag();
+    // Velocity matching and flock centering, weighted by nearness
+    double nearness = exp(-al::pow2(dist / matchR));
+    velSum[i] += boids[j].vel * nearness;
+    posSum[i] += boids[j].pos * nearness;
+    nearSum[i] += nearness;
+  }
 
-        // Collision avoidance
-        double pushRadius = 0.05;
-        double pushStrength = 1;
-        double push = exp(-al::pow2(dist / pushRadius)) * pushStrength;
+  void interactPairwise() {
+    int n = boids.size();
+    double s = radiusScale();
+    for (int i = 0; i < n; ++i) {
+      for (int j = 0; j < n; ++j) {
+        if (i != j) interact(i, j, pushRadius * s, matchRadius * s);
+      }
+    }
+  }
 
-        auto pushVector = ds.normalized() * push;
-        boids[i].pos += pushVector;
-        boids[j].pos -= pushVector;
+  void interactGrid() {
+    int n = boids.size();
+    double s = radiusScale();
+    double pushR = pushRadius * s, matchR = matchRadius * s;
+    grid.build(boids, 3 * matchR);
+    // Visit boids in cell order so neighbours are likely in cache
+    for (int k = 0; k < n; ++k) {
+      int i = grid.sorted[k];
+      grid.forNeighbors(i, [&](int j) {
+        if (i != j) interact(i, j, pushR, matchR);
+      });
+    }
+  }
 
-        // Velocity matching
-        double matchRadius = 0.125;
-        double nearness = exp(-al::pow2(dist / matchRadius));
-        Vec2d veli = boids[i].vel;
-        Vec2d velj = boids[j].vel;
+  void step(double dt) {
+    clearSums();
+    if (useGrid) {
+      interactGrid();
+    } else {
+      interactPairwise();
+    }
 
+    for (size_t i = 0; i < boids.size(); ++i) {
+      auto& b = boids[i];
+      b.pos += pushSum[i];
+      if (nearSum[i] > 0) {
         // Take a weighted average of velocities according to nearness
-        boids[i].vel = veli * (1 - 0.5 * nearness) + velj * (0.5 * nearness);
-        boids[j].vel = velj * (1 - 0.5 * nearness) + veli * (0.5 * nearness);
-
-        // TODO: Flock centering
+        double w = 0.5 * nearSum[i] / std::max(1., nearSum[i]);
+        b.vel = b.vel * (1 - w) + velSum[i] / nearSum[i] * w;
+        // Steer toward the (nearness weighted) center of nearby flockmates
+        b.vel += (posSum[i] / nearSum[i] - b.pos) * centerUrge;
       }
-    }
 
-    // Update boid independent behaviors
-    for (auto& b : boids) {
       // Random "hunting" motion
-      float huntUrge = 0.2f;
       auto hunt = rnd::ball<Vec2f>();
       // Use cubed distribution to make small jumps more frequent
       hunt *= hunt.magSqr();
@@ -118,7 +232,40 @@ struct MyApp : public App {
         b.pos.y = b.pos.y > 0 ? 1 : -1;
         b.vel.y = -b.vel.y;
       }
+
+      b.update(dt);
     }
+  }
+};
+
+struct MyApp : public App {
+  // Simulation thread owns the flock and publishes the boids
+  FixedStepSimulation<Flock, std::vector<Boid>> sim;
+  Mesh heads, tails;
+  Mesh box;
+
+  void onCreate() {
+    box.primitive(Mesh::LINE_LOOP);
+    box.vertex(-1, -1);
+    box.vertex(1, -1);
+    box.vertex(1, 1);
+    box.vertex(-1, 1);
+    nav().pullBack(4);
+
+    Flock flock;
+    flock.resize(32);
+    sim.start(
+        flock, 60, [](Flock& f, double dt) { f.step(dt); },
+        [](const Flock& f, std::vector<Boid>& boids) { boids = f.boids; });
+  }
+
+  void onAnimate(double /*dt*/) {
+    sim.update();
+    const auto& prev = sim.previous();
+    const auto& curr = sim.current();
+    // The flock may have been resized between the two states
+    bool interpolate = prev.size() == curr.size();
+    float alpha = sim.alpha();
 
     // Generate meshes
     heads.reset();
@@ -127,14 +274,17 @@ struct MyApp : public App {
     tails.reset();
     tails.primitive(Mesh::LINES);
 
-    for (size_t i = 0; i < Nb; ++i) {
-      boids[i].update(dt);
-
-      heads.vertex(boids[i].pos);
+    int Nb = curr.size();
+    float tailLength = 0.07 * std::max(0.1, std::sqrt(32. / std::max(Nb, 1)));
+    for (int i = 0; i < Nb; ++i) {
+      auto& b = curr[i];
+      Vec2d pos = b.pos;
+      if (interpolate) pos = prev[i].pos + (b.pos - prev[i].pos) * alpha;
+      heads.vertex(pos);
       heads.color(HSV(float(i) / Nb * 0.3f + 0.3f, 0.7f));
 
-      tails.vertex(boids[i].pos);
-      tails.vertex(boids[i].pos - boids[i].vel.normalized(0.07));
+      tails.vertex(pos);
+      tails.vertex(pos - b.vel.normalized(tailLength));
 
       tails.color(heads.colors()[i]);
       tails.color(RGB(0.5));
@@ -144,7 +294,7 @@ struct MyApp : public App {
   void onDraw(Graphics& g) {
     g.clear(0);
     gl::depthTesting(true);
-    gl::pointSize(8);
+    gl::pointSize(sim.current().size() > 1000 ? 2 : 8);
     // g.nicest();
     // g.stroke(8);
     g.meshColor();
@@ -156,14 +306,64 @@ struct MyApp : public App {
     g.draw(box);
   }
 
+  // Time grid and all-pairs steps for increasing flock sizes. All-pairs is
+  // skipped where it would take too long. Runs on the simulation thread,
+  // which pauses the flock meanwhile: the window stays responsive and only
+  // one thread draws from rnd's shared generator.
+  static void benchmark() {
+    Flock bench;
+    for (int n : {32, 1000, 10000, 100000}) {
+      bench.resize(n);
+      for (bool grid : {false, true}) {
+        if (!grid && n > 10000) {
+          std::cout << n << " boids, all-pairs: skipped" << std::endl;
+          continue;
+        }
+        bench.useGrid = grid;
+        int steps = grid ? 20 : std::max(1, 2000000 / (n * n) + 1);
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < steps; ++i) bench.step(1. / 60);
+        auto end = std::chrono::steady_clock::now();
+        double ms =
+            std::chrono::duration<double, std::milli>(end - start).count() /
+            steps;
+        std::cout << n << " boids, " << (grid ? "grid" : "all-pairs") << ": "
+                  << ms << " ms/step" << std::endl;
+      }
+    }
+  }
+
   bool onKeyDown(const Keyboard& k) {
     switch (k.key()) {
       case 'r':
-        resetBoids();
+        sim.post([](Flock& f) { f.reset(); });
+        break;
+      case '1':
+        sim.post([](Flock& f) { f.resize(32); });
+        break;
+      case '2':
+        sim.post([](Flock& f) { f.resize(1000); });
+        break;
+      case '3':
+        sim.post([](Flock& f) { f.resize(10000); });
+        break;
+      case '4':
+        sim.post([](Flock& f) { f.resize(100000); });
+        break;
+      case 'g':
+        sim.post([](Flock& f) {
+          f.useGrid = !f.useGrid;
+          std::cout << (f.useGrid ? "grid" : "all-pairs") << std::endl;
+        });
+        break;
+      case 'b':
+        sim.post([](Flock&) { benchmark(); });
         break;
     }
     return true;
   }
+
+  void onExit() { sim.stop(); }
 };
 
 int main() {
@@ -7,6 +7,23 @@ gravitational pull of a single heavy body.
 
 Press the number keys to reset the particles with different initial conditions.
 
+In N-body mode the bodies also attract each other. The pairwise forces are
+approximated with a Barnes-Hut octree: a cell whose size seen from a body is
+below the opening angle theta acts as a single mass at its center of mass, so
+each step is O(N log N) instead of O(N^2). Forces are evaluated on all cores
+and integrated with a kick-drift-kick leapfrog.
+
+The bodies are stepped at a fixed 60 Hz on their own thread (see
+FixedStepSimulation.hpp) and drawn interpolated between the last two steps.
+
+Keys:
+    1-6     reset with preset initial conditions
+    n       toggle N-body mode
+    [ ]     fewer / more bodies (400 up to 1,000,000)
+    - =     decrease / increase opening angle theta
+    b       benchmark Barnes-Hut against direct summation
+    space   toggle well light
+
 Author:
 Lance Putnam, Nov. 2015
 */
@@ -18,7 +35,15 @@ Lance Putnam, Nov. 2015
 #include "al/math/al_Random.hpp"
 #include "al/system/al_Time.hpp"
 #include <algorithm> // max
+#include <chrono>
 #include <cmath>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "../../tools/graphics/InstancedMesh.hpp"
+#include "FixedStepSimulation.hpp"
+#include "ParallelFor.hpp"
 
 using namespace al;
 using namespace std;
@@ -29,27 +54,244 @@ public:
   Vec3f pos;
   Vec3f vel;
   Vec3f acc;
+};
 
-  void update(double dt) {
-    // Semi-implicit Euler method:
-    vel += acc * dt;
-    pos += vel * dt;
+// Barnes-Hut octree over equal-mass bodies
+class BarnesHut {
+public:
+  float theta = 0.5f;      // Opening angle up to 1; 0 sums all pairs exactly
+  float softening = 0.02f; // Plummer softening length
+  float bodyMass = 1.f;    // Gravitational constant times mass of one body
+
+  void build(const std::vector<Particle> &ps) {
+    int n = ps.size();
+    mIndex.resize(n);
+    mTemp.resize(n);
+    for (int i = 0; i < n; ++i)
+      mIndex[i] = i;
+    mNodes.clear();
+    if (n == 0)
+      return;
+
+    // Bounding cube
+    Vec3f lo = ps[0].pos, hi = ps[0].pos;
+    for (auto &p : ps) {
+      for (int k = 0; k < 3; ++k) {
+        lo[k] = std::min(lo[k], p.pos[k]);
+        hi[k] = std::max(hi[k], p.pos[k]);
+      }
+    }
+    float halfSize =
+        0.5f * std::max(hi[0] - lo[0], std::max(hi[1] - lo[1], hi[2] - lo[2]));
+    mNodes.push_back(Node());
+    mNodes[0].center = (lo + hi) * 0.5f;
+    mNodes[0].halfSize = halfSize * 1.0001f + 1e-6f;
+    buildNode(ps, 0, 0, n, 0);
+  }
+
+  // Add the acceleration due to all other bodies to ps[i].acc. Requires
+  // build() with the current positions.
+  void accumulate(std::vector<Particle> &ps) const {
+    // Walk bodies in tree order so neighboring bodies (on the same thread)
+    // visit the same nodes
+    parallelFor(ps.size(), [&](int begin, int end) {
+      for (int k = begin; k < end; ++k) {
+        int i = mIndex[k];
+        ps[i].acc += accelerationAt(ps, i);
+      }
+    });
+  }
+
+  Vec3f accelerationAt(const std::vector<Particle> &ps, int i) const {
+    const Vec3f x = ps[i].pos;
+    const float eps2 = softening * softening;
+    const float theta2 = theta * theta;
+    Vec3f a(0);
+    int stack[kStackSize];
+    int top = 0;
+    stack[top++] = 0;
+    while (top > 0) {
+      const Node &node = mNodes[stack[--top]];
+      Vec3f d = node.com - x;
+      float r2 = d.magSqr();
+      float size = 2 * node.halfSize;
+      if (node.numChildren == 0) {
+        for (int k = node.begin; k < node.end; ++k) {
+          int j = mIndex[k];
+          if (j == i)
+            continue;
+          Vec3f dj = ps[j].pos - x;
+          float s2 = dj.magSqr() + eps2;
+          a += dj * (bodyMass / (s2 * std::sqrt(s2)));
+        }
+      } else if (size * size < theta2 * r2 && !node.contains(x)) {
+        // Cells around the body are always opened, their mass includes the
+        // body itself
+        float s2 = r2 + eps2;
+        a += d * (node.mass / (s2 * std::sqrt(s2)));
+      } else {
+        for (int c = 0; c < node.numChildren; ++c) {
+          stack[top++] = node.firstChild + c;
+        }
+      }
+    }
+    return a;
   }
+
+  // Reference O(N^2) acceleration on body i
+  Vec3f directAt(const std::vector<Particle> &ps, int i) const {
+    const Vec3f x = ps[i].pos;
+    const float eps2 = softening * softening;
+    Vec3f a(0);
+    for (int j = 0; j < int(ps.size()); ++j) {
+      if (j == i)
+        continue;
+      Vec3f dj = ps[j].pos - x;
+      float s2 = dj.magSqr() + eps2;
+      a += dj * (bodyMass / (s2 * std::sqrt(s2)));
+    }
+    return a;
+  }
+
+  int numNodes() const { return mNodes.size(); }
+
+private:
+  struct Node {
+    Vec3f center; // Geometric center of cell
+    float halfSize = 0;
+    Vec3f com;      // Center of mass
+    float mass = 0; // Total (G times) mass
+    int begin = 0, end = 0;          // Range of bodies in mIndex
+    int firstChild = 0, numChildren = 0; // Children are contiguous
+
+    bool contains(const Vec3f &p) const {
+      return std::fabs(p.x - center.x) <= halfSize &&
+             std::fabs(p.y - center.y) <= halfSize &&
+             std::fabs(p.z - center.z) <= halfSize;
+    }
+  };
+
+  static const int kLeafSize = 8;
+  static const int kMaxDepth = 32;
+  // Each level pushes at most 8 nodes and pops one
+  static const int kStackSize = 7 * kMaxDepth + 8;
+
+  void buildNode(const std::vector<Particle> &ps, int nodeIndex, int begin,
+                 int end, int depth) {
+    mNodes[nodeIndex].begin = begin;
+    mNodes[nodeIndex].end = end;
+    Vec3f center = mNodes[nodeIndex].center;
+    float halfSize = mNodes[nodeIndex].halfSize;
+
+    if (end - begin <= kLeafSize || depth >= kMaxDepth) {
+      Vec3f com(0);
+      for (int k = begin; k < end; ++k)
+        com += ps[mIndex[k]].pos;
+      mNodes[nodeIndex].com = com / float(end - begin);
+      mNodes[nodeIndex].mass = bodyMass * (end - begin);
+      return;
+    }
+
+    // Counting sort bodies into octants
+    int count[8] = {0};
+    auto octant = [&](int i) {
+      const Vec3f &p = ps[i].pos;
+      return (p.x > center.x) | ((p.y > center.y) << 1) |
+             ((p.z > center.z) << 2);
+    };
+    for (int k = begin; k < end; ++k)
+      ++count[octant(mIndex[k])];
+    int start[8];
+    int sum = begin;
+    for (int o = 0; o < 8; ++o) {
+      start[o] = sum;
+      sum += count[o];
+    }
+    int fill[8];
+    std::copy(start, start + 8, fill);
+    for (int k = begin; k < end; ++k) {
+      int i = mIndex[k];
+      mTemp[fill[octant(i)]++] = i;
+    }
+    std::copy(mTemp.begin() + begin, mTemp.begin() + end,
+              mIndex.begin() + begin);
+
+    // Add non-empty children contiguously, then recurse. Recursion appends
+    // to mNodes, so nodes are accessed by index.
+    int firstChild = mNodes.size();
+    int numChildren = 0;
+    float childHalf = 0.5f * halfSize;
+    for (int o = 0; o < 8; ++o) {
+      if (count[o] == 0)
+        continue;
+      Node child;
+      child.center = center + Vec3f(o & 1 ? childHalf : -childHalf,
+                                    o & 2 ? childHalf : -childHalf,
+                                    o & 4 ? childHalf : -childHalf);
+      child.halfSize = childHalf;
+      child.begin = start[o];
+      child.end = start[o] + count[o];
+      mNodes.push_back(child);
+      ++numChildren;
+    }
+    mNodes[nodeIndex].firstChild = firstChild;
+    mNodes[nodeIndex].numChildren = numChildren;
+
+    Vec3f com(0);
+    float mass = 0;
+    for (int c = 0; c < numChildren; ++c) {
+      int childIndex = firstChild + c;
+      buildNode(ps, childIndex, mNodes[childIndex].begin,
+                mNodes[childIndex].end, depth + 1);
+      com += mNodes[childIndex].com * mNodes[childIndex].mass;
+      mass += mNodes[childIndex].mass;
+    }
+    mNodes[nodeIndex].com = com / mass;
+    mNodes[nodeIndex].mass = mass;
+  }
+
+  std::vector<Node> mNodes;
+  std::vector<int> mIndex; // Body indices ordered by octree leaf
+  std::vector<int> mTemp;
+};
+
+// Simulation state, owned by the simulation thread
+struct Bodies {
+  std::vector<Particle> particles;
+  bool accValid = false; // Accelerations match positions
 };
 
 class MyApp : public App {
 public:
-  static const int M = 20;
-  static const int N = M * M;
-  Particle particles[N];
+  // Simulation settings. Only changed on the simulation thread (see post()).
+  int N = 400;
+  bool nbody = false;
+  float cloudMass = 0.05; // Gravitational constant times total mass of bodies
+  BarnesHut tree;
   Particle well;
+
   Mesh body1, body2;
+  InstancedMesh bodies;
   Light light1, light2;
 
+  // Steps Bodies, publishes body positions
+  FixedStepSimulation<Bodies, std::vector<Vec3f>> sim;
+
   void onCreate() override {
-    reset();
+    Bodies initial;
+    reset(initial);
+    sim.start(
+        initial, 60, [this](Bodies &b, double dt) { step(b, dt); },
+        [](const Bodies &b, std::vector<Vec3f> &positions) {
+          positions.resize(b.particles.size());
+          for (size_t i = 0; i < positions.size(); ++i)
+            positions[i] = b.particles[i].pos;
+        });
+
     addIcosahedron(body1, 0.03);
     body1.generateNormals();
+    bodies.init(body1);
+    bodies.lighting(true, Vec3f(1, 1, 1));
     addTorus(body2, 0.03, 0.1);
     body2.generateNormals();
 
@@ -57,7 +299,12 @@ public:
     nav().faceToward(Vec3f(0, 0.7, -1));
   }
 
-  void reset(int preset = '1') {
+  void reset(Bodies &b, int preset = '1') {
+    auto &particles = b.particles;
+    particles.resize(N);
+    int M = std::max(2, int(std::ceil(std::sqrt(float(N)))));
+    b.accValid = false;
+
     switch (preset) {
     case '1': // dust cloud
       for (auto &p : particles) {
@@ -101,27 +348,57 @@ public:
     }
   }
 
-  void onAnimate(double dt_ms) override {
-    // convert millisecond to second
-    float dt = dt_ms;
+  void computeAccelerations(Bodies &b) {
+    auto &particles = b.particles;
+    // Force of the well
+    parallelFor(N, [&](int begin, int end) {
+      for (int i = begin; i < end; ++i) {
+        auto &p = particles[i];
+        // Newton's law of gravity
+        auto r21 = well.pos - p.pos; // distance vector between well and particle
+        auto dist = r21.mag();       // distance between well and particle
+        dist = std::max(dist, 0.1f); // prevent high velocities
+        auto F = r21 / (dist * dist * dist); // force vector acting on particle
 
-    // Compute forces
-    for (auto &p : particles) {
-      // Newton's law of gravity
-      auto r21 = well.pos - p.pos; // distance vector between well and particle
-      auto dist = r21.mag();       // distance between well and particle
-      dist = std::max(dist, 0.1f); // prevent high velocities
-      auto F = r21 / (dist * dist * dist); // force vector acting on particle
+        // Newton's second law of motion, F = ma -> a = F/m
+        p.acc = F * (1. / 10); // mass of particle is 10
+      }
+    });
 
-      // Newton's second law of motion, F = ma -> a = F/m
-      p.acc = F * (1. / 10); // mass of particle is 10
+    // Forces between bodies
+    if (nbody) {
+      tree.bodyMass = cloudMass / N;
+      tree.build(particles);
+      tree.accumulate(particles);
     }
+    b.accValid = true;
+  }
 
-    // Update particles
-    for (auto &p : particles)
-      p.update(dt);
+  // Simulation thread
+  void step(Bodies &b, float dt) {
+    auto &particles = b.particles;
+    if (!b.accValid)
+      computeAccelerations(b);
+
+    // Leapfrog (kick-drift-kick)
+    parallelFor(N, [&](int begin, int end) {
+      for (int i = begin; i < end; ++i) {
+        auto &p = particles[i];
+        p.vel += p.acc * (0.5f * dt);
+        p.pos += p.vel * dt;
+      }
+    });
+    computeAccelerations(b);
+    parallelFor(N, [&](int begin, int end) {
+      for (int i = begin; i < end; ++i) {
+        auto &p = particles[i];
+        p.vel += p.acc * (0.5f * dt);
+      }
+    });
   }
 
+  void onAnimate(double /*dt*/) override { sim.update(); }
+
   void onDraw(Graphics &g) override {
     g.clear(0.1);
 
@@ -147,27 +424,128 @@ public:
     g.color(HSV(0.2));
     g.draw(body2);
 
-    // Draw the particles
-    g.color(HSV(0.67, 0.2, 0.5));
-    for (auto &p : particles) {
-      g.pushMatrix();
-      g.translate(p.pos);
-      g.draw(body1);
-      g.popMatrix();
+    // Draw the particles, one instance per particle
+    Color bodyColor = HSV(0.67, 0.2, 0.5);
+    const auto &prev = sim.previous();
+    const auto &curr = sim.current();
+    float alpha = sim.alpha();
+    bodies.clear();
+    if (prev.size() == curr.size()) {
+      for (size_t i = 0; i < curr.size(); ++i)
+        bodies.add(prev[i] + (curr[i] - prev[i]) * alpha, 1, bodyColor);
+    } else {
+      for (auto &pos : curr)
+        bodies.add(pos, 1, bodyColor);
     }
+    bodies.draw(g);
 
     // cout << "\rfps: " << fps() << rnd::uniform() << flush;
     //		cout << "\rfps: " << fps() << "   " << rnd::uniform() << flush;
   }
 
-  bool onKeyDown(const Keyboard &k) override {
-    reset(k.key());
+  void benchmark() {
+    BarnesHut bench;
+    bench.theta = tree.theta;
+    for (int n : {1000, 10000, 100000, 1000000}) {
+      std::vector<Particle> ps(n);
+      for (auto &p : ps) {
+        p.pos = rnd::ball<Vec3f>();
+        p.acc = Vec3f(0);
+      }
+      bench.bodyMass = cloudMass / n;
+
+      auto t0 = std::chrono::steady_clock::now();
+      bench.build(ps);
+      auto t1 = std::chrono::steady_clock::now();
+      bench.accumulate(ps);
+      auto t2 = std::chrono::steady_clock::now();
+
+      // Direct summation on a sample of bodies, extrapolated to all n
+      int samples = std::min(n, 2000);
+      std::vector<Vec3f> direct(samples);
+      auto t3 = std::chrono::steady_clock::now();
+      parallelFor(samples, [&](int begin, int end) {
+        for (int s = begin; s < end; ++s)
+          direct[s] = bench.directAt(ps, s * (n / samples));
+      });
+      auto t4 = std::chrono::steady_clock::now();
+
+      double maxError = 0;
+      for (int s = 0; s < samples; ++s) {
+        const Vec3f &a = ps[s * (n / samples)].acc;
+        maxError = std::max(maxError, double((a - direct[s]).mag() /
+                                             std::max(direct[s].mag(), 1e-9f)));
+      }
+
+      auto ms = [](std::chrono::steady_clock::duration d) {
+        return std::chrono::duration<double, std::milli>(d).count();
+      };
+      cout << n << " bodies, theta " << bench.theta << ": Barnes-Hut "
+           << ms(t2 - t0) << " ms (build " << ms(t1 - t0) << " ms, "
+           << bench.numNodes() << " nodes), direct "
+           << ms(t4 - t3) * n / samples << " ms"
+           << (samples < n ? " (extrapolated)" : "")
+           << ", max relative error " << maxError << endl;
+    }
+  }
 
-    if (k.key() == ' ') {
+  bool onKeyDown(const Keyboard &k) override {
+    // Settings are changed on the simulation thread, between steps
+    switch (k.key()) {
+    case '1':
+    case '2':
+    case '3':
+    case '4':
+    case '5':
+    case '6': {
+      int preset = k.key();
+      sim.post([this, preset](Bodies &b) { reset(b, preset); });
+    } break;
+    case 'n':
+      sim.post([this](Bodies &b) {
+        nbody = !nbody;
+        b.accValid = false;
+        cout << "N-body " << (nbody ? "on" : "off") << endl;
+      });
+      break;
+    case '[':
+    case ']': {
+      int change = k.key() == ']' ? 1 : -1;
+      sim.post([this, change](Bodies &b) {
+        static const int counts[] = {400, 4000, 40000, 250000, 1000000};
+        int countIndex = 0;
+        while (countIndex < 4 && counts[countIndex] < N)
+          ++countIndex;
+        N = counts[std::min(std::max(countIndex + change, 0), 4)];
+        cout << N << " bodies" << endl;
+        reset(b);
+      });
+    } break;
+    case '-':
+      sim.post([this](Bodies &) {
+        tree.theta = std::max(0.f, tree.theta - 0.1f);
+        cout << "theta " << tree.theta << endl;
+      });
+      break;
+    case '=':
+      sim.post([this](Bodies &) {
+        // Above 1 the error is no longer bounded
+        tree.theta = std::min(1.f, tree.theta + 0.1f);
+        cout << "theta " << tree.theta << endl;
+      });
+      break;
+    case 'b':
+      // Pauses the simulation while running
+      sim.post([this](Bodies &) { benchmark(); });
+      break;
+    case ' ':
       graphics().toggleLight(1);
+      break;
     }
     return true;
   }
+
+  void onExit() override { sim.stop(); }
 };
 
 int main() {
@@ -5,22 +5,209 @@ Description:
 A Lévy flight is a random walk where the step size is determined by a function
 that is heavy-tailed. This example uses a Cauchy distribution.
 
+The trail is kept in a ring of vertices on the GPU. Each frame only the newly
+written vertices are uploaded, and the line strip is drawn as two ranges when
+the ring has wrapped around. The color from the age of a vertex is computed in
+the vertex shader, so the CPU cost per frame does not depend on the length of
+the trail.
+
 Author:
 Lance Putnam, 9/2011
 */
 
 #include "al/app/al_App.hpp"
-#include "al/math/al_Functions.hpp"
 #include "al/math/al_Random.hpp"
-#include "al/types/al_Buffer.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <string>
+#include <vector>
 
 using namespace al;
 
+const std::string trail_vert = R"(
+#version 330
+uniform mat4 al_ModelViewMatrix;
+uniform mat4 al_ProjectionMatrix;
+uniform int newest;
+uniform int capacity;
+
+layout (location = 0) in vec3 position;
+layout (location = 1) in float speed;
+
+out vec4 color;
+
+vec3 hsv2rgb(vec3 c) {
+  vec4 K = vec4(1., 2. / 3., 1. / 3., 3.);
+  vec3 p = abs(fract(c.xxx + K.xyz) * 6. - K.www);
+  return c.z * mix(K.xxx, clamp(p - K.xxx, 0., 1.), c.y);
+}
+
+void main() {
+  // Age in [0, 1), 0 for the newest vertex
+  int index = gl_VertexID % capacity;
+  float f = float((newest - index + capacity) % capacity) / float(capacity);
+  color = vec4(hsv2rgb(vec3((1. - f) * 0.2, clamp(speed * 4. + 0.2, 0., 1.),
+                            1. - f)), 1.);
+  gl_Position = al_ProjectionMatrix * al_ModelViewMatrix * vec4(position, 1.);
+}
+)";
+
+const std::string trail_frag = R"(
+#version 330
+in vec4 color;
+layout (location = 0) out vec4 fragColor;
+void main() { fragColor = color; }
+)";
+
+// Line strip history in a ring of GPU vertices. Vertex 0 is mirrored at the
+// end of the buffer so the strip stays connected across the wrap point.
+class TrailBuffer {
+public:
+  TrailBuffer() = default;
+  ~TrailBuffer() { release(); }
+  // Owns GL objects
+  TrailBuffer(const TrailBuffer&) = delete;
+  TrailBuffer& operator=(const TrailBuffer&) = delete;
+
+  void init(int capacity) {
+    mCapacity = capacity;
+    mVertices.assign(capacity + 1, Vertex{Vec3f(0), 0});
+    mNewest = -1;
+    mCount = 0;
+    mDirtyCount = 0;
+    mAllocated = false;
+  }
+
+  Vec3f newest() const { return mCount ? mVertices[mNewest].pos : Vec3f(0); }
+
+  void write(const Vec3f& p) {
+    int i = (mNewest + 1) % mCapacity;
+    float speed = 0;
+    if (mCount > 0) {
+      int prev = mNewest;
+      // Speed of the newest point is provisional until the next one arrives
+      speed = (p - mVertices[prev].pos).mag() * 2;
+      if (mCount > 1) {
+        int prevprev = (prev - 1 + mCapacity) % mCapacity;
+        set(prev, {mVertices[prev].pos, (p - mVertices[prevprev].pos).mag()});
+      }
+    }
+    set(i, {p, speed});
+    mNewest = i;
+    mCount = std::min(mCount + 1, mCapacity);
+  }
+
+  void draw(Graphics& g) {
+    if (mCount < 2) return;
+    if (!mShaderCompiled) {
+      mShaderCompiled = mShader.compile(trail_vert, trail_frag);
+    }
+    upload();
+
+    g.shader(mShader);
+    g.shader().uniform("newest", mNewest);
+    g.shader().uniform("capacity", mCapacity);
+    g.update();
+
+    glBindVertexArray(mVao);
+    if (mCount < mCapacity) {
+      glDrawArrays(GL_LINE_STRIP, 0, mCount);
+    } else {
+      // Oldest part (through the mirror of vertex 0), then the newest part
+      glDrawArrays(GL_LINE_STRIP, mNewest + 1, mCapacity - mNewest);
+      glDrawArrays(GL_LINE_STRIP, 0, mNewest + 1);
+    }
+    glBindVertexArray(0);
+  }
+
+private:
+  struct Vertex {
+    Vec3f pos;
+    float speed;
+  };
+
+  void set(int i, const Vertex& v) {
+    mVertices[i] = v;
+    if (i == 0) mVertices[mCapacity] = v;
+    // Extend the dirty range (in ring order) to include i
+    if (mDirtyCount == 0) {
+      mDirtyBegin = i;
+      mDirtyCount = 1;
+    } else {
+      mDirtyCount =
+          std::max(mDirtyCount, (i - mDirtyBegin + mCapacity) % mCapacity + 1);
+    }
+  }
+
+  void release() {
+    if (mVao == 0) return;
+    glDeleteBuffers(1, &mBuffer);
+    glDeleteVertexArrays(1, &mVao);
+    mVao = 0;
+    mBuffer = 0;
+  }
+
+  void upload() {
+    if (!mAllocated) {
+      release();  // From before a call to init()
+      glGenVertexArrays(1, &mVao);
+      glGenBuffers(1, &mBuffer);
+      glBindVertexArray(mVao);
+      glBindBuffer(GL_ARRAY_BUFFER, mBuffer);
+      glBufferData(GL_ARRAY_BUFFER, mVertices.size() * sizeof(Vertex),
+                   mVertices.data(), GL_DYNAMIC_DRAW);
+      glEnableVertexAttribArray(0);
+      glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex),
+                            (void*)offsetof(Vertex, pos));
+      glEnableVertexAttribArray(1);
+      glVertexAttribPointer(1, 1, GL_FLOAT, GL_FALSE, sizeof(Vertex),
+                            (void*)offsetof(Vertex, speed));
+      glBindVertexArray(0);
+      mAllocated = true;
+      mDirtyCount = 0;
+      return;
+    }
+    if (mDirtyCount == 0) return;
+
+    glBindBuffer(GL_ARRAY_BUFFER, mBuffer);
+    auto uploadRange = [&](int begin, int count) {
+      glBufferSubData(GL_ARRAY_BUFFER, begin * sizeof(Vertex),
+                      count * sizeof(Vertex), &mVertices[begin]);
+    };
+    int end = mDirtyBegin + mDirtyCount;
+    if (end <= mCapacity) {
+      uploadRange(mDirtyBegin, mDirtyCount);
+    } else {
+      uploadRange(mDirtyBegin, mCapacity - mDirtyBegin);
+      uploadRange(0, end - mCapacity);
+    }
+    if (mDirtyBegin == 0 || end > mCapacity) {
+      uploadRange(mCapacity, 1);  // Mirror of vertex 0
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    mDirtyCount = 0;
+  }
+
+  int mCapacity = 0;
+  std::vector<Vertex> mVertices;  // CPU copy of the ring
+  int mNewest = -1;
+  int mCount = 0;
+  int mDirtyBegin = 0, mDirtyCount = 0;
+
+  bool mAllocated = false;
+  GLuint mVao = 0, mBuffer = 0;
+  ShaderProgram mShader;
+  bool mShaderCompiled = false;
+};
+
 struct MyApp : public App {
-  RingBuffer<Vec3f> A{8000};
-  Mesh vert;
+  TrailBuffer trail;
 
-  void onCreate() { nav().pullBack(4); }
+  void onCreate() {
+    nav().pullBack(4);
+    trail.init(8000);
+  }
 
   void onAnimate(double dt) {
     for (int i = 0; i < 4; ++i) {
@@ -31,26 +218,14 @@ struct MyApp : public App {
       float v = l / (mm + l * l) * 0.1f;  // map uniform to Cauchy distribution
 
       p = p.normalized() * v;
-      p += A.newest();
-      A.write(p);
-    }
-
-    vert.primitive(Mesh::LINE_STRIP);
-    vert.reset();
-    for (int i = 0; i < A.fill(); ++i) {
-      float f = float(i) / A.size();
-      vert.vertex(A.read(i));
-
-      Vec3f dr = A.read(i + 1) - A.read(i - 1);
-
-      vert.color(HSV((1 - f) * 0.2, al::clip(dr.mag() * 4 + 0.2), 1 - f));
+      p += trail.newest();
+      trail.write(p);
     }
   }
 
   void onDraw(Graphics& g) {
     g.clear(0);
-    g.meshColor();
-    g.draw(vert);
+    trail.draw(g);
   }
 };
 
@@ -5,6 +5,18 @@ Description:
 This demonstrates how to build a particle system with a simple fountain-like
 behavior.
 
+Particles are stored as a structure of arrays (one array per coordinate) so
+that integration, aging and spawning are simple loops over contiguous floats
+which the compiler turns into SIMD code. Random numbers for spawning and
+color are a hash of the particle index instead of one rnd::uniform() call
+per value. There is no generator state carried from one particle to the
+next, so those loops vectorize too. Particles are written straight into a
+mesh that is allocated once, so the emitter can handle millions of
+particles.
+
+Keys:
+    1-3     8000, 200000 or 2000000 particles
+
 Author(s):
 Lance Putnam, 4/25/2011
 */
@@ -12,87 +24,189 @@ Lance Putnam, 4/25/2011
 #include "al/app/al_App.hpp"
 #include "al/math/al_Random.hpp"
 
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
 using namespace al;
 
-struct Particle {
-  Vec3f pos, vel, acc;
-  int age = 0;
+// Counter based random numbers: value k of element i is a hash of (key, i,
+// k). Unlike a sequential generator (e.g. xorshift), where each value
+// depends on the previous one, elements are independent, so a loop over
+// them vectorizes. Call nextKey() for a new set of values.
+struct FastRandom {
+  uint32_t key = 2463534242u;
+
+  // lowbias32 integer hash (Chris Wellons)
+  static uint32_t hash(uint32_t x) {
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+  }
+
+  void nextKey() { key = hash(key + 0x9e3779b9u); }
 
-  void update(int ageInc) {
-    vel += acc;
-    pos += vel;
-    age += ageInc;
+  // Up to 8 values (k) per element
+  uint32_t bits(uint32_t i, uint32_t k) const { return hash(key + i * 8 + k); }
+  // [0, 1)
+  float uniform(uint32_t i, uint32_t k) const {
+    return (bits(i, k) >> 8) * (1.f / 16777216.f);
+  }
+  // [lo, hi)
+  float uniform(uint32_t i, uint32_t k, float lo, float hi) const {
+    return lo + (hi - lo) * uniform(i, k);
+  }
+  // [-x, x)
+  float uniformS(uint32_t i, uint32_t k, float x) const {
+    return x * (2.f * uniform(i, k) - 1.f);
   }
 };
 
-template <int N> struct Emitter {
-  Particle particles[N];
+struct Emitter {
+  // Structure of arrays
+  std::vector<float> px, py, pz;
+  std::vector<float> vx, vy, vz;
+  std::vector<float> ay; // only vertical acceleration is used
+  std::vector<int> age;
   int tap = 0;
+  FastRandom rng;
 
-  Emitter() {
-    for (auto &p : particles)
-      p.age = N;
+  void resize(int n) {
+    for (auto *a : {&px, &py, &pz, &vx, &vy, &vz, &ay}) a->assign(n, 0.f);
+    age.assign(n, n);
+    tap = 0;
   }
 
-  template <int M> void update() {
-    for (auto &p : particles)
-      p.update(M);
-
-    for (int i = 0; i < M; ++i) {
-      auto &p = particles[tap];
-
-      // fountain
-      if (rnd::prob(0.95)) {
-        p.vel.set(rnd::uniform(-0.1, -0.05), rnd::uniform(0.12, 0.14),
-                  rnd::uniform(0.01));
-        p.acc.set(0, -0.002, 0);
-
-        // spray
-      } else {
-        p.vel.set(rnd::uniformS(0.01), rnd::uniformS(0.01),
-                  rnd::uniformS(0.01));
-        p.acc.set(0, 0, 0);
-      }
-      p.pos.set(4, -2, 0);
-
-      p.age = 0;
-      ++tap;
-      if (tap >= N)
-        tap = 0;
+  int size() const { return int(px.size()); }
+
+  // Integrate all particles and spawn M new ones
+  void update(int M) {
+    int n = size();
+    integrate(n, M, px.data(), py.data(), pz.data(), vx.data(), vy.data(),
+              vz.data(), ay.data(), age.data());
+
+    // New particles go into the ring at [tap, tap + M), in at most two
+    // contiguous ranges
+    M = std::min(M, n);
+    rng.nextKey();
+    int first = std::min(M, n - tap);
+    spawn(tap, tap + first);
+    spawn(0, M - first);
+    tap = (tap + M) % n;
+  }
+
+  void spawn(int begin, int end) {
+    spawnVelocities(rng, begin, end, vx.data(), vy.data(), vz.data(),
+                    ay.data());
+    std::fill(px.begin() + begin, px.begin() + end, 4.f);
+    std::fill(py.begin() + begin, py.begin() + end, -2.f);
+    std::fill(pz.begin() + begin, pz.begin() + end, 0.f);
+    std::fill(age.begin() + begin, age.begin() + end, 0);
+  }
+
+  // The loops take their arrays as __restrict parameters, which compilers
+  // honor more reliably than __restrict locals once a function is inlined.
+  // Without it the many arrays need too many runtime alias checks to
+  // vectorize.
+  static void integrate(int n, int M, float *__restrict x,
+                        float *__restrict y, float *__restrict z,
+                        const float *__restrict dx, float *__restrict dy,
+                        const float *__restrict dz,
+                        const float *__restrict ddy, int *__restrict a) {
+    for (int i = 0; i < n; ++i) {
+      dy[i] += ddy[i];
+      x[i] += dx[i];
+      y[i] += dy[i];
+      z[i] += dz[i];
+      a[i] += M;
     }
   }
 
-  int size() { return N; }
+  static void spawnVelocities(const FastRandom &r, int begin, int end,
+                              float *__restrict dx, float *__restrict dy,
+                              float *__restrict dz, float *__restrict ddy) {
+    for (int i = begin; i < end; ++i) {
+      // 95% fountain, 5% spray. Both sets of values are computed and blended
+      // with a weight of 0 or 1 so the loop has no branches.
+      float fountain = r.uniform(i, 0) < 0.95f ? 1.f : 0.f;
+      float fx = r.uniform(i, 1, -0.1f, -0.05f);
+      float fy = r.uniform(i, 2, 0.12f, 0.14f);
+      float fz = r.uniform(i, 3, 0.f, 0.01f);
+      float sx = r.uniformS(i, 4, 0.01f);
+      float sy = r.uniformS(i, 5, 0.01f);
+      float sz = r.uniformS(i, 6, 0.01f);
+      dx[i] = sx + (fx - sx) * fountain;
+      dy[i] = sy + (fy - sy) * fountain;
+      dz[i] = sz + (fz - sz) * fountain;
+      ddy[i] = -0.002f * fountain;
+    }
+  }
 };
 
 struct MyApp : public App {
-  Emitter<8000> em1;
+  Emitter em1;
   Mesh mesh;
+  FastRandom rng;
 
-  void onCreate() { nav().pullBack(16); }
-
-  void onAnimate(double dt) {
-    em1.update<40>();
-
+  void resize(int n) {
+    em1.resize(n);
+    // Allocate vertices and colors once; they are overwritten every frame
     mesh.reset();
     mesh.primitive(Mesh::POINTS);
+    mesh.vertices().resize(n);
+    mesh.colors().resize(n);
+  }
 
-    for (int i = 0; i < em1.size(); ++i) {
-      Particle &p = em1.particles[i];
-      float age = float(p.age) / em1.size();
+  void onCreate() {
+    nav().pullBack(16);
+    resize(8000);
+  }
 
-      mesh.vertex(p.pos);
-      mesh.color(HSV(0.6, rnd::uniform(), (1 - age) * 0.4));
+  void onAnimate(double dt) {
+    int n = em1.size();
+    // Particles live for 200 frames
+    em1.update(n / 200);
+
+    auto *verts = mesh.vertices().data();
+    auto *cols = mesh.colors().data();
+    float invN = 1.f / n;
+    rng.nextKey();
+    for (int i = 0; i < n; ++i) {
+      verts[i].set(em1.px[i], em1.py[i], em1.pz[i]);
+
+      // HSV(0.6, s, v) to RGB without the general conversion: hue 0.6 lies
+      // in the cyan-to-blue sector where r = v(1-s), g = v(1-0.6s), b = v
+      float v = (1 - em1.age[i] * invN) * 0.4f;
+      float s = rng.uniform(i, 0);
+      cols[i].set(v * (1 - s), v * (1 - 0.6f * s), v, 1);
     }
   }
 
   void onDraw(Graphics &g) {
     g.clear(0);
     g.blendAdd();
-    gl::pointSize(6);
+    gl::pointSize(em1.size() > 100000 ? 2 : 6);
     g.meshColor();
     g.draw(mesh);
   }
+
+  bool onKeyDown(const Keyboard &k) {
+    switch (k.key()) {
+    case '1':
+      resize(8000);
+      break;
+    case '2':
+      resize(200000);
+      break;
+    case '3':
+      resize(2000000);
+      break;
+    }
+    return true;
+  }
 };
 
 int main() { MyApp().start(); }
@@ -19,106 +19,169 @@ in the x and y directions.
 
 See also: http://locklessinc.com/articles/wave_eqn/
 
+The solver keeps the current and previous time steps in two separate planes.
+Each row is computed with the toroidal wrap handled once per row: the two
+boundary columns are peeled off and the interior is a branch-free loop over
+contiguous memory, which the compiler vectorizes. Large grids are split into
+bands of rows computed in parallel (see ParallelFor.hpp).
+
+Only the heights are uploaded each frame. The surface normals are computed in
+the vertex shader from the neighboring heights (see HeightFieldMesh.hpp).
+
+Keys:
+    1-5     grid of 256, 512, 1024, 2048 or 4096 squared
+    b       benchmark (cells per second) for all grid sizes
+
 Author:
 Lance Putnam, Oct. 2014
 */
 
 #include "al/app/al_App.hpp"
-#include "al/graphics/al_Shapes.hpp"
 #include "al/math/al_Random.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <vector>
+
+#include "HeightFieldMesh.hpp"
+#include "ParallelFor.hpp"
+
 using namespace al;
 
-struct MyApp : public App {
-  static const int Nx = 256, Ny = Nx;
-  float wave[Nx * Ny * 2];  // Values of wave for current and previous time step
-  int zcurr = 0;            // The current "plane" coordinate representing time
+struct WaveSolver {
+  int Nx = 0, Ny = 0;
+  std::vector<float> curr;  // Values of wave for current time step
+  std::vector<float> prev;  // Values of wave for previous time step
   float decay = 0.96f;      // Decay factor of waves, in (0, 1]
   float velocity = 0.5f;    // Velocity of wave propagation, in (0, 0.5]
 
-  Mesh mesh;
-  Light light;
-  Material mtrl;
+  void resize(int nx, int ny) {
+    Nx = nx;
+    Ny = ny;
+    curr.assign(Nx * Ny, 0.f);
+    prev.assign(Nx * Ny, 0.f);
+  }
 
-  void onCreate() {
-    for (auto& v : wave) v = 0;
+  // Add a Gaussian-shaped droplet to both time steps
+  void addDroplet(int ix, int iy) {
+    for (int j = -4; j <= 4; ++j) {
+      for (int i = -4; i <= 4; ++i) {
+        float x = float(i) / 4;
+        float y = float(j) / 4;
+        float v = 0.5 * exp(-(x * x + y * y) / (0.5 * 0.5));
+        curr[(iy + j) * Nx + ix + i] += v;
+        prev[(iy + j) * Nx + ix + i] += v;
+      }
+    }
+  }
 
-    // Add a tessellated plane
-    addSurface(mesh, Nx, Ny);
+  // Compute rows [j0, j1) of the next time step into prev
+  void stepRows(int j0, int j1) {
+    const float v = velocity, d = decay;
+    for (int j = j0; j < j1; ++j) {
+      // Neighbor rows; wrap toroidally
+      int jm1 = j != 0 ? j - 1 : Ny - 1;
+      int jp1 = j != Ny - 1 ? j + 1 : 0;
+      const float *__restrict c = &curr[j * Nx];
+      const float *__restrict cd = &curr[jm1 * Nx];
+      const float *__restrict cu = &curr[jp1 * Nx];
+      float *__restrict p = &prev[j * Nx];
+
+      // Compute next value of wave equation and store in previous plane
+      // since we don't need it again
+      auto cell = [&](int i, int im1, int ip1) {
+        float vc = c[i];
+        p[i] = (2 * vc - p[i] +
+                v * ((c[im1] - 2 * vc + c[ip1]) + (cd[i] - 2 * vc + cu[i]))) *
+               d;
+      };
+
+      // Peeled boundary columns
+      cell(0, Nx - 1, 1);
+      // Interior
+      for (int i = 1; i < Nx - 1; ++i) {
+        float vc = c[i];
+        p[i] = (2 * vc - p[i] + v * ((c[i - 1] - 2 * vc + c[i + 1]) +
+                                     (cd[i] - 2 * vc + cu[i]))) *
+               d;
+      }
+      cell(Nx - 1, Nx - 2, 0);
+    }
+  }
 
-    nav().pullBack(4);
+  void step() {
+    // Threads only pay off once a band is large enough (128K cells)
+    int minRows = std::max(1, 128 * 1024 / std::max(1, Nx));
+    parallelFor(
+        Ny, [this](int j0, int j1) { stepRows(j0, j1); }, minRows);
+    std::swap(curr, prev);
+  }
+};
+
+struct MyApp : public App {
+  WaveSolver wave;
+  HeightFieldMesh surface;
 
-    light.dir(1, 1, 1);
-    mtrl.specular(RGB(1));
-    mtrl.shininess(30);
+  void resize(int n) {
+    wave.resize(n, n);
+    surface.create(n, n);
   }
 
-  int indexAt(int x, int y, int z) {
-    // return (z*Nx + y)*Ny + x;
-    return (y * Nx + x) * 2 + z;  // may give slightly faster accessing
+  void onCreate() {
+    resize(256);
+
+    nav().pullBack(4);
   }
 
   void onAnimate(double /*dt*/) {
-    int zprev = 1 - zcurr;
+    int Nx = wave.Nx, Ny = wave.Ny;
 
     // Add some random droplets
     for (int k = 0; k < 3; ++k) {
       if (rnd::prob(0.01)) {
-        // Add a Gaussian-shaped droplet
-        int ix = rnd::uniform(Nx - 8) + 4;
-        int iy = rnd::uniform(Ny - 8) + 4;
-        for (int j = -4; j <= 4; ++j) {
-          for (int i = -4; i <= 4; ++i) {
-            float x = float(i) / 4;
-            float y = float(j) / 4;
-            float v = 0.5 * exp(-(x * x + y * y) / (0.5 * 0.5));
-            wave[indexAt(ix + i, iy + j, zcurr)] += v;
-            wave[indexAt(ix + i, iy + j, zprev)] += v;
-          }
-        }
+        wave.addDroplet(rnd::uniform(Nx - 8) + 4, rnd::uniform(Ny - 8) + 4);
       }
     }
 
     // Update wave equation
-    for (int j = 0; j < Ny; ++j) {
-      for (int i = 0; i < Nx; ++i) {
-        // Neighbor indices; wrap toroidally
-        int im1 = i != 0 ? i - 1 : Nx - 1;
-        int ip1 = i != Nx - 1 ? i + 1 : 0;
-        int jm1 = j != 0 ? j - 1 : Ny - 1;
-        int jp1 = j != Nx - 1 ? j + 1 : 0;
-
-        // Get neighborhood of samples
-        auto vp = wave[indexAt(i, j, zprev)];    // previous value
-        auto vc = wave[indexAt(i, j, zcurr)];    // current value
-        auto vl = wave[indexAt(im1, j, zcurr)];  // neighbor left
-        auto vr = wave[indexAt(ip1, j, zcurr)];  // neighbor right
-        auto vd = wave[indexAt(i, jm1, zcurr)];  // neighbor up
-        auto vu = wave[indexAt(i, jp1, zcurr)];  // neighbor down
-
-        // Compute next value of wave equation at (i,j)
-        auto val =
-            2 * vc - vp + velocity * ((vl - 2 * vc + vr) + (vd - 2 * vc + vu));
-
-        // Store in previous value since we don't need it again
-        wave[indexAt(i, j, zprev)] = val * decay;
-
-        int idx = j * Nx + i;
-        mesh.vertices()[idx].z = val;
-      }
-    }
-
-    mesh.generateNormals();
+    wave.step();
 
-    zcurr = zprev;
+    surface.update(wave.curr.data());
   }
 
   void onDraw(Graphics& g) {
     g.clear(0);
-    g.lighting(true);
-    g.light(light);
-    g.tint(HSV(0.6, 0.2, 0.9));
-    g.material(mtrl);
-    g.draw(mesh);
+    surface.draw(g, Vec3f(1, 1, 1), Vec3f(nav().pos()), HSV(0.6, 0.2, 0.9),
+                 30);
+  }
+
+  void benchmark() {
+    WaveSolver bench;
+    for (int n = 256; n <= 4096; n *= 2) {
+      bench.resize(n, n);
+      bench.addDroplet(n / 2, n / 2);
+      int steps = std::max(4, (1 << 28) / (n * n));
+      auto start = std::chrono::steady_clock::now();
+      for (int i = 0; i < steps; ++i) bench.step();
+      auto end = std::chrono::steady_clock::now();
+      double sec = std::chrono::duration<double>(end - start).count();
+      std::cout << n << "x" << n << ": " << double(n) * n * steps / sec / 1e6
+                << " Mcells/s (" << 1000 * sec / steps << " ms/step)"
+                << std::endl;
+    }
+  }
+
+  bool onKeyDown(const Keyboard& k) {
+    switch (k.key()) {
+      case '1': resize(256); break;
+      case '2': resize(512); break;
+      case '3': resize(1024); break;
+      case '4': resize(2048); break;
+      case '5': resize(4096); break;
+      case 'b': benchmark(); break;
+    }
+    return true;
   }
 };
 
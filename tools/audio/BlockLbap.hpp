@@ -0,0 +1,166 @@
+#pragma once
+#ifndef BlockLbap_H
+#define BlockLbap_H
+
+// Block-rate LBAP spatializer.
+//
+// al::Lbap evaluates the panning law for every sample of every source. For
+// the 60 channel AlloSphere layout that work dominates the audio callback
+// once there are more than a handful of sources, even though a source only
+// ever feeds the (at most four) speakers around it.
+//
+// BlockLbap computes the LBAP gains once per block per source by probing the
+// base class with a single unit sample, then ramps linearly from the previous
+// block's gains to the new ones across the block. Only speakers with a non
+// zero gain at either end of the ramp are written, and the inner loop is a
+// fused multiply-add over contiguous output buffers (see MixKernels.hpp).
+//
+// DynamicScene does not tell the spatializer which voice a buffer belongs
+// to, so interpolation state is kept per call slot (the order voices are
+// rendered in since prepare()). When the direction for a slot jumps, e.g.
+// because a voice was added or removed and the order shifted, the gains snap
+// instead of ramping, which is what plain Lbap does on every block.
+//
+// Optional per speaker gain and delay compensation is applied as the gains
+// are written (see SpeakerCompensation.hpp).
+
+#include "al/io/al_AudioIOData.hpp"
+#include "al/sound/al_Lbap.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <vector>
+
+#include "MixKernels.hpp"
+#include "SpeakerCompensation.hpp"
+
+class BlockLbap : public al::Lbap {
+public:
+  BlockLbap(const al::Speakers &sl) : al::Lbap(sl) {
+    for (const auto &spkr : sl) {
+      if (spkr.deviceChannel + 1 > mNumChannels) {
+        mNumChannels = spkr.deviceChannel + 1;
+      }
+    }
+  }
+
+  void compile() override {
+    al::Lbap::compile();
+    mProbe.framesPerBuffer(1);
+    mProbe.channelsOut(mNumChannels);
+    mSlots.clear();
+  }
+
+  // Gain and delay (in samples) per device channel. Must be called before
+  // audio starts.
+  void setCompensation(std::vector<float> gains, std::vector<float> delays) {
+    mOutput.configure(gains, delays);
+  }
+
+  void prepare(al::AudioIOData &io) override {
+    al::Lbap::prepare(io);
+    mOutput.beginBlock(io);
+    mCurrentSlot = 0;
+  }
+
+  void renderBuffer(al::AudioIOData &io, const al::Pose &listeningPose,
+                    const float *samples,
+                    const unsigned int &numFrames) override {
+    if (mCurrentSlot >= mSlots.size()) {
+      // Only allocates the first time a given number of sources plays
+      mSlots.resize(mCurrentSlot + 1);
+      mSlots.back().gains.resize(mNumChannels, 0.0f);
+    }
+    SourceSlot &slot = mSlots[mCurrentSlot++];
+
+    // Evaluate LBAP once for this block
+    const float one = 1.0f;
+    mProbe.zeroOut();
+    al::Lbap::renderBuffer(mProbe, listeningPose, &one, 1);
+
+    al::Vec3f dir = listeningPose.pos();
+    dir.normalize();
+    bool snap = !slot.valid || dir.dot(slot.direction) < kSnapCosine;
+    slot.direction = dir;
+    slot.valid = true;
+
+    const float invFrames = numFrames > 0 ? 1.0f / numFrames : 0.0f;
+    int outChannels = std::min(mNumChannels, (int)io.channelsOut());
+    for (int ch = 0; ch < outChannels; ch++) {
+      float g1 = mProbe.outBuffer(ch)[0];
+      float g0 = snap ? g1 : slot.gains[ch];
+      slot.gains[ch] = g1;
+      if (g0 == 0.0f && g1 == 0.0f) {
+        continue;
+      }
+      mOutput.write(io, ch, samples, numFrames, g0, (g1 - g0) * invFrames);
+    }
+  }
+
+  int numChannels() const { return mNumChannels; }
+
+private:
+  struct SourceSlot {
+    std::vector<float> gains;
+    al::Vec3f direction;
+    bool valid{false};
+  };
+
+  // Directions further apart than ~60 degrees between consecutive blocks are
+  // treated as a different source.
+  static constexpr float kSnapCosine = 0.5f;
+
+  int mNumChannels{0};
+  al::AudioIOData mProbe;
+  CompensatedOutput mOutput;
+  std::vector<SourceSlot> mSlots;
+  size_t mCurrentSlot{0};
+};
+
+// Renders numSources moving sources through a spatializer for numBlocks and
+// prints the average time per block against the real time budget.
+// Used to compare BlockLbap with Lbap (target: 256 sources x 60 channels on
+// one core).
+inline double benchmarkSpatializer(al::Spatializer &spatializer,
+                                   const char *name, int numChannels,
+                                   int numSources, int framesPerBuffer,
+                                   double sampleRate, int numBlocks = 200) {
+  al::AudioIOData io;
+  io.framesPerBuffer(framesPerBuffer);
+  io.framesPerSecond(sampleRate);
+  io.channelsOut(numChannels);
+
+  std::vector<float> source(framesPerBuffer);
+  for (int i = 0; i < framesPerBuffer; i++) {
+    source[i] = std::sin(i * 0.05f);
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  for (int block = 0; block < numBlocks; block++) {
+    io.zeroOut();
+    spatializer.prepare(io);
+    for (int s = 0; s < numSources; s++) {
+      float az = s * 0.7f + block * 0.002f;
+      float el = std::sin(s * 0.31f) * 0.8f;
+      al::Pose pose(al::Vec3d(std::sin(az) * std::cos(el), std::sin(el),
+                              std::cos(az) * std::cos(el)));
+      spatializer.renderBuffer(io, pose, source.data(), framesPerBuffer);
+    }
+    spatializer.finalize(io);
+  }
+  auto end = std::chrono::steady_clock::now();
+
+  double usPerBlock =
+      std::chrono::duration<double, std::micro>(end - start).count() /
+      numBlocks;
+  double budgetUs = 1.0e6 * framesPerBuffer / sampleRate;
+  std::cout << name << ": " << numSources << " sources x " << numChannels
+            << " channels, " << framesPerBuffer << " frames: " << usPerBlock
+            << " us/block (" << 100.0 * usPerBlock / budgetUs
+            << "% of real time)" << std::endl;
+  return usPerBlock;
+}
+
+#endif
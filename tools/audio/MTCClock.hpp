@@ -0,0 +1,455 @@
+#pragma once
+#ifndef MTCClock_H
+#define MTCClock_H
+
+// Timecode clock locked to incoming MIDI Time Code.
+//
+// MTCParser only reports a complete time every eight quarter frames (two
+// frames), and the arrival times of MIDI bytes jitter by a millisecond or
+// more. Chasing those positions directly makes playback jump back and forth.
+// MTCClock instead counts every quarter frame and runs a phase locked loop
+// (a second order delay locked loop) that estimates the timecode position
+// and its rate against the local clock. position() then gives a smooth
+// position for any moment, not only when a quarter frame arrives.
+//
+// - Jumps: a quarter frame more than jumpThreshold from the prediction, or
+//   a decoded time that doesn't follow from the previous one, restarts the
+//   loop at the new position.
+// - Drop-outs: without quarter frames for dropoutTime the clock reports
+//   Stopped and holds its last position.
+// - Full frame messages (sent by most masters when locating) move the
+//   stopped clock to the new position.
+//
+// Every restart and locate increments generation() and calls onLocate with
+// the new position, from the thread calling feed(). Streaming players can use
+// it to seek ahead of time, before the audio thread needs the data.
+//
+// feed() publishes status, position, rate and generation together as a
+// Snapshot behind a sequence lock. Reading it never blocks and always gives
+// values from the same update, so it is safe from the audio thread.
+//
+// On the audio thread MTCFollower turns the clock into a position for every
+// sample of a block: it advances by the clock's rate and slews gently toward
+// the clock position, so callback timing jitter doesn't reach the output.
+//
+// Typical use:
+//
+//   // MIDI callback
+//   clock.feed(m.bytes, 2);
+//   // onSound()
+//   if (follower.block(clock, io.framesPerBuffer(), io.framesPerSecond())) {
+//     // sample i is at timecode follower.start() + i * follower.increment()
+//   }
+//
+// Times are seconds of timecode (hours, minutes, seconds and frames converted
+// at the frame rate, real time for 29.97 drop frame) and seconds on a
+// monotonic clock (now()).
+
+#include "MTCParser.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <mutex>
+
+class MTCClock {
+public:
+  enum class Status { Stopped, Locking, Locked };
+
+  double bandwidth = 1.0;       // Loop bandwidth in Hz, 4x while locking
+  double jumpThreshold = 0.1;   // Seconds of prediction error
+  double dropoutTime = 0.25;    // Seconds without quarter frames
+  double lockThreshold = 0.002; // Seconds of error counted as locked
+  int lockCount = 32;           // Quarter frames within lockThreshold to lock
+
+  // New position after a start, jump or locate
+  std::function<void(double position)> onLocate;
+
+  // Clock state from one update of feed()
+  struct Snapshot {
+    Status state;
+    uint32_t generation;  // Incremented on every start, jump and locate
+    double anchorTime;     // Loop estimate: anchorPosition at anchorTime,
+    double anchorPosition; // advancing at loopRate
+    double loopRate;
+    double heldPosition; // While stopped
+    double holdUntil;    // Stopped when no quarter frame came by this time
+
+    double position(double time) const {
+      if (state == Status::Stopped) {
+        return heldPosition;
+      }
+      return anchorPosition +
+             loopRate * (std::min(time, holdUntil) - anchorTime);
+    }
+    double rate() const { return state == Status::Stopped ? 0.0 : loopRate; }
+    Status status(double time) const {
+      return state != Status::Stopped && time > holdUntil ? Status::Stopped
+                                                          : state;
+    }
+  };
+
+  struct Stats {
+    uint64_t quarterFrames{0};
+    uint64_t jumps{0};
+    uint64_t dropouts{0};
+    uint64_t locates{0}; // Full frame messages
+    double jitter{0};    // Mean absolute loop error in seconds
+  };
+
+  MTCClock() { publish(); }
+
+  static double now() {
+    return std::chrono::duration<double>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+  }
+
+  // Frames per second for an MTC type (0: 24, 1: 25, 2: 29.97 drop frame,
+  // 3: 30)
+  static double frameRate(uint8_t type) {
+    static const double rates[4] = {24.0, 25.0, 30000.0 / 1001.0, 30.0};
+    return rates[type & 3];
+  }
+
+  // Timecode to seconds, see MTCParser::frameCount()
+  static double toSeconds(uint8_t type, int hour, int minute, int second,
+                          int frame) {
+    MTCParser::MTCPacket packet{};
+    packet.type = type & 3;
+    packet.hour = uint8_t(hour);
+    packet.minute = uint8_t(minute);
+    packet.second = uint8_t(second);
+    packet.frame = uint8_t(frame);
+    return MTCParser::frameCount(packet) / frameRate(type);
+  }
+
+  // Seconds to timecode, the inverse of toSeconds()
+  static void toTimecode(uint8_t type, double seconds, int &hour, int &minute,
+                         int &second, int &frame) {
+    int64_t nominal = type == 0 ? 24 : type == 1 ? 25 : 30;
+    int64_t frames = int64_t(std::floor(seconds * frameRate(type) + 1e-6));
+    if ((type & 3) == 2) {
+      // Add back the frame numbers skipped so far. 17982 frames per ten
+      // minutes, 1798 per minute after the first.
+      int64_t tens = frames / 17982;
+      int64_t rest = frames % 17982;
+      frames += 18 * tens;
+      if (rest > 1) {
+        frames += 2 * ((rest - 2) / 1798);
+      }
+    }
+    frame = int(frames % nominal);
+    int64_t total = frames / nominal;
+    second = int(total % 60);
+    minute = int(total / 60 % 60);
+    hour = int(total / 3600 % 24);
+  }
+
+  // MIDI bytes as received, at the time they arrived. Quarter frames (F1 xx)
+  // and full frame sysex may be split across calls.
+  void feed(const uint8_t *data, size_t size, double time = now()) {
+    for (size_t i = 0; i < size; i++) {
+      feed(data[i], time);
+    }
+  }
+
+  void feed(uint8_t byte, double time = now()) {
+    if (byte >= 0xF8) {
+      // Real time bytes (MIDI clock, ...) may come anywhere, even between a
+      // quarter frame's status and data byte
+      return;
+    }
+    mParser.feed(byte);
+    if (mQuarterFrameData && byte < 0x80) {
+      mQuarterFrameData = false;
+      quarterFrame((byte >> 4) & 7, time);
+    } else {
+      mQuarterFrameData = byte == 0xF1;
+      if (mParser.available() && mParser.fullFrame()) {
+        mParser.pop();
+        mType = mParser.type() & 3;
+        locate(toSeconds(mType, mParser.hour(), mParser.minute(),
+                         mParser.second(), mParser.frame()),
+               time);
+      }
+    }
+  }
+
+  // Lock free, from any thread. Use one snapshot for values that must agree
+  // (e.g. position and generation).
+  Snapshot snapshot() const { return mShared.load(); }
+
+  // Timecode position at a time. Held at the last position while stopped.
+  double position(double time = now()) const {
+    return snapshot().position(time);
+  }
+
+  // Timecode seconds per second
+  double rate() const { return snapshot().rate(); }
+
+  Status status(double time = now()) const { return snapshot().status(time); }
+
+  // Incremented on every start, jump and locate
+  uint32_t generation() const { return snapshot().generation; }
+
+  // MTC type of the last complete time, see frameRate()
+  uint8_t type() const { return mType; }
+
+  Stats stats() const {
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mStats;
+  }
+  void resetStats() {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mStats = Stats();
+  }
+
+private:
+  // Sequence lock for a single writer. The words are atomics, so readers
+  // racing with a store see torn data only in copies they then discard.
+  class SharedSnapshot {
+  public:
+    void store(const Snapshot &snapshot) {
+      uint64_t words[kWords] = {};
+      memcpy(words, &snapshot, sizeof(Snapshot));
+      uint32_t sequence = mSequence.load(std::memory_order_relaxed);
+      mSequence.store(sequence + 1, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_release);
+      for (size_t i = 0; i < kWords; i++) {
+        mWords[i].store(words[i], std::memory_order_relaxed);
+      }
+      mSequence.store(sequence + 2, std::memory_order_release);
+    }
+
+    Snapshot load() const {
+      uint64_t words[kWords];
+      uint32_t before, after;
+      do {
+        before = mSequence.load(std::memory_order_acquire);
+        for (size_t i = 0; i < kWords; i++) {
+          words[i] = mWords[i].load(std::memory_order_relaxed);
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        after = mSequence.load(std::memory_order_relaxed);
+      } while ((before & 1) || before != after);
+      Snapshot snapshot;
+      memcpy(&snapshot, words, sizeof(Snapshot));
+      return snapshot;
+    }
+
+  private:
+    static const size_t kWords = (sizeof(Snapshot) + 7) / 8;
+    std::atomic<uint32_t> mSequence{0};
+    std::atomic<uint64_t> mWords[kWords] = {};
+  };
+
+  double predict(double time) const {
+    return mAnchorPosition + mRate * (time - mAnchorTime);
+  }
+
+  void publish() {
+    Snapshot snapshot;
+    snapshot.state = mStatus;
+    snapshot.generation = mGeneration;
+    snapshot.anchorTime = mAnchorTime;
+    snapshot.anchorPosition = mAnchorPosition;
+    snapshot.loopRate = mRate;
+    snapshot.heldPosition = mHeldPosition;
+    snapshot.holdUntil = mLastQuarterFrame + dropoutTime;
+    mShared.store(snapshot);
+  }
+
+  void quarterFrame(int piece, double time) {
+    bool contiguous = piece == ((mLastPiece + 1) & 7) &&
+                      time - mLastPieceTime < dropoutTime;
+    mLastPiece = piece;
+    mLastPieceTime = time;
+    mPieces = contiguous ? mPieces + 1 : 0;
+
+    if (piece == 0 && contiguous && mHasGroup) {
+      mGroupStart += 2.0 / frameRate(mType);
+    }
+    if (piece == 7) {
+      // Only trust times assembled from all eight pieces in order
+      if (mParser.available() && mPieces >= 7) {
+        mType = mParser.type() & 3;
+        double decoded = toSeconds(mType, mParser.hour(), mParser.minute(),
+                                   mParser.second(), mParser.frame());
+        if (!mHasGroup ||
+            std::fabs(decoded - mGroupStart) > 0.5 / frameRate(mType)) {
+          mGroupStart = decoded;
+          mHasGroup = true;
+        }
+      }
+      mParser.pop();
+    }
+    if (!contiguous) {
+      // Wait for the next complete time
+      mHasGroup = false;
+    }
+    if (!mHasGroup) {
+      return;
+    }
+
+    // The time of a group is the time of its piece 0
+    double quarter = 0.25 / frameRate(mType);
+    double measured = mGroupStart + piece * quarter;
+    double located = -1;
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      mStats.quarterFrames++;
+      if (mStatus == Status::Stopped ||
+          time - mLastQuarterFrame > dropoutTime) {
+        if (mStatus != Status::Stopped) {
+          mStats.dropouts++;
+        }
+        if (mStatus != Status::Stopped ||
+            std::fabs(measured - mHeldPosition) > jumpThreshold) {
+          located = measured;
+        }
+        restart(measured, time);
+      } else {
+        double error = measured - predict(time);
+        if (std::fabs(error) > jumpThreshold) {
+          mStats.jumps++;
+          located = measured;
+          restart(measured, time);
+        } else {
+          // Second order loop, updated once per quarter frame period T
+          double period = quarter / mRate;
+          double b = mStatus == Status::Locked ? bandwidth : 4 * bandwidth;
+          double omega = 2 * M_PI * b * period;
+          mAnchorPosition = predict(time) + std::sqrt(2.0) * omega * error;
+          mAnchorTime = time;
+          mRate += omega * omega * error / period;
+          mRate = std::max(0.5, std::min(2.0, mRate));
+
+          mStats.jitter += (std::fabs(error) - mStats.jitter) / 16.0;
+          if (std::fabs(error) < lockThreshold) {
+            if (++mGoodFrames >= lockCount) {
+              mStatus = Status::Locked;
+            }
+          } else {
+            mGoodFrames = 0;
+          }
+        }
+      }
+      mLastQuarterFrame = time;
+    }
+    publish();
+    if (located >= 0 && onLocate) {
+      onLocate(located);
+    }
+  }
+
+  void restart(double position, double time) {
+    mAnchorPosition = position;
+    mAnchorTime = time;
+    mRate = 1.0;
+    mGoodFrames = 0;
+    mStatus = Status::Locking;
+    mGeneration++;
+  }
+
+  void locate(double position, double time) {
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      if (mStatus != Status::Stopped &&
+          time - mLastQuarterFrame > dropoutTime) {
+        mStats.dropouts++;
+      }
+      mStatus = Status::Stopped;
+      mHeldPosition = position;
+      mStats.locates++;
+      mGeneration++;
+    }
+    publish();
+    mHasGroup = false;
+    if (onLocate) {
+      onLocate(position);
+    }
+  }
+
+  // feed() thread only
+  MTCParser mParser;
+  bool mQuarterFrameData{false};
+  int mLastPiece{-1};
+  double mLastPieceTime{-1e9};
+  int mPieces{0}; // Contiguous pieces before the last one
+  bool mHasGroup{false};
+  double mGroupStart{0};
+  std::atomic<uint8_t> mType{3}; // Also read by type()
+
+  // Loop state, feed() thread only. Other threads see it through mShared.
+  Status mStatus{Status::Stopped};
+  double mAnchorTime{0};
+  double mAnchorPosition{0};
+  double mRate{1.0};
+  double mHeldPosition{0};
+  double mLastQuarterFrame{-1e9};
+  int mGoodFrames{0};
+  uint32_t mGeneration{0};
+  SharedSnapshot mShared;
+
+  mutable std::mutex mMutex; // Guards mStats
+  Stats mStats;
+};
+
+// Timecode for each sample of an audio block, following an MTCClock.
+// Use from the audio thread only.
+class MTCFollower {
+public:
+  double maxCorrection = 0.002; // Largest rate change while slewing
+  double correctionTime = 0.5;  // Seconds to remove an offset
+
+  // Call once per block. Returns false while the clock is stopped.
+  bool block(const MTCClock &clock, int frames, double sampleRate,
+             double time = MTCClock::now()) {
+    mResynced = false;
+    // One consistent, lock free read of the clock
+    const MTCClock::Snapshot state = clock.snapshot();
+    if (state.status(time) == MTCClock::Status::Stopped) {
+      mRunning = false;
+      return false;
+    }
+    double target = state.position(time);
+    double rate = state.rate();
+    uint32_t generation = state.generation;
+    double error = target - mPosition;
+    if (!mRunning || generation != mGeneration ||
+        std::fabs(error) > clock.jumpThreshold) {
+      mPosition = target;
+      mGeneration = generation;
+      mRunning = true;
+      mResynced = true;
+      error = 0;
+    }
+    double correction = std::max(
+        -maxCorrection, std::min(maxCorrection, error / correctionTime));
+    mStart = mPosition;
+    mIncrement = (rate + correction) / sampleRate;
+    mPosition += mIncrement * frames;
+    return true;
+  }
+
+  double start() const { return mStart; }         // Timecode of sample 0
+  double increment() const { return mIncrement; } // Timecode per sample
+  // True if this block doesn't continue the previous one
+  bool resynced() const { return mResynced; }
+
+private:
+  bool mRunning{false};
+  bool mResynced{false};
+  uint32_t mGeneration{0};
+  double mPosition{0};
+  double mStart{0};
+  double mIncrement{0};
+};
+
+#endif
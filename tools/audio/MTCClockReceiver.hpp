@@ -0,0 +1,37 @@
+#pragma once
+#ifndef MTCClockReceiver_H
+#define MTCClockReceiver_H
+
+// Feeds an MTCClock from a MIDI input.
+//
+// MIDIMessageHandler passes at most three bytes per message, so full frame
+// (sysex) messages never arrive through it. This takes the raw messages from
+// RtMidi instead, quarter frames and sysex alike, timestamped when the
+// callback runs.
+
+#include "al/io/al_MIDI.hpp"
+
+#include "MTCClock.hpp"
+
+#include <vector>
+
+class MTCClockReceiver {
+public:
+  MTCClock clock;
+
+  // midiIn must not have a callback (e.g. a MIDIMessageHandler) yet
+  void bindTo(RtMidiIn &midiIn) {
+    // Receive sysex and time code, ignore active sensing
+    midiIn.ignoreTypes(false, false, true);
+    midiIn.setCallback(&MTCClockReceiver::callback, this);
+  }
+
+private:
+  static void callback(double /*deltaTime*/,
+                       std::vector<unsigned char> *message, void *userData) {
+    auto receiver = static_cast<MTCClockReceiver *>(userData);
+    receiver->clock.feed(message->data(), message->size());
+  }
+};
+
+#endif
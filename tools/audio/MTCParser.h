@@ -46,11 +46,32 @@
 // 6	 0110 hhhh Hour lsbits
 // 7	 0111 0rrh Rate and hour msbit
 
+// ---------- Parsing ----------
+// Bytes go through a transition table indexed by parser state and byte,
+// built once, instead of a switch per byte. On Arduino the table (2.8 KB)
+// wouldn't fit in SRAM, so the same transitions are computed per byte
+// there. Real time bytes (F8-FF), which MIDI allows anywhere, leave the
+// state alone. A quarter frame time is only
+// reported once all eight pieces arrived in order, and a time only if its
+// fields are in range.
+//
+// feed() keeps the latest time for available() / pop(). feedBuffer() takes
+// whole MIDI buffers with the time they arrived and queues every time it
+// completes, so bursts don't overwrite positions that weren't read yet.
+// The queue is single producer, single consumer and lock free: one thread
+// calls feedBuffer(), another popPacket().
+
 #include <stdint.h>
+#include <stddef.h>
 #include <string>
 
+#ifndef Arduino_h
+#include <atomic>
+#endif
+
 class MTCParser
 {
+public:
 	struct MTCPacket
 	{
 		uint8_t type;
@@ -58,8 +79,13 @@ class MTCParser
 		uint8_t minute;
 		uint8_t second;
 		uint8_t frame;
+		bool full_frame; // From a full frame message (locate), not quarter frames
+#ifndef Arduino_h
+		double time;     // As passed to feedBuffer()
+#endif
 	};
 
+private:
 #ifdef Arduino_h
 	using string_t = String;
 #else
@@ -76,15 +102,18 @@ public:
 	inline uint8_t minute() const { return mtc_.minute; }
 	inline uint8_t second() const { return mtc_.second; }
 	inline uint8_t frame() const { return mtc_.frame; }
+	// The last time came from a full frame message, not quarter frames
+	inline bool fullFrame() const { return mtc_.full_frame; }
 
+	// Real time, also for 29.97 drop frame
 	inline float asSeconds() const
 	{
-		return hour() * 60.f * 60.f + minute() * 60.f + second() + frame() * MTCFrameSecond[type()];
+		return asFrameCount() / MTCFrameRate[type() & 0x03];
 	}
-	inline float asMillis() const { return asSeconds() * 0.001f; }
-	inline float asMicros() const { return asMillis() * 0.001f; }
-    inline int32_t asFrameCount() const { return asSeconds() * MTCFrameRate[type()]; }
-    inline std::string asString() const
+	inline float asMillis() const { return asSeconds() * 1000.f; }
+	inline float asMicros() const { return asMillis() * 1000.f; }
+	inline int32_t asFrameCount() const { return frameCount(mtc_); }
+	inline std::string asString() const
 	{
 #ifdef Arduino_h
 		string_t str = string_t(hour()) + ":" + string_t(minute()) + ":" + string_t(second());
@@ -102,6 +131,18 @@ public:
 		return str;
 	}
 
+	// Frames since 00:00:00:00. 29.97 drop frame timecode skips frame numbers
+	// 0 and 1 at the start of every minute except every tenth.
+	static inline int32_t frameCount(const MTCPacket& p)
+	{
+		int32_t nominal = p.type == 0 ? 24 : p.type == 1 ? 25 : 30;
+		int32_t minutes = p.hour * 60 + p.minute;
+		int32_t frames = (minutes * 60 + p.second) * nominal + p.frame;
+		if (p.type == static_cast<uint8_t>(MTCType::FPS_29_97))
+			frames -= 2 * (minutes - minutes / 10);
+		return frames;
+	}
+
 	inline void feed(const uint8_t* const data, const uint8_t size)
 	{
 		for (uint8_t i = 0; i < size; ++i) feed(data[i]);
@@ -109,172 +150,44 @@ public:
 
 	inline void feed(const uint8_t data)
 	{
-		switch (state)
+		if (step(data, state))
 		{
-			// common path for FFM & QFM
-			case State::Header:
-			{
-				if (data == static_cast<uint8_t>(StateFlag::FFM_Header_1))
-				{
-					state = State::FFM_Header_2;
-					clearBuffer();
-				}
-				else if (data == static_cast<uint8_t>(StateFlag::QFM_Header))
-				{
-					state = State::QFM_Value;
-				}
-				else
-				{
-					state = State::Header;
-					clearBuffer();
-				}
-				break;
-			}
-
-			// for Full Frame Message (FFM)
-			case State::FFM_Header_2:
-			{
-				if (data == static_cast<uint8_t>(StateFlag::FFM_Header_2))
-					state = State::FFM_Channel;
-				else
-					state = State::Header;
-				break;
-			}
-			case State::FFM_Channel:
-			{
-				if (data == static_cast<uint8_t>(StateFlag::FFM_Channel))
-					state = State::FFM_ID_1;
-				else
-					state = State::Header;
-				break;
-			}
-			case State::FFM_ID_1:
-			{
-				if (data == static_cast<uint8_t>(StateFlag::FFM_ID_1))
-					state = State::FFM_ID_2;
-				else
-					state = State::Header;
-				break;
-			}
-			case State::FFM_ID_2:
-			{
-				if (data == static_cast<uint8_t>(StateFlag::FFM_ID_2))
-					state = State::FFM_Hour;
-				else
-					state = State::Header;
-				break;
-			}
-			case State::FFM_Hour:
-			{
-				mtc_buffer_.type = (data >> 5) & 0x03;
-				mtc_buffer_.hour = (data >> 0) & 0x1F;
-				state = State::FFM_Minute;
-				break;
-            }
-			case State::FFM_Minute:
-			{
-				mtc_buffer_.minute = data;
-				state = State::FFM_Second;
-				break;
-			}
-			case State::FFM_Second:
-			{
-				mtc_buffer_.second = data;
-				state = State::FFM_Frame;
-				break;
-			}
-			case State::FFM_Frame:
-			{
-				mtc_buffer_.frame = data;
-				state = State::FFM_EOX;
-				break;
-			}
-			case State::FFM_EOX:
-			{
-				if (data == static_cast<uint8_t>(StateFlag::FFM_EOX))
-				{
-					mtc_ = mtc_buffer_;
-                    b_available = true;
-				}
-				else
-				{
-					// error
-				}
-				state = State::Header;
-				break;
-			}
-
-			// Quarter Frame Message
-			case State::QFM_Value:
-			{
-				uint8_t index = (data >> 4) & 0x07;
-				uint8_t value = (data >> 0) & 0x0F;
-
-				switch (index)
-				{
-					case static_cast<uint8_t>(StateFlag::QFM_Index_Frame_LSB):
-					{
-                        mtc_buffer_.frame = (value & 0x0F);
-						break;
-					}
-					case static_cast<uint8_t>(StateFlag::QFM_Index_Frame_MSB):
-					{
-                        mtc_buffer_.frame |= (value & 0x01) << 4;
-						break;
-					}
-					case static_cast<uint8_t>(StateFlag::QFM_Index_Second_LSB):
-					{
-                        mtc_buffer_.second = (value & 0x0F);
-						break;
-					}
-					case static_cast<uint8_t>(StateFlag::QFM_Index_Second_MSB):
-					{
-                        mtc_buffer_.second |= (value & 0x03) << 4;
-						break;
-					}
-					case static_cast<uint8_t>(StateFlag::QFM_Index_Minute_LSB):
-					{
-                        mtc_buffer_.minute = (value & 0x0F);
-						break;
-					}
-					case static_cast<uint8_t>(StateFlag::QFM_Index_Minute_MSB):
-					{
-                        mtc_buffer_.minute |= (value & 0x03) << 4;
-						break;
-					}
-					case static_cast<uint8_t>(StateFlag::QFM_Index_Hour_LSB):
-					{
-                        mtc_buffer_.hour = (value & 0x0F);
-						break;
-					}
-					case static_cast<uint8_t>(StateFlag::QFM_Index_Hour_MSB):
-					{
-						mtc_buffer_.hour |= (value & 0x01) << 4;
-                        mtc_buffer_.type = (value >> 1) & 0x03;
-                        mtc_ = mtc_buffer_;
-                        b_available = true;
-                        clearBuffer();
-						break;
-					}
-                }
-				state = State::Header;
-				break;
-			}
+			mtc_ = mtc_buffer_;
+			b_available = true;
 		}
 	}
 
-private:
-
-	void clearBuffer()
+#ifndef Arduino_h
+	// Parse a whole buffer received at time, queueing every completed time.
+	// Returns the number of times queued.
+	inline size_t feedBuffer(const uint8_t* data, size_t size, double time)
 	{
-		mtc_buffer_.type = 0xFF;
-		mtc_buffer_.hour = 0xFF;
-		mtc_buffer_.minute = 0xFF;
-		mtc_buffer_.second = 0xFF;
-		mtc_buffer_.frame = 0xFF;
+		size_t queued = 0;
+		// Local, so the state isn't reloaded after every store
+		State s = state;
+		for (size_t i = 0; i < size; ++i)
+		{
+			if (!step(data[i], s)) continue;
+			mtc_buffer_.time = time;
+			if (queue_.push(mtc_buffer_))
+				queued++;
+			else
+				n_dropped++;
+		}
+		state = s;
+		return queued;
 	}
 
-	enum class State
+	// Oldest queued time, from the consumer thread
+	inline bool popPacket(MTCPacket& packet) { return queue_.pop(packet); }
+
+	// Times lost because the queue was full
+	inline size_t dropped() const { return n_dropped; }
+#endif
+
+private:
+
+	enum class State : uint8_t
 	{
 		// for both
 		Header,
@@ -289,7 +202,8 @@ private:
 		FFM_Frame,
 		FFM_EOX,
 		// for QFM only
-		QFM_Value
+		QFM_Value,
+		Count
 	};
 	enum class StateFlag
 	{
@@ -301,30 +215,176 @@ private:
 		FFM_EOX = 0xF7,
 
 		QFM_Header = 0xF1,
-		QFM_Index_Frame_LSB = 0x00,
-		QFM_Index_Frame_MSB = 0x01,
-		QFM_Index_Second_LSB = 0x02,
-		QFM_Index_Second_MSB = 0x03,
-		QFM_Index_Minute_LSB = 0x04,
-		QFM_Index_Minute_MSB = 0x05,
-		QFM_Index_Hour_LSB = 0x06,
-		QFM_Index_Hour_MSB = 0x07,
+	};
+	// What to do with a byte, besides moving to the next state
+	enum Action : uint8_t
+	{
+		None,
+		Hour,
+		Minute,
+		Second,
+		Frame,
+		FullFrame,
+		QuarterFrame,
 	};
 
-	enum class MTCType { FPS_24, FPS_25, FPS_29_97, FPS_30 };
-    const float MTCFrameRate[4] { 24.f, 25.f, 29.97f, 30.f };
-	const float MTCFrameSecond[4]
+	static uint8_t pack(State state, Action action = None)
+	{
+		return static_cast<uint8_t>(static_cast<uint8_t>(state) | (action << 4));
+	}
+
+	// Next state in the low nibble, action in the high nibble
+	static uint8_t transition(State s, uint8_t b)
+	{
+		// Real time bytes leave the state unchanged
+		if (b >= 0xF8) return pack(s);
+		if (b == static_cast<uint8_t>(StateFlag::FFM_Header_1)) return pack(State::FFM_Header_2);
+		if (b == static_cast<uint8_t>(StateFlag::QFM_Header)) return pack(State::QFM_Value);
+		if (b == static_cast<uint8_t>(StateFlag::FFM_EOX) && s == State::FFM_EOX)
+			return pack(State::Header, FullFrame);
+		if (b >= 0x80) return pack(State::Header);
+		switch (s)
+		{
+			case State::FFM_Header_2:
+				return pack(b == static_cast<uint8_t>(StateFlag::FFM_Header_2) ? State::FFM_Channel : State::Header);
+			case State::FFM_Channel:
+				return pack(b == static_cast<uint8_t>(StateFlag::FFM_Channel) ? State::FFM_ID_1 : State::Header);
+			case State::FFM_ID_1:
+				return pack(b == static_cast<uint8_t>(StateFlag::FFM_ID_1) ? State::FFM_ID_2 : State::Header);
+			case State::FFM_ID_2:
+				return pack(b == static_cast<uint8_t>(StateFlag::FFM_ID_2) ? State::FFM_Hour : State::Header);
+			case State::FFM_Hour: return pack(State::FFM_Minute, Hour);
+			case State::FFM_Minute: return pack(State::FFM_Second, Minute);
+			case State::FFM_Second: return pack(State::FFM_Frame, Second);
+			case State::FFM_Frame: return pack(State::FFM_EOX, Frame);
+			case State::QFM_Value: return pack(State::Header, QuarterFrame);
+			default: return pack(State::Header);
+		}
+	}
+
+#ifndef Arduino_h
+	struct Transitions
 	{
-		1.f / MTCFrameRate[0],
-		1.f / MTCFrameRate[1],
-		1.f / MTCFrameRate[2],
-		1.f / MTCFrameRate[3],
+		uint8_t next[static_cast<int>(State::Count)][256];
+
+		Transitions()
+		{
+			for (int s = 0; s < static_cast<int>(State::Count); ++s)
+				for (int b = 0; b < 256; ++b)
+					next[s][b] = transition(static_cast<State>(s), static_cast<uint8_t>(b));
+		}
 	};
 
-	MTCPacket mtc_;
-    MTCPacket mtc_buffer_;
+	static const Transitions& transitions()
+	{
+		static const Transitions table;
+		return table;
+	}
+#endif
+
+	// Returns true when mtc_buffer_ holds a new valid time
+	inline bool step(const uint8_t data, State& s)
+	{
+#ifdef Arduino_h
+		uint8_t t = transition(s, data);
+#else
+		uint8_t t = table_->next[static_cast<uint8_t>(s)][data];
+#endif
+		s = static_cast<State>(t & 0x0F);
+		switch (static_cast<Action>(t >> 4))
+		{
+			case Hour:
+				ffm_.type = (data >> 5) & 0x03;
+				ffm_.hour = data & 0x1F;
+				return false;
+			case Minute: ffm_.minute = data; return false;
+			case Second: ffm_.second = data; return false;
+			case Frame: ffm_.frame = data; return false;
+			case FullFrame:
+				ffm_.full_frame = true;
+				return complete(ffm_);
+			case QuarterFrame:
+			{
+				uint8_t index = (data >> 4) & 0x07;
+				// Pieces must come in order, starting from 0
+				if (index != next_piece_)
+				{
+					next_piece_ = 0;
+					if (index != 0) return false;
+				}
+				pieces_[index] = data & 0x0F;
+				next_piece_ = (index + 1) & 0x07;
+				if (index != 7) return false;
+				MTCPacket p;
+				p.frame = pieces_[0] | ((pieces_[1] & 0x01) << 4);
+				p.second = pieces_[2] | ((pieces_[3] & 0x03) << 4);
+				p.minute = pieces_[4] | ((pieces_[5] & 0x03) << 4);
+				p.hour = pieces_[6] | ((pieces_[7] & 0x01) << 4);
+				p.type = (pieces_[7] >> 1) & 0x03;
+				p.full_frame = false;
+				return complete(p);
+			}
+			default: return false;
+		}
+	}
+
+	inline bool complete(const MTCPacket& p)
+	{
+		uint8_t nominal = p.type == 0 ? 24 : p.type == 1 ? 25 : 30;
+		if (p.hour > 23 || p.minute > 59 || p.second > 59 || p.frame >= nominal)
+			return false;
+		mtc_buffer_ = p;
+		return true;
+	}
+
+#ifndef Arduino_h
+	// Single producer, single consumer ring
+	class PacketQueue
+	{
+	public:
+		bool push(const MTCPacket& p)
+		{
+			size_t head = head_.load(std::memory_order_relaxed);
+			if (head - tail_.load(std::memory_order_acquire) == kCapacity) return false;
+			items_[head % kCapacity] = p;
+			head_.store(head + 1, std::memory_order_release);
+			return true;
+		}
+		bool pop(MTCPacket& p)
+		{
+			size_t tail = tail_.load(std::memory_order_relaxed);
+			if (tail == head_.load(std::memory_order_acquire)) return false;
+			p = items_[tail % kCapacity];
+			tail_.store(tail + 1, std::memory_order_release);
+			return true;
+		}
+
+	private:
+		// About four seconds of quarter frame times
+		static const size_t kCapacity = 64;
+		MTCPacket items_[kCapacity];
+		std::atomic<size_t> head_{0};
+		std::atomic<size_t> tail_{0};
+	};
+#endif
+
+	enum class MTCType { FPS_24, FPS_25, FPS_29_97, FPS_30 };
+    const float MTCFrameRate[4] { 24.f, 25.f, 30000.f / 1001.f, 30.f };
+
+#ifndef Arduino_h
+	const Transitions* table_ {&transitions()};
+#endif
+	MTCPacket mtc_ {};
+    MTCPacket mtc_buffer_ {};
+	MTCPacket ffm_ {};
+	uint8_t pieces_[8] {};
+	uint8_t next_piece_ {0};
     State state {State::Header};
     bool b_available{false};
+#ifndef Arduino_h
+	PacketQueue queue_;
+	size_t n_dropped {0};
+#endif
 };
 
 #endif
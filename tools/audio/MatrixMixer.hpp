@@ -0,0 +1,180 @@
+#pragma once
+#ifndef MatrixMixer_H
+#define MatrixMixer_H
+
+// N to M mixing matrix for interleaved sources (e.g. soundfiles).
+//
+// Routes are declared per source channel with a gain. compile() expands them
+// through an optional downmix matrix, merges duplicate routes and drops
+// silent ones, so the audio callback does a single pass per source:
+// deinterleave the routed channels once, then one vectorized multiply-add per
+// (channel, output) pair. Per output gain and delay (speaker compensation) are
+// applied during that same write by CompensatedOutput.
+//
+// Muting and source gain changes ramp across one block instead of requiring
+// a recompile.
+
+#include "al/io/al_AudioIOData.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <vector>
+
+#include "MixKernels.hpp"
+#include "SpeakerCompensation.hpp"
+
+class MatrixMixer {
+public:
+  struct Route {
+    uint16_t inChannel;
+    uint16_t outChannel;
+    float gain;
+  };
+
+  // Returns source index
+  size_t addSource(size_t numChannels) {
+    mSources.push_back(Source());
+    mSources.back().numChannels = numChannels;
+    return mSources.size() - 1;
+  }
+
+  void addRoute(size_t source, uint16_t inChannel, uint16_t outChannel,
+                float gain) {
+    assert(source < mSources.size());
+    mSources[source].routes.push_back({inChannel, outChannel, gain});
+  }
+
+  // Gain and delay (in samples) applied to each output channel after mixing
+  // and downmixing. Outputs beyond the size of the vectors have unity gain
+  // and no delay. Must be called before audio starts.
+  void setCompensation(std::vector<float> gains, std::vector<float> delays) {
+    mOutput.configure(gains, delays);
+  }
+
+  // downmix[out][in]: contribution of mix channel "in" to output "out"
+  void setDownmix(std::vector<std::vector<float>> downmix) {
+    mDownmix = downmix;
+  }
+
+  // Build the routing tables. Must be called before audio starts.
+  void compile(size_t maxFrames) {
+    size_t maxRouted = 0;
+    for (auto &source : mSources) {
+      source.direct = expand(source.routes, false);
+      source.downmixed = expand(source.routes, true);
+      source.routedChannels.clear();
+      for (auto *table : {&source.direct, &source.downmixed}) {
+        for (const auto &r : *table) {
+          if (std::find(source.routedChannels.begin(),
+                        source.routedChannels.end(),
+                        r.inChannel) == source.routedChannels.end()) {
+            source.routedChannels.push_back(r.inChannel);
+          }
+        }
+      }
+      std::sort(source.routedChannels.begin(), source.routedChannels.end());
+      maxRouted = std::max(maxRouted, source.routedChannels.size());
+    }
+    mMaxFrames = maxFrames;
+    mScratch.assign(maxRouted * maxFrames, 0.0f);
+  }
+
+  // Call once per block before mixing any source
+  void beginBlock(al::AudioIOData &io) { mOutput.beginBlock(io); }
+
+  // Mix one block of interleaved samples from a source into io's outputs.
+  // targetGain (0 when muted) is reached at the end of the block.
+  void mix(size_t sourceIndex, const float *interleaved, size_t numFrames,
+           al::AudioIOData &io, float targetGain, bool downmix) {
+    auto &source = mSources[sourceIndex];
+    float previousGain = source.currentGain;
+    source.currentGain = targetGain;
+    if (previousGain == 0.0f && targetGain == 0.0f) {
+      return;
+    }
+    numFrames = std::min(numFrames, mMaxFrames);
+    const auto &routes = downmix ? source.downmixed : source.direct;
+    const float invFrames = numFrames > 0 ? 1.0f / numFrames : 0.0f;
+    const int outChannels = io.channelsOut();
+
+    // Routes are sorted by input channel, so each routed channel is
+    // deinterleaved once into contiguous scratch memory
+    int scratchIndex = -1;
+    int currentChannel = -1;
+    for (const auto &r : routes) {
+      if (r.inChannel != currentChannel) {
+        currentChannel = r.inChannel;
+        scratchIndex++;
+        mix::deinterleave(&mScratch[scratchIndex * mMaxFrames], interleaved,
+                          numFrames, source.numChannels, r.inChannel);
+      }
+      if (r.outChannel >= outChannels) {
+        continue;
+      }
+      const float *in = &mScratch[scratchIndex * mMaxFrames];
+      float g0 = r.gain * previousGain;
+      float g1 = r.gain * targetGain;
+      mOutput.write(io, r.outChannel, in, numFrames, g0,
+                    (g1 - g0) * invFrames);
+    }
+  }
+
+  const std::vector<Route> &routes(size_t source, bool downmix) const {
+    return downmix ? mSources[source].downmixed : mSources[source].direct;
+  }
+
+private:
+  struct Source {
+    size_t numChannels{0};
+    std::vector<Route> routes;         // As declared
+    std::vector<Route> direct;         // Compiled
+    std::vector<Route> downmixed;      // Compiled through downmix matrix
+    std::vector<uint16_t> routedChannels;
+    float currentGain{1.0f};
+  };
+
+  std::vector<Route> expand(const std::vector<Route> &routes,
+                            bool downmix) const {
+    std::vector<Route> expanded;
+    auto add = [&](uint16_t in, uint16_t out, float gain) {
+      for (auto &r : expanded) {
+        if (r.inChannel == in && r.outChannel == out) {
+          r.gain += gain;
+          return;
+        }
+      }
+      expanded.push_back({in, out, gain});
+    };
+    for (const auto &r : routes) {
+      if (downmix && mDownmix.size() > 0) {
+        for (size_t out = 0; out < mDownmix.size(); out++) {
+          if (r.outChannel < mDownmix[out].size() &&
+              mDownmix[out][r.outChannel] != 0.0f) {
+            add(r.inChannel, out, r.gain * mDownmix[out][r.outChannel]);
+          }
+        }
+      } else {
+        add(r.inChannel, r.outChannel, r.gain);
+      }
+    }
+    expanded.erase(std::remove_if(expanded.begin(), expanded.end(),
+                                  [](const Route &r) { return r.gain == 0.0f; }),
+                   expanded.end());
+    std::sort(expanded.begin(), expanded.end(),
+              [](const Route &a, const Route &b) {
+                return a.inChannel < b.inChannel ||
+                       (a.inChannel == b.inChannel &&
+                        a.outChannel < b.outChannel);
+              });
+    return expanded;
+  }
+
+  std::vector<Source> mSources;
+  CompensatedOutput mOutput;
+  std::vector<std::vector<float>> mDownmix;
+  std::vector<float> mScratch;
+  size_t mMaxFrames{0};
+};
+
+#endif
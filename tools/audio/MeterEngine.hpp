@@ -0,0 +1,245 @@
+#pragma once
+#ifndef MeterEngine_H
+#define MeterEngine_H
+
+// Multichannel level metering for the audio callback.
+//
+// Per block, MeterEngine only accumulates linear values for each output
+// channel: sample peak, sum of squares (for RMS) and an estimate of the
+// inter-sample ("true") peak from 4x Catmull-Rom interpolation. The channel
+// buffers are contiguous, so the accumulation is vectorized along the block
+// (SSE when available).
+//
+// At the publication rate (30 Hz by default) the accumulators are converted
+// to dB, the display ballistics are applied and the result is published to a
+// lock-free triple buffer. The graphics thread picks up the newest snapshot
+// with update() and can copy it straight into distributed state.
+
+#include "al/io/al_AudioIOData.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+#if defined(__SSE__) || defined(_M_X64)
+#include <immintrin.h>
+#define METERENGINE_SSE 1
+#endif
+
+// Single producer, single consumer triple buffer. The producer always has a
+// buffer to write to and the consumer always reads a complete snapshot,
+// neither ever waits.
+template <class T> class TripleBuffer {
+public:
+  T &back() { return mBuffers[mBack]; }
+  void publish() { mBack = mMiddle.exchange(mBack | kFresh) & kIndexMask; }
+
+  // Returns true if a new snapshot was acquired
+  bool update() {
+    if ((mMiddle.load() & kFresh) == 0) {
+      return false;
+    }
+    mFront = mMiddle.exchange(mFront) & kIndexMask;
+    return true;
+  }
+  const T &front() const { return mBuffers[mFront]; }
+
+private:
+  static const int kIndexMask = 0x3;
+  static const int kFresh = 0x4;
+  T mBuffers[3];
+  int mBack{0};
+  std::atomic<int> mMiddle{1};
+  int mFront{2};
+};
+
+struct MeterSnapshot {
+  static const int kMaxChannels = 64;
+  int numChannels{0};
+  float peakDb[kMaxChannels];
+  float rmsDb[kMaxChannels];
+  float truePeakDb[kMaxChannels];
+  // Smoothed peak mapped for display, same scale previously used by Meter
+  float display[kMaxChannels];
+};
+
+class MeterEngine {
+public:
+  void prepare(int numChannels, int framesPerBuffer, double sampleRate,
+               double publishRate = 30.0) {
+    mNumChannels = std::min(numChannels, int(MeterSnapshot::kMaxChannels));
+    mFramesPerBuffer = framesPerBuffer;
+    mFramesPerPublish = std::max(1, int(sampleRate / publishRate));
+    mFramesAccumulated = 0;
+    mPeak.assign(mNumChannels, 0.0f);
+    mSumSquares.assign(mNumChannels, 0.0f);
+    mTruePeak.assign(mNumChannels, 0.0f);
+    mDisplay.assign(mNumChannels, float(kDisplayFloor));
+    mHistory.assign(mNumChannels * kHistory, 0.0f);
+    mScratch.assign(framesPerBuffer + kHistory, 0.0f);
+    // Release rate used to be 5% per 512 frame block
+    mRelease = 1.0f - std::pow(0.95f, mFramesPerPublish / 512.0f);
+  }
+
+  bool prepared(int numChannels, int framesPerBuffer) const {
+    return mNumChannels ==
+               std::min(numChannels, int(MeterSnapshot::kMaxChannels)) &&
+           mFramesPerBuffer == framesPerBuffer;
+  }
+
+  // Audio thread
+  void process(const al::AudioIOData &io) {
+    int fpb = io.framesPerBuffer();
+    for (int ch = 0; ch < mNumChannels; ch++) {
+      const float *buf = io.outBuffer(ch);
+      accumulate(ch, buf, fpb);
+    }
+    mFramesAccumulated += fpb;
+    if (mFramesAccumulated >= mFramesPerPublish) {
+      publish();
+    }
+  }
+
+  // Graphics thread. Returns true if a new snapshot is available in
+  // snapshot()
+  bool update() { return mSnapshots.update(); }
+  const MeterSnapshot &snapshot() const { return mSnapshots.front(); }
+
+  // Copy display values (e.g. into distributed state)
+  void copyDisplayValues(float *dest, size_t count) const {
+    const auto &s = snapshot();
+    size_t n = std::min(count, size_t(s.numChannels));
+    memcpy(dest, s.display, n * sizeof(float));
+  }
+
+private:
+  static const int kHistory = 3;
+  static constexpr float kDisplayFloor = 0.01f;
+
+  void accumulate(int ch, const float *buf, int fpb) {
+    float peak = mPeak[ch];
+    float sumSq = 0.0f;
+    int i = 0;
+#ifdef METERENGINE_SSE
+    const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    __m128 peak4 = _mm_set1_ps(peak);
+    __m128 sum4 = _mm_setzero_ps();
+    for (; i + 4 <= fpb; i += 4) {
+      __m128 x = _mm_loadu_ps(buf + i);
+      peak4 = _mm_max_ps(peak4, _mm_and_ps(x, absMask));
+      sum4 = _mm_add_ps(sum4, _mm_mul_ps(x, x));
+    }
+    float lanes[4];
+    _mm_storeu_ps(lanes, peak4);
+    peak = std::max(std::max(lanes[0], lanes[1]), std::max(lanes[2], lanes[3]));
+    _mm_storeu_ps(lanes, sum4);
+    sumSq = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+#endif
+    for (; i < fpb; i++) {
+      peak = std::max(peak, std::fabs(buf[i]));
+      sumSq += buf[i] * buf[i];
+    }
+    mPeak[ch] = peak;
+    mSumSquares[ch] += sumSq;
+    mTruePeak[ch] =
+        std::max(mTruePeak[ch], std::max(peak, truePeak(ch, buf, fpb)));
+  }
+
+  // Maximum of Catmull-Rom interpolated values at 1/4, 1/2 and 3/4 between
+  // samples. Interval j uses s[j - 1 .. j + 2] where s is the previous three
+  // samples followed by the current block.
+  float truePeak(int ch, const float *buf, int fpb) {
+    float *s = mScratch.data();
+    float *hist = mHistory.data() + ch * kHistory;
+    memcpy(s, hist, kHistory * sizeof(float));
+    memcpy(s + kHistory, buf, fpb * sizeof(float));
+    memcpy(hist, s + fpb, kHistory * sizeof(float));
+
+    // Coefficients for t = 0.25, 0.5, 0.75
+    static const float c[3][4] = {
+        {-0.0703125f, 0.8671875f, 0.2265625f, -0.0234375f},
+        {-0.0625f, 0.5625f, 0.5625f, -0.0625f},
+        {-0.0234375f, 0.2265625f, 0.8671875f, -0.0703125f}};
+    float maxVal = 0.0f;
+    int j = 1;
+#ifdef METERENGINE_SSE
+    const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    __m128 max4 = _mm_setzero_ps();
+    for (; j + 4 <= fpb + 1; j += 4) {
+      __m128 p0 = _mm_loadu_ps(s + j - 1);
+      __m128 p1 = _mm_loadu_ps(s + j);
+      __m128 p2 = _mm_loadu_ps(s + j + 1);
+      __m128 p3 = _mm_loadu_ps(s + j + 2);
+      for (int k = 0; k < 3; k++) {
+        __m128 v = _mm_add_ps(
+            _mm_add_ps(_mm_mul_ps(p0, _mm_set1_ps(c[k][0])),
+                       _mm_mul_ps(p1, _mm_set1_ps(c[k][1]))),
+            _mm_add_ps(_mm_mul_ps(p2, _mm_set1_ps(c[k][2])),
+                       _mm_mul_ps(p3, _mm_set1_ps(c[k][3]))));
+        max4 = _mm_max_ps(max4, _mm_and_ps(v, absMask));
+      }
+    }
+    float lanes[4];
+    _mm_storeu_ps(lanes, max4);
+    maxVal =
+        std::max(std::max(lanes[0], lanes[1]), std::max(lanes[2], lanes[3]));
+#endif
+    for (; j < fpb + 1; j++) {
+      for (int k = 0; k < 3; k++) {
+        float v = c[k][0] * s[j - 1] + c[k][1] * s[j] + c[k][2] * s[j + 1] +
+                  c[k][3] * s[j + 2];
+        maxVal = std::max(maxVal, std::fabs(v));
+      }
+    }
+    return maxVal;
+  }
+
+  static float toDb(float linear) {
+    return linear > 1.0e-6f ? 20.0f * std::log10(linear) : -120.0f;
+  }
+
+  void publish() {
+    auto &s = mSnapshots.back();
+    s.numChannels = mNumChannels;
+    float invFrames = 1.0f / mFramesAccumulated;
+    for (int ch = 0; ch < mNumChannels; ch++) {
+      s.peakDb[ch] = toDb(mPeak[ch]);
+      s.rmsDb[ch] = toDb(std::sqrt(mSumSquares[ch] * invFrames));
+      s.truePeakDb[ch] = toDb(mTruePeak[ch]);
+
+      float target = kDisplayFloor;
+      if (s.peakDb[ch] >= -60.0f) {
+        target = kDisplayFloor + 0.005f * (60.0f + s.peakDb[ch]);
+      }
+      if (mDisplay[ch] > target) {
+        mDisplay[ch] -= mRelease * (mDisplay[ch] - target);
+      } else {
+        mDisplay[ch] = target;
+      }
+      s.display[ch] = mDisplay[ch];
+
+      mPeak[ch] = 0.0f;
+      mSumSquares[ch] = 0.0f;
+      mTruePeak[ch] = 0.0f;
+    }
+    mFramesAccumulated = 0;
+    mSnapshots.publish();
+  }
+
+  int mNumChannels{0};
+  int mFramesPerBuffer{0};
+  int mFramesPerPublish{1};
+  int mFramesAccumulated{0};
+  float mRelease{0.05f};
+  std::vector<float> mPeak;
+  std::vector<float> mSumSquares;
+  std::vector<float> mTruePeak;
+  std::vector<float> mDisplay;
+  std::vector<float> mHistory;
+  std::vector<float> mScratch;
+  TripleBuffer<MeterSnapshot> mSnapshots;
+};
+
+#endif
@@ -0,0 +1,110 @@
+#pragma once
+#ifndef MixKernels_H
+#define MixKernels_H
+
+// Inner loops shared by the audio tools for summing a contiguous
+// (non-interleaved) buffer into an output buffer with a gain.
+// SSE/AVX paths are used when the compiler targets them, with FMA if
+// available. The scalar loops are also the fallback on other platforms, where
+// the compiler can vectorize them (e.g. NEON).
+
+#include <cstddef>
+
+#if defined(__SSE__) || defined(_M_X64)
+#include <immintrin.h>
+#define MIXKERNELS_SSE 1
+#endif
+
+namespace mix {
+
+// out[i] += (g0 + i * dg) * in[i]
+inline void mixRamp(float *out, const float *in, unsigned int numFrames,
+                    float g0, float dg) {
+  unsigned int i = 0;
+#ifdef MIXKERNELS_SSE
+#ifdef __AVX__
+  __m256 gain =
+      _mm256_setr_ps(g0, g0 + dg, g0 + 2 * dg, g0 + 3 * dg, g0 + 4 * dg,
+                     g0 + 5 * dg, g0 + 6 * dg, g0 + 7 * dg);
+  const __m256 gainStep = _mm256_set1_ps(8 * dg);
+  for (; i + 8 <= numFrames; i += 8) {
+    __m256 o = _mm256_loadu_ps(out + i);
+    __m256 x = _mm256_loadu_ps(in + i);
+#ifdef __FMA__
+    o = _mm256_fmadd_ps(gain, x, o);
+#else
+    o = _mm256_add_ps(o, _mm256_mul_ps(gain, x));
+#endif
+    _mm256_storeu_ps(out + i, o);
+    gain = _mm256_add_ps(gain, gainStep);
+  }
+#endif
+  __m128 gain4 = _mm_setr_ps(g0 + i * dg, g0 + (i + 1) * dg, g0 + (i + 2) * dg,
+                             g0 + (i + 3) * dg);
+  const __m128 gainStep4 = _mm_set1_ps(4 * dg);
+  for (; i + 4 <= numFrames; i += 4) {
+    __m128 o = _mm_loadu_ps(out + i);
+    __m128 x = _mm_loadu_ps(in + i);
+#ifdef __FMA__
+    o = _mm_fmadd_ps(gain4, x, o);
+#else
+    o = _mm_add_ps(o, _mm_mul_ps(gain4, x));
+#endif
+    _mm_storeu_ps(out + i, o);
+    gain4 = _mm_add_ps(gain4, gainStep4);
+  }
+#endif
+  for (; i < numFrames; i++) {
+    out[i] += (g0 + i * dg) * in[i];
+  }
+}
+
+// out[i] += g * in[i]
+inline void mixGain(float *out, const float *in, unsigned int numFrames,
+                    float g) {
+  unsigned int i = 0;
+#ifdef MIXKERNELS_SSE
+#ifdef __AVX__
+  const __m256 gain = _mm256_set1_ps(g);
+  for (; i + 8 <= numFrames; i += 8) {
+    __m256 o = _mm256_loadu_ps(out + i);
+    __m256 x = _mm256_loadu_ps(in + i);
+#ifdef __FMA__
+    o = _mm256_fmadd_ps(gain, x, o);
+#else
+    o = _mm256_add_ps(o, _mm256_mul_ps(gain, x));
+#endif
+    _mm256_storeu_ps(out + i, o);
+  }
+#endif
+  const __m128 gain4 = _mm_set1_ps(g);
+  for (; i + 4 <= numFrames; i += 4) {
+    __m128 o = _mm_loadu_ps(out + i);
+    __m128 x = _mm_loadu_ps(in + i);
+#ifdef __FMA__
+    o = _mm_fmadd_ps(gain4, x, o);
+#else
+    o = _mm_add_ps(o, _mm_mul_ps(gain4, x));
+#endif
+    _mm_storeu_ps(out + i, o);
+  }
+#endif
+  for (; i < numFrames; i++) {
+    out[i] += g * in[i];
+  }
+}
+
+// Copy one channel out of an interleaved buffer
+inline void deinterleave(float *out, const float *interleaved,
+                         unsigned int numFrames, unsigned int numChannels,
+                         unsigned int channel) {
+  const float *in = interleaved + channel;
+  for (unsigned int i = 0; i < numFrames; i++) {
+    out[i] = *in;
+    in += numChannels;
+  }
+}
+
+} // namespace mix
+
+#endif
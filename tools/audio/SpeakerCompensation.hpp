@@ -0,0 +1,242 @@
+#pragma once
+#ifndef SpeakerCompensation_H
+#define SpeakerCompensation_H
+
+// Per speaker gain and delay compensation applied while mixing.
+//
+// Appending SpeakerDistanceGainAdjustmentProcessor to the audio chain costs a
+// full read-modify-write pass over every output channel each block (and it
+// only compensates gain). CompensatedOutput instead applies the gain and a
+// fractional delay at the moment a source buffer is summed into an output:
+// samples are written at an offset of floor(delay) and floor(delay) + 1 with
+// linear interpolation weights, and whatever spills past the end of the block
+// is kept in a short per channel carry buffer that is added at the start of
+// the next block. The only per-block overhead is the carry, which is as long
+// as the largest delay (a few ms for the AlloSphere).
+
+#include "al/io/al_AudioIOData.hpp"
+#include "al/sound/al_Speaker.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+#include "MixKernels.hpp"
+
+class CompensatedOutput {
+public:
+  // gains and delays (in samples) indexed by output channel. Empty vectors
+  // or missing entries mean unity gain and no delay.
+  void configure(std::vector<float> gains, std::vector<float> delays) {
+    size_t numChannels = std::max(gains.size(), delays.size());
+    mChannels.resize(numChannels);
+    for (size_t ch = 0; ch < numChannels; ch++) {
+      auto &c = mChannels[ch];
+      c.gain = ch < gains.size() ? gains[ch] : 1.0f;
+      float delay = ch < delays.size() ? std::max(0.0f, delays[ch]) : 0.0f;
+      c.delayInt = (unsigned int)delay;
+      c.delayFrac = delay - c.delayInt;
+      c.carry.assign(c.delayInt + 2, 0.0f);
+      if (c.delayInt == 0 && c.delayFrac == 0.0f) {
+        c.carry.clear();
+      }
+    }
+  }
+
+  float gain(size_t ch) const {
+    return ch < mChannels.size() ? mChannels[ch].gain : 1.0f;
+  }
+
+  // Add samples delayed from previous blocks. Call once per block, before
+  // any write().
+  void beginBlock(al::AudioIOData &io) {
+    unsigned int fpb = io.framesPerBuffer();
+    size_t numChannels = std::min(mChannels.size(), (size_t)io.channelsOut());
+    for (size_t ch = 0; ch < numChannels; ch++) {
+      auto &carry = mChannels[ch].carry;
+      if (carry.empty()) {
+        continue;
+      }
+      float *out = io.outBuffer(ch);
+      size_t n = std::min(carry.size(), (size_t)fpb);
+      for (size_t i = 0; i < n; i++) {
+        out[i] += carry[i];
+      }
+      // Shift remaining carry to the front
+      std::copy(carry.begin() + n, carry.end(), carry.begin());
+      std::fill(carry.end() - n, carry.end(), 0.0f);
+    }
+  }
+
+  // out += compensated (g0 + i * dg) * in[i]
+  // numFrames may be shorter than the block (e.g. a short soundfile read).
+  void write(al::AudioIOData &io, size_t ch, const float *in,
+             unsigned int numFrames, float g0, float dg) {
+    float *out = io.outBuffer(ch);
+    if (ch >= mChannels.size() || mChannels[ch].carry.empty()) {
+      float g = gain(ch);
+      mix::mixRamp(out, in, numFrames, g0 * g, dg * g);
+      return;
+    }
+    auto &c = mChannels[ch];
+    unsigned int blockFrames = io.framesPerBuffer();
+    float ga = c.gain * (1.0f - c.delayFrac);
+    float gb = c.gain * c.delayFrac;
+    writeShifted(out, c.carry.data(), in, numFrames, blockFrames, c.delayInt,
+                 g0 * ga, dg * ga);
+    if (gb != 0.0f) {
+      writeShifted(out, c.carry.data(), in, numFrames, blockFrames,
+                   c.delayInt + 1, g0 * gb, dg * gb);
+    }
+  }
+
+  size_t numChannels() const { return mChannels.size(); }
+
+private:
+  struct Channel {
+    float gain{1.0f};
+    unsigned int delayInt{0};
+    float delayFrac{0.0f};
+    std::vector<float> carry;
+  };
+
+  // out[i + shift] += (g0 + i * dg) * in[i], spilling into carry past the end
+  // of the block
+  static void writeShifted(float *out, float *carry, const float *in,
+                           unsigned int numFrames, unsigned int blockFrames,
+                           unsigned int shift, float g0, float dg) {
+    unsigned int inBlock =
+        shift < blockFrames ? std::min(numFrames, blockFrames - shift) : 0;
+    if (inBlock > 0) {
+      mix::mixRamp(out + shift, in, inBlock, g0, dg);
+    }
+    unsigned int spill = numFrames - inBlock;
+    if (spill > 0) {
+      unsigned int carryStart = shift + inBlock - blockFrames;
+      mix::mixRamp(carry + carryStart, in + inBlock, spill, g0 + inBlock * dg,
+                   dg);
+    }
+  }
+
+  std::vector<Channel> mChannels;
+};
+
+// Delay in samples for each device channel so that sound from all speakers
+// arrives at the center at the same time as from the farthest speaker.
+inline std::vector<float> speakerDistanceDelays(const al::Speakers &sl,
+                                                double sampleRate,
+                                                double speedOfSound = 343.0) {
+  float maxRadius = 0.0f;
+  int numChannels = 0;
+  for (const auto &spkr : sl) {
+    maxRadius = std::max(maxRadius, float(spkr.radius));
+    numChannels = std::max(numChannels, spkr.deviceChannel + 1);
+  }
+  std::vector<float> delays(numChannels, 0.0f);
+  for (const auto &spkr : sl) {
+    delays[spkr.deviceChannel] =
+        (maxRadius - spkr.radius) / speedOfSound * sampleRate;
+  }
+  return delays;
+}
+
+// Per output channel gain applied by an AudioCallback (e.g.
+// SpeakerDistanceGainAdjustmentProcessor), measured by running it on a single
+// frame of ones.
+inline std::vector<float> measureOutputGains(al::AudioCallback &processor,
+                                             int numChannels) {
+  al::AudioIOData probe;
+  probe.framesPerBuffer(1);
+  probe.channelsOut(numChannels);
+  for (int i = 0; i < numChannels; i++) {
+    probe.outBuffer(i)[0] = 1.0f;
+  }
+  probe.frame(0);
+  processor.onAudioCB(probe);
+  std::vector<float> gains(numChannels);
+  for (int i = 0; i < numChannels; i++) {
+    gains[i] = probe.outBuffer(i)[0];
+  }
+  return gains;
+}
+
+// Times mixing numSources mono buffers to every output followed by a
+// separate gain/delay pass over all outputs, against writing through
+// CompensatedOutput. Prints microseconds per block for both.
+inline void benchmarkCompensation(int numChannels, int numSources,
+                                  int framesPerBuffer, double sampleRate,
+                                  const std::vector<float> &gains,
+                                  const std::vector<float> &delays,
+                                  int numBlocks = 500) {
+  al::AudioIOData io;
+  io.framesPerBuffer(framesPerBuffer);
+  io.channelsOut(numChannels);
+  std::vector<float> source(framesPerBuffer);
+  for (int i = 0; i < framesPerBuffer; i++) {
+    source[i] = std::sin(i * 0.05f);
+  }
+
+  // Separate pass: gain plus a delay line per channel, as a post processor
+  // would do it. Each line holds the last samples of the previous block in
+  // front of the current one and is shifted once per block, the same scheme
+  // CompensatedOutput uses for its carry, so neither path wraps per sample.
+  size_t history = 1;
+  for (auto d : delays) {
+    history = std::max(history, size_t(std::max(0.0f, d)) + 1);
+  }
+  std::vector<std::vector<float>> delayLines(
+      numChannels, std::vector<float>(history + framesPerBuffer, 0.0f));
+
+  auto start = std::chrono::steady_clock::now();
+  for (int block = 0; block < numBlocks; block++) {
+    io.zeroOut();
+    for (int s = 0; s < numSources; s++) {
+      int ch = s % numChannels;
+      mix::mixGain(io.outBuffer(ch), source.data(), framesPerBuffer, 0.5f);
+    }
+    for (int ch = 0; ch < numChannels; ch++) {
+      float g = ch < (int)gains.size() ? gains[ch] : 1.0f;
+      float d = ch < (int)delays.size() ? std::max(0.0f, delays[ch]) : 0.0f;
+      unsigned int di = (unsigned int)d;
+      float df = d - di;
+      float *line = delayLines[ch].data();
+      float *out = io.outBuffer(ch);
+      std::copy(out, out + framesPerBuffer, line + history);
+      const float *r0 = line + history - di;
+      const float *r1 = r0 - 1;
+      for (int i = 0; i < framesPerBuffer; i++) {
+        out[i] = g * ((1.0f - df) * r0[i] + df * r1[i]);
+      }
+      std::copy(line + framesPerBuffer, line + framesPerBuffer + history,
+                line);
+    }
+  }
+  auto mid = std::chrono::steady_clock::now();
+
+  CompensatedOutput output;
+  output.configure(gains, delays);
+  for (int block = 0; block < numBlocks; block++) {
+    io.zeroOut();
+    output.beginBlock(io);
+    for (int s = 0; s < numSources; s++) {
+      int ch = s % numChannels;
+      output.write(io, ch, source.data(), framesPerBuffer, 0.5f, 0.0f);
+    }
+  }
+  auto end = std::chrono::steady_clock::now();
+
+  double separateUs =
+      std::chrono::duration<double, std::micro>(mid - start).count() /
+      numBlocks;
+  double fusedUs =
+      std::chrono::duration<double, std::micro>(end - mid).count() / numBlocks;
+  std::cout << "Speaker compensation, " << numSources << " sources x "
+            << numChannels << " channels, " << framesPerBuffer
+            << " frames: separate pass " << separateUs << " us/block, fused "
+            << fusedUs << " us/block" << std::endl;
+}
+
+#endif
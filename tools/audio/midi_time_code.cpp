@@ -30,48 +30,21 @@
 // LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
-#include "MTCParser.h"
+#include "MTCClockReceiver.hpp"
 
 using namespace al;
 
-class MTCReceiver : public MIDIMessageHandler {
-public:
-  MTCParser mtc;
-  uint8_t hour{0};
-  uint8_t minute{0};
-  uint8_t second{0};
-  uint8_t frame{0};
-  virtual ~MTCReceiver() {}
-
-  /// Called when a MIDI message is received
-  virtual void onMIDIMessage(const MIDIMessage &m) {
-    if (m.type() == MIDIByte::SYSTEM_MSG && m.status() == MIDIByte::TIME_CODE) {
-      mtc.feed(m.bytes, m.dataSize());
-      if (mtc.available()) {
-        hour = mtc.hour();
-        minute = mtc.minute();
-        second = mtc.second();
-        frame = mtc.frame();
-        mtc.pop();
-      }
-    }
-  };
-
-  /// Bind handler to a MIDI input
-  //    void bindTo(RtMidiIn &RtMidiIn, unsigned port = 0);
-};
-
 class MTCApp : public App {
 public:
   RtMidiIn midiIn;
-  MTCReceiver mtcReceiver;
+  // Smooth position between quarter frames, see MTCClock.hpp
+  MTCClockReceiver mtcReceiver;
   ParameterMenu TCframes{"TC_fps"};
   ParameterInt frameOffset{"frame_offset", "", 0, -25, 25};
   std::vector<float> frameValues = {24, 25, 30, 30};
   // App callbacks
   void onInit() override {
     mtcReceiver.bindTo(midiIn);
-    midiIn.ignoreTypes(false, false, false);
     std::vector<std::string> fps = {"24", "25", "29.97", "30"};
 
     TCframes.setElements(fps);
@@ -86,14 +59,25 @@ public:
     ParameterGUI::draw(&frameOffset);
     ParameterGUI::drawMIDIIn(&midiIn);
 
-    ImGui::Text("%02i:%02i:%02i:%02i", mtcReceiver.hour, mtcReceiver.minute,
-                mtcReceiver.second, mtcReceiver.frame);
+    const MTCClock &clock = mtcReceiver.clock;
+    double position = clock.position();
+    int hour, minute, second, frame;
+    MTCClock::toTimecode(clock.type(), position, hour, minute, second, frame);
+    ImGui::Text("%02i:%02i:%02i%c%02i", hour, minute, second,
+                clock.type() == 2 ? ';' : ':', frame);
     int fps = frameValues[TCframes.get()];
-    int frameNum = mtcReceiver.hour * 60 * 60 * fps +
-                   mtcReceiver.minute * 60 * fps + mtcReceiver.second * fps +
-                   mtcReceiver.frame;
+    int frameNum =
+        hour * 60 * 60 * fps + minute * 60 * fps + second * fps + frame;
     ImGui::Text("Frame num : %i", frameNum);
 
+    const char *status[] = {"Stopped", "Locking", "Locked"};
+    auto stats = clock.stats();
+    ImGui::Text("%s, %.3f s at rate %.5f", status[int(clock.status())],
+                position, clock.rate());
+    ImGui::Text("Jitter %.2f ms, %i jumps, %i drop-outs, %i locates",
+                stats.jitter * 1000, int(stats.jumps), int(stats.dropouts),
+                int(stats.locates));
+
     ImGui::End();
     imguiEndFrame();
     g.clear(0, 0, 0);
@@ -0,0 +1,315 @@
+/*
+MIDI Time Code clock with a synthetic MTC stream
+
+Description:
+Generates quarter frame and full frame MIDI bytes for a timecode master whose
+clock runs slightly fast, delivers them with random MIDI latency and feeds
+them into MTCClock (see MTCClock.hpp), all in simulated time. Every third
+quarter frame has a MIDI clock byte (F8) between its status and data byte.
+
+The master plays for a while, jumps forward, stops and sends a locate, and
+then plays again. For each MTC frame rate it prints the error of the position
+MTCParser alone would give (the last complete time, updated every two
+frames), the error of MTCClock::position() once locked and the error of the
+per-sample position MTCFollower gives to audio blocks with jittery callback
+times. Errors are measured against the timecode sent one average MIDI delay
+earlier, as a constant delay can't be detected by the receiver. It also
+checks that the jump, the drop-out and the locate were detected.
+
+Finally it parses 30 minutes of 29.97 drop frame quarter frames, with MIDI
+clock bytes mixed in, in 256 byte buffers with MTCParser::feedBuffer(). It
+checks that every time arrives through the queue with consecutive frame
+counts, and compares with reading only the latest time after each buffer.
+
+Usage:
+    mtc_clock_simulation [MIDI jitter ms] [drift ppm]
+*/
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include "MTCClock.hpp"
+
+struct TimedByte {
+  double time;
+  uint8_t byte;
+};
+
+class SyntheticMaster {
+public:
+  SyntheticMaster(uint8_t type, double drift, double latency, double jitter)
+      : mType(type), mDrift(drift), mLatency(latency), mJitter(jitter) {}
+
+  // Put a MIDI clock byte inside every third quarter frame message
+  bool clockInQuarterFrames = false;
+
+  // Play from a frame at a receiver time for some seconds, sending quarter
+  // frames. Groups start on even frames.
+  void play(int64_t frame, double time, double duration) {
+    double rate = MTCClock::frameRate(mType);
+    double quarter = 0.25 / rate / (1 + mDrift);
+    frame &= ~int64_t(1);
+    mStart = time;
+    mStartPosition = frame / rate;
+    for (int64_t q = 0; q * quarter < duration; q++) {
+      int piece = int(q % 8);
+      if (piece == 0 && q > 0) {
+        frame += 2;
+      }
+      int tc[4];
+      MTCClock::toTimecode(mType, frame / rate, tc[0], tc[1], tc[2], tc[3]);
+      uint8_t nibbles[8] = {uint8_t(tc[3] & 0xF),
+                            uint8_t(tc[3] >> 4),
+                            uint8_t(tc[2] & 0xF),
+                            uint8_t(tc[2] >> 4),
+                            uint8_t(tc[1] & 0xF),
+                            uint8_t(tc[1] >> 4),
+                            uint8_t(tc[0] & 0xF),
+                            uint8_t((tc[0] >> 4) | (mType << 1))};
+      double sent = time + q * quarter;
+      uint8_t data = uint8_t(piece << 4 | nibbles[piece]);
+      if (clockInQuarterFrames && q % 3 == 0) {
+        send({0xF1, 0xF8, data}, sent);
+      } else {
+        send({0xF1, data}, sent);
+      }
+    }
+  }
+
+  // Full frame message, as sent when the master locates
+  void locate(int64_t frame, double time) {
+    int tc[4];
+    MTCClock::toTimecode(mType, frame / MTCClock::frameRate(mType), tc[0],
+                         tc[1], tc[2], tc[3]);
+    send({0xF0, 0x7F, 0x7F, 0x01, 0x01, uint8_t(mType << 5 | tc[0]),
+          uint8_t(tc[1]), uint8_t(tc[2]), uint8_t(tc[3]), 0xF7},
+         time);
+  }
+
+  // Timecode at a receiver time, during the last play()
+  double truePosition(double time) const {
+    return mStartPosition + (time - mStart) * (1 + mDrift);
+  }
+
+  std::vector<TimedByte> &bytes() { return mBytes; }
+
+private:
+  void send(std::vector<uint8_t> message, double time) {
+    // MIDI keeps message order, so later messages can't overtake
+    double arrival = time + mLatency + mJitter * mUniform(mRandom);
+    if (!mBytes.empty()) {
+      arrival = std::max(arrival, mBytes.back().time);
+    }
+    for (uint8_t byte : message) {
+      mBytes.push_back({arrival, byte});
+    }
+  }
+
+  uint8_t mType;
+  double mDrift;
+  double mLatency;
+  double mJitter;
+  double mStart{0};
+  double mStartPosition{0};
+  std::vector<TimedByte> mBytes;
+  std::mt19937 mRandom{1};
+  std::uniform_real_distribution<double> mUniform{0.0, 1.0};
+};
+
+// Returns true if every time came through the queue in order
+static bool batchParsing() {
+  const uint8_t type = 2;
+  const double rate = MTCClock::frameRate(type);
+  SyntheticMaster master(type, 0, 0, 0);
+  // Across minute and ten minute boundaries
+  int64_t start =
+      std::llround(MTCClock::toSeconds(type, 0, 55, 0, 0) * rate);
+  master.play(start, 0, 30 * 60);
+
+  // MIDI clock (F8) may come between any two bytes
+  std::vector<uint8_t> stream;
+  std::mt19937 random(3);
+  for (const auto &b : master.bytes()) {
+    if (random() % 4 == 0) {
+      stream.push_back(0xF8);
+    }
+    stream.push_back(b.byte);
+  }
+
+  MTCParser batch, latest;
+  size_t received = 0, latestReceived = 0, outOfOrder = 0;
+  int32_t lastCount = -1;
+  auto begin = std::chrono::steady_clock::now();
+  for (size_t offset = 0; offset < stream.size(); offset += 256) {
+    size_t size = std::min(size_t(256), stream.size() - offset);
+    batch.feedBuffer(&stream[offset], size, offset / 31250.0);
+    MTCParser::MTCPacket packet;
+    while (batch.popPacket(packet)) {
+      int32_t count = MTCParser::frameCount(packet);
+      if (lastCount >= 0 && count != lastCount + 2) {
+        outOfOrder++;
+      }
+      lastCount = count;
+      received++;
+    }
+  }
+  double seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - begin)
+                       .count();
+  for (size_t offset = 0; offset < stream.size(); offset += 256) {
+    size_t size = std::min(size_t(256), stream.size() - offset);
+    for (size_t i = 0; i < size; i++) {
+      latest.feed(stream[offset + i]);
+    }
+    if (latest.available()) {
+      latestReceived++;
+      latest.pop();
+    }
+  }
+
+  size_t expected = master.bytes().size() / 16;
+  bool pass = received == expected && outOfOrder == 0 && batch.dropped() == 0;
+  std::cout << "Batch parsing: " << received << " of " << expected
+            << " times queued, " << outOfOrder << " out of order, "
+            << batch.dropped() << " dropped, "
+            << stream.size() / seconds / 1e6
+            << " MB/s. Reading only the latest time after each buffer: "
+            << latestReceived << ". " << (pass ? "OK" : "FAILED")
+            << std::endl;
+  return pass;
+}
+
+int main(int argc, char *argv[]) {
+  double jitter = argc > 1 ? atof(argv[1]) / 1000.0 : 0.002;
+  double drift = argc > 2 ? atof(argv[2]) * 1e-6 : 100e-6;
+  const double latency = 0.001;
+  const double sampleRate = 48000;
+  const int blockSize = 512;
+  const char *names[4] = {"24", "25", "29.97 drop", "30"};
+  bool ok = true;
+
+  for (uint8_t type = 0; type < 4; type++) {
+    double rate = MTCClock::frameRate(type);
+    SyntheticMaster master(type, drift, latency, jitter);
+    master.clockInQuarterFrames = true;
+    struct Segment {
+      double start, end;
+      SyntheticMaster copy;
+    };
+    // 20 s playing from 00:59:50:00, a jump 1 hour ahead, 10 s playing, 2 s
+    // stopped at a located position, 10 s playing from there
+    auto toFrames = [&](int hour, int minute, int second) {
+      return std::llround(MTCClock::toSeconds(type, hour, minute, second, 0) *
+                          rate);
+    };
+    int64_t first = toFrames(0, 59, 50);
+    int64_t second = toFrames(1, 59, 50);
+    int64_t third = toFrames(2, 10, 0);
+    std::vector<Segment> segments;
+    master.play(first, 0.0, 20.0);
+    segments.push_back({0.0, 20.0, master});
+    master.play(second, 20.0, 10.0);
+    segments.push_back({20.0, 30.0, master});
+    master.locate(third, 31.0);
+    master.play(third, 32.0, 10.0);
+    segments.push_back({32.0, 42.0, master});
+
+    MTCClock clock;
+    MTCFollower follower;
+    std::vector<double> located;
+    clock.onLocate = [&](double position) { located.push_back(position); };
+
+    // Compare with what MTCParser alone would show
+    MTCParser parser;
+    double parserPosition = 0;
+
+    const auto &bytes = master.bytes();
+    size_t next = 0;
+    double maxRawError = 0, maxClockError = 0, maxFollowerError = 0;
+    double maxStep = 0;
+    bool stoppedInGap = false;
+    std::mt19937 random(2);
+    std::uniform_real_distribution<double> callbackJitter(0.0, 0.001);
+    double blockTime = blockSize / sampleRate;
+    double lastEnd = 0;
+    bool haveLast = false;
+    for (double t = 0; t < 42.0; t += blockTime) {
+      // Callbacks run late by up to a millisecond
+      double now = t + callbackJitter(random);
+      for (; next < bytes.size() && bytes[next].time <= now; next++) {
+        clock.feed(bytes[next].byte, bytes[next].time);
+        parser.feed(bytes[next].byte);
+        if (parser.available()) {
+          parserPosition = MTCClock::toSeconds(
+              parser.type() & 3, parser.hour(), parser.minute(),
+              parser.second(), parser.frame());
+          parser.pop();
+        }
+      }
+      const Segment *segment = nullptr;
+      for (const auto &s : segments) {
+        if (t >= s.start && t < s.end) {
+          segment = &s;
+        }
+      }
+      bool running = follower.block(clock, blockSize, sampleRate, now);
+      if (!segment) {
+        if (t > 30.5 && t < 31.9 && !running) {
+          stoppedInGap = true;
+        }
+        haveLast = false;
+        continue;
+      }
+      // Skip two seconds after each start, while locking
+      if (t < segment->start + 2.0 || !running) {
+        haveLast = false;
+        continue;
+      }
+      // A receiver can't tell a constant MIDI delay from a timecode offset,
+      // so compare with the timecode sent one average delay ago
+      double delay = latency + jitter / 2;
+      double truth = segment->copy.truePosition(now - delay);
+      maxRawError = std::max(maxRawError, std::fabs(parserPosition - truth));
+      maxClockError =
+          std::max(maxClockError, std::fabs(clock.position(now) - truth));
+      // Blocks are meant to start at t. The average lateness of callbacks
+      // is part of the output latency.
+      double blockTruth =
+          segment->copy.truePosition(t + callbackJitter.b() / 2 - delay);
+      maxFollowerError = std::max(maxFollowerError,
+                                  std::fabs(follower.start() - blockTruth));
+      if (haveLast && !follower.resynced()) {
+        maxStep = std::max(maxStep, std::fabs(follower.start() - lastEnd));
+      }
+      lastEnd = follower.start() + follower.increment() * blockSize;
+      haveLast = true;
+    }
+
+    auto stats = clock.stats();
+    double thirdPosition = MTCClock::toSeconds(type, 2, 10, 0, 0);
+    bool locateSeen = std::any_of(
+        located.begin(), located.end(),
+        [&](double p) { return std::fabs(p - thirdPosition) < 1.0 / rate; });
+    // Loop error scales with the MIDI jitter
+    double tolerance = std::max(0.001, jitter / 2);
+    bool pass = stats.jumps == 1 && stats.dropouts == 1 &&
+                stats.locates == 1 && stoppedInGap && locateSeen &&
+                maxClockError < tolerance && maxFollowerError < tolerance;
+    ok = ok && pass;
+    std::cout << names[type] << " fps: MTCParser error " << maxRawError * 1000
+              << " ms, clock error " << maxClockError * 1000
+              << " ms, audio block error " << maxFollowerError * 1000
+              << " ms, largest discontinuity " << maxStep * sampleRate
+              << " samples. " << stats.jumps << " jumps, " << stats.dropouts
+              << " drop-outs, " << stats.locates << " locates, "
+              << located.size() << " resyncs. " << (pass ? "OK" : "FAILED")
+              << std::endl;
+  }
+  ok = batchParsing() && ok;
+  return ok ? 0 : 1;
+}
@@ -2,7 +2,6 @@
 #include "al/io/al_File.hpp"
 #include "al/io/al_Imgui.hpp"
 #include "al/io/al_Toml.hpp"
-#include "al/sound/al_DownMixer.hpp"
 #include "al/sound/al_SpeakerAdjustment.hpp"
 #include "al/sphere/al_AlloSphereSpeakerLayout.hpp"
 #include "al/sphere/al_SphereUtils.hpp"
@@ -10,11 +9,20 @@
 #include "al/ui/al_ParameterGUI.hpp"
 #include "al_ext/soundfile/al_SoundfileBuffered.hpp"
 
+#include "MTCClockReceiver.hpp"
+#include "MatrixMixer.hpp"
+
+#include <atomic>
+#include <cmath>
+#include <cstring>
+
 using namespace al;
 
 struct MappedAudioFile {
   std::unique_ptr<SoundFileBuffered> soundfile;
   std::vector<size_t> outChannelMap;
+  std::vector<float> channelGains; // Optional per channel gain
+  size_t mixerSource;
   std::string fileInfoText;
   std::string fileName;
   float gain;
@@ -30,9 +38,15 @@ public:
   Trigger rewind{"rewind"};
   Trigger fw{"fw"};
   Trigger back{"back"};
+  // Follow MIDI Time Code instead of the play button
+  ParameterBool chaseMTC{"chaseMTC", "", 0.0};
+
+  double mtcStart{0}; // Timecode (seconds) of the start of the files
+  double chaseTolerance{0.02}; // Seconds off before resyncing
+  double resyncLead{0.25};     // Seek this far ahead of the timecode
 
   bool loadFile(std::string fileName, std::vector<size_t> channelMap,
-                float gain, bool loop) {
+                float gain, bool loop, std::vector<float> channelGains = {}) {
     soundfiles.push_back(MappedAudioFile());
     soundfiles.back().soundfile = std::make_unique<SoundFileBuffered>(
         File::conformPathToOS(rootDir) + fileName, false, 4096);
@@ -42,12 +56,22 @@ public:
                 << File::conformPathToOS(rootDir) + fileName << std::endl;
       return false;
     }
-    if (soundfiles.back().soundfile->channels() != channelMap.size()) {
+    if (soundfiles.back().soundfile->channels() < channelMap.size()) {
+      // Routes must not read past the channels of an interleaved frame
       std::cerr << "Channel mismatch for file " << fileName << ". File has "
                 << soundfiles.back().soundfile->channels() << " but "
                 << channelMap.size() << " provided. Aborting." << std::endl;
+      return false;
+    }
+    if (soundfiles.back().soundfile->channels() != channelMap.size()) {
+      std::cerr << "Channel mismatch for file " << fileName << ". File has "
+                << soundfiles.back().soundfile->channels() << " but "
+                << channelMap.size()
+                << " provided. Remaining channels are not played."
+                << std::endl;
     }
     soundfiles.back().outChannelMap = channelMap;
+    soundfiles.back().channelGains = channelGains;
     soundfiles.back().gain = gain;
     soundfiles.back().fileName = fileName;
     soundfiles.back().fileInfoText +=
@@ -89,6 +113,13 @@ public:
       play = 1.0;
     });
 
+    // Locates arrive on the MIDI thread. Files are moved there by the audio
+    // thread right away, so they are buffered by the time playback starts.
+    mtcReceiver.bindTo(midiIn);
+    mtcReceiver.clock.onLocate = [&](double position) {
+      mLocateRequest = position;
+    };
+
     AudioDevice dev = AudioDevice::defaultOutput();
     if (sphere::isSphereMachine()) {
       dev = AudioDevice("ECHO X5");
@@ -97,9 +128,8 @@ public:
     configureAudio(dev, soundfiles.back().soundfile->frameRate(), 1024,
                    dev.channelsOutMax(), 0);
 
-    audioIO().append(gainAdjustment);
-
     int highestChannel = 0;
+    size_t maxFileChannels = 0;
     for (const auto &sf : soundfiles) {
       for (const auto entry : sf.outChannelMap) {
         assert(entry <= INT32_MAX);
@@ -107,13 +137,41 @@ public:
           highestChannel = static_cast<int32_t>(entry);
         }
       }
+      maxFileChannels = std::max(maxFileChannels,
+                                 (size_t)sf.soundfile->channels());
     }
     audioIO().channelsOut(highestChannel + 1);
+
+    // Speaker compensation, per file gain and downmix are folded into the
+    // mixing matrix instead of running as separate passes over the outputs.
+    if (sphere::isSphereMachine()) {
+      mMixer.setCompensation(
+          measureOutputGains(gainAdjustment, audioIO().channelsOut()),
+          speakerDistanceDelays(AlloSphereSpeakerLayoutCompensated(),
+                                audioIO().framesPerSecond()));
+    }
     if (soundfiles.size() == 6) {
-      // assume 5.1 to stereo
-      mDownMixer.set5_1toStereo(audioIO());
-      mDownMixer.setOutputs({0, 1});
+      // assume 5.1 (L R C LFE Ls Rs) to stereo, ITU-R BS.775 coefficients
+      mMixer.setDownmix({{1.0f, 0.0f, 0.707f, 0.0f, 0.707f, 0.0f},
+                         {0.0f, 1.0f, 0.707f, 0.0f, 0.0f, 0.707f}});
+    }
+    for (auto &sf : soundfiles) {
+      sf.mixerSource = mMixer.addSource(sf.soundfile->channels());
+      for (size_t i = 0; i < sf.outChannelMap.size(); i++) {
+        float channelGain =
+            i < sf.channelGains.size() ? sf.channelGains[i] : 1.0f;
+        mMixer.addRoute(sf.mixerSource, i, sf.outChannelMap[i],
+                        sf.gain * channelGain);
+      }
     }
+    // The block size can be changed in the GUI while the files play, so
+    // size for the largest one instead of reallocating on the audio thread
+    size_t maxFrames = std::max((size_t)kMaxFramesPerBuffer,
+                                (size_t)audioIO().framesPerBuffer());
+    mMixer.compile(maxFrames);
+    // One frame more for blocks stretched to follow timecode, see chase()
+    mReadBuffer.resize((maxFrames + 1) * maxFileChannels);
+    mStretchBuffer.resize(maxFrames * maxFileChannels);
   }
 
   void onCreate() override { imguiInit(); }
@@ -129,6 +187,20 @@ public:
     ParameterGUI::draw(&back);
     ImGui::SameLine(0, 20);
     ParameterGUI::draw(&fw);
+    ParameterGUI::draw(&chaseMTC);
+    if (chaseMTC.get() == 1.0f) {
+      ParameterGUI::drawMIDIIn(&midiIn);
+      const char *status[] = {"Stopped", "Locking", "Locked"};
+      ImGui::Text("MTC %s: %.3f s", status[int(mtcReceiver.clock.status())],
+                  mtcReceiver.clock.position());
+    }
+    if (ImGui::Button("Benchmark compensation")) {
+      auto sl = AlloSphereSpeakerLayoutCompensated();
+      benchmarkCompensation(
+          60, soundfiles.size(), audioIO().framesPerBuffer(),
+          audioIO().framesPerSecond(), measureOutputGains(gainAdjustment, 60),
+          speakerDistanceDelays(sl, audioIO().framesPerSecond()));
+    }
 
     ParameterGUI::drawParameterMeta(audioDomain()->parameters(),
                                     " (Global)##AudioIO");
@@ -154,30 +226,115 @@ public:
   }
 
   void onSound(AudioIOData &io) override {
-    float buffer[2048 * 60];
-    if (play.get() == 1.0f) {
+    mMixer.beginBlock(io);
+    size_t framesPerBuffer = io.framesPerBuffer();
+    size_t silentFrames = 0; // Before the files start within this block
+    int slip = 0; // Frames the files advance beyond the block, see chase()
+    bool playing = chaseMTC.get() == 1.0f
+                       ? chase(framesPerBuffer, io.framesPerSecond(),
+                               silentFrames, slip)
+                       : play.get() == 1.0f;
+    if (playing) {
+      bool downmix = downmixStereo.get() == 1.0f;
+      size_t framesToPlay = framesPerBuffer - silentFrames;
+      size_t framesToRead = framesToPlay + slip;
       for (auto &sf : soundfiles) {
-        int numChannels = sf.soundfile->channels();
-        int framesRead = sf.soundfile->read(buffer, io.framesPerBuffer());
-        if (framesRead != io.framesPerBuffer()) {
+        size_t numChannels = sf.soundfile->channels();
+        if (framesPerBuffer > mStretchBuffer.size() / numChannels) {
+          // Larger than any block size offered in the GUI
+          continue;
+        }
+        memset(mReadBuffer.data(), 0,
+               silentFrames * numChannels * sizeof(float));
+        float *samples = mReadBuffer.data() + silentFrames * numChannels;
+        int framesRead = sf.soundfile->read(samples, framesToRead);
+        if (framesRead != framesToRead) {
           std::cout << "short buffer " << framesRead << std::endl;
         }
-        for (size_t i = 0; i < sf.outChannelMap.size(); i++) {
-          size_t outIndex = sf.outChannelMap[i];
-          if (!sf.mute) {
-            for (uint64_t sample = 0; sample < framesRead; sample++) {
-              io.outBuffer(outIndex)[sample] +=
-                  sf.gain * buffer[sample * numChannels + i];
-            }
-          }
+        if (slip != 0 && framesRead == framesToRead) {
+          stretch(samples, framesToRead, mStretchBuffer.data(), framesToPlay,
+                  numChannels);
+          mMixer.mix(sf.mixerSource, mStretchBuffer.data(), framesToPlay, io,
+                     sf.mute ? 0.0f : 1.0f, downmix);
+        } else {
+          mMixer.mix(sf.mixerSource, mReadBuffer.data(),
+                     silentFrames + framesRead, io, sf.mute ? 0.0f : 1.0f,
+                     downmix);
         }
       }
-      if (downmixStereo.get() == 1.0) {
-        mDownMixer.downMix(io);
+      mFilePosition += framesToRead / io.framesPerSecond();
+    }
+  }
+
+  // Linear interpolation of interleaved frames to another length, keeping
+  // the first and last frame
+  static void stretch(const float *in, size_t inFrames, float *out,
+                      size_t outFrames, size_t numChannels) {
+    double step = outFrames > 1 ? double(inFrames - 1) / (outFrames - 1) : 0;
+    for (size_t i = 0; i < outFrames; i++) {
+      double position = i * step;
+      size_t i0 = std::min(size_t(position), inFrames - 1);
+      size_t i1 = std::min(i0 + 1, inFrames - 1);
+      float t = float(position - i0);
+      const float *a = in + i0 * numChannels;
+      const float *b = in + i1 * numChannels;
+      for (size_t ch = 0; ch < numChannels; ch++) {
+        out[i * numChannels + ch] = a[ch] + t * (b[ch] - a[ch]);
       }
     }
   }
 
+  // Decides whether the files play in this block when following MIDI Time
+  // Code. When the files are out of sync they are moved resyncLead seconds
+  // ahead of the timecode and wait there, so the soundfile buffers have time
+  // to fill. Playback then starts at the exact sample the timecode reaches
+  // them.
+  //
+  // While playing, the files follow the rate of the timecode. When they are
+  // a frame or more from where the timecode will be at the end of the
+  // block, slip is set to read one frame more or less, stretched to the
+  // block: a pitch change of at most a frame per block. Drift between the
+  // timecode master and the audio clock then never builds up to a resync,
+  // only real jumps seek.
+  bool chase(size_t frames, double sampleRate, size_t &silentFrames,
+             int &slip) {
+    double locate = mLocateRequest.exchange(-1.0);
+    if (locate >= 0) {
+      seekFiles(locate - mtcStart);
+    }
+    if (!mFollower.block(mtcReceiver.clock, int(frames), sampleRate)) {
+      return false;
+    }
+    double lead = mFilePosition - (mFollower.start() - mtcStart);
+    if (mWaiting && lead > 0 && lead < 2 * resyncLead) {
+      size_t waitFrames = size_t(lead * sampleRate);
+      if (waitFrames >= frames) {
+        return false;
+      }
+      silentFrames = waitFrames;
+      mWaiting = false;
+      return true;
+    }
+    if (std::fabs(lead) > chaseTolerance) {
+      seekFiles(mFollower.start() - mtcStart + resyncLead);
+      return false;
+    }
+    mWaiting = false;
+    double end = mFollower.start() + mFollower.increment() * frames - mtcStart;
+    double behind = (end - mFilePosition) * sampleRate - frames;
+    slip = behind >= 1.0 ? 1 : behind <= -1.0 ? -1 : 0;
+    return true;
+  }
+
+  void seekFiles(double time) {
+    time = std::max(0.0, time);
+    for (auto &sf : soundfiles) {
+      sf.soundfile->seek(long(std::llround(time * sf.soundfile->frameRate())));
+    }
+    mFilePosition = time;
+    mWaiting = true;
+  }
+
   void onExit() override {
     for (auto &sf : soundfiles) {
       sf.soundfile->close();
@@ -186,9 +343,21 @@ public:
   }
 
 private:
+  // Largest block size offered by ParameterGUI::drawAudioIO()
+  static constexpr size_t kMaxFramesPerBuffer = 2048;
+
   std::vector<MappedAudioFile> soundfiles;
   SpeakerDistanceGainAdjustmentProcessor gainAdjustment;
-  DownMixer mDownMixer;
+  MatrixMixer mMixer;
+  std::vector<float> mReadBuffer;
+  std::vector<float> mStretchBuffer;
+
+  RtMidiIn midiIn;
+  MTCClockReceiver mtcReceiver;
+  MTCFollower mFollower;
+  std::atomic<double> mLocateRequest{-1.0}; // Set by the MIDI thread
+  double mFilePosition{0}; // Seconds, where the next read starts
+  bool mWaiting{false};    // Sought ahead, waiting for the timecode
 };
 
 int main(int argc, char *argv[]) {
@@ -205,6 +374,10 @@ gain = 0.9
 name = "test_mono.wav"
 outChannels = [1]
 gain = 1.2
+channelGains = [0.5]
+
+  Optionally, mtcStart = 3600.0 sets the MIDI Time Code (in seconds) at which
+  the files start when chasing timecode.
     */
 
   std::string configFile;
@@ -219,6 +392,9 @@ gain = 1.2
   if (appConfig.hasKey<std::string>("rootDir")) {
     app.rootDir = appConfig.gets("rootDir");
   }
+  if (appConfig.hasKey<double>("mtcStart")) {
+    app.mtcStart = appConfig.getd("mtcStart");
+  }
   if (appConfig.hasKey<double>("globalGain")) {
     assert(app.audioDomain()->parameters()[0]->getName() == "gain");
     app.audioDomain()->parameters()[0]->fromFloat(appConfig.getd("globalGain"));
@@ -241,8 +417,14 @@ gain = 1.2
       for (auto channel : outChannelsToml) {
         outChannels.push_back(channel);
       }
+      std::vector<float> channelGains;
+      if (table->contains("channelGains")) {
+        for (auto g : *table->get_array_of<double>("channelGains")) {
+          channelGains.push_back(g);
+        }
+      }
       // Load requested file into app. If any file fails, abort.
-      if (!app.loadFile(name, outChannels, gain, loop)) {
+      if (!app.loadFile(name, outChannels, gain, loop, channelGains)) {
         return -1;
       }
     }
@@ -23,6 +23,12 @@
 #include "Gamma/Analysis.h"
 #include "Gamma/scl.h"
 
+#include "BlockLbap.hpp"
+#include "MTCClockReceiver.hpp"
+
+#include <algorithm>
+#include <atomic>
+
 using namespace al;
 
 struct SharedState {
@@ -38,11 +44,60 @@ struct MappedAudioFile {
   bool mute{false};
 };
 
+// Scratch memory for AudioObject soundfile reads. Allocated once when the scene
+// is set up, for the largest block size and channel count, so voices don't
+// touch a large stack buffer on every audio callback and the memory is never
+// reallocated while audio runs.
+// Each voice claims its own slot the first time it is triggered. A slot holds
+// an interleaved read area of framesPerBuffer * maxChannels samples and one
+// contiguous (deinterleaved) buffer per routed channel.
+struct AudioScratchArena {
+  void allocate(size_t numSlots, size_t framesPerBuffer, size_t maxChannels,
+                size_t routedChannels) {
+    mFramesPerBuffer = framesPerBuffer;
+    mMaxChannels = maxChannels;
+    mRoutedChannels = routedChannels;
+    mSlotSize = framesPerBuffer * (maxChannels + routedChannels);
+    mData.assign(numSlots * mSlotSize, 0.0f);
+    mNumSlots = numSlots;
+  }
+
+  // Returns a slot index or -1 if all slots have been claimed.
+  int claimSlot() {
+    int slot = mNextSlot.fetch_add(1);
+    if (slot >= static_cast<int>(mNumSlots)) {
+      return -1;
+    }
+    return slot;
+  }
+
+  float *interleaved(int slot) { return mData.data() + slot * mSlotSize; }
+
+  float *routed(int slot, size_t routedIndex) {
+    return interleaved(slot) + mFramesPerBuffer * mMaxChannels +
+           mFramesPerBuffer * routedIndex;
+  }
+
+  size_t framesPerBuffer() const { return mFramesPerBuffer; }
+  size_t maxChannels() const { return mMaxChannels; }
+  size_t routedChannels() const { return mRoutedChannels; }
+
+private:
+  std::vector<float> mData;
+  size_t mNumSlots{0};
+  size_t mSlotSize{0};
+  size_t mFramesPerBuffer{0};
+  size_t mMaxChannels{0};
+  size_t mRoutedChannels{0};
+  std::atomic<int> mNextSlot{0};
+};
+
 struct AudioObjectData {
   std::string rootPath;
   uint16_t audioSampleRate;
   uint16_t audioBlockSize;
   Mesh *mesh;
+  AudioScratchArena *arena{nullptr};
 };
 
 class AudioObject : public PositionedVoice {
@@ -69,19 +124,39 @@ public:
   }
 
   void onProcess(AudioIOData &io) override {
-    float buffer[2048 * 60];
-    int numChannels = soundfile.channels();
-    assert(io.framesPerBuffer() < INT32_MAX);
+    if (mArenaSlot < 0 || !soundfile.opened()) {
+      return;
+    }
+    auto &arena = *static_cast<AudioObjectData *>(userData())->arena;
+    size_t numChannels = soundfile.channels();
+    size_t framesToRead = io.framesPerBuffer();
+    if (framesToRead > arena.framesPerBuffer() ||
+        numChannels > arena.maxChannels()) {
+      // Arena was sized for a different configuration. Skip block rather than
+      // overrun the scratch memory.
+      return;
+    }
+    float *interleaved = arena.interleaved(mArenaSlot);
+    float *mono = arena.routed(mArenaSlot, 0);
+    assert(framesToRead < INT32_MAX);
     auto framesRead =
-        soundfile.read(buffer, static_cast<int>(io.framesPerBuffer()));
-    int outIndex = 0;
-    size_t inChannel = 0;
-    if (!mute) {
-      for (size_t sample = 0; sample < framesRead; sample++) {
-        io.outBuffer(outIndex)[sample] +=
-            gain * buffer[sample * numChannels + inChannel];
-        mEnvFollow(buffer[sample * numChannels + inChannel]);
-      }
+        soundfile.read(interleaved, static_cast<int>(framesToRead));
+    if (mute) {
+      return;
+    }
+
+    // Only deinterleave the routed channel
+    const float *in = interleaved + inChannel;
+    for (size_t sample = 0; sample < framesRead; sample++) {
+      mono[sample] = *in;
+      in += numChannels;
+    }
+
+    float *out = io.outBuffer(outIndex);
+    const float g = gain;
+    for (size_t sample = 0; sample < framesRead; sample++) {
+      out[sample] += g * mono[sample];
+      mEnvFollow(mono[sample]);
     }
   }
 
@@ -101,6 +176,13 @@ public:
     auto objData = static_cast<AudioObjectData *>(userData());
 
     if (isPrimary()) {
+      if (mArenaSlot < 0) {
+        mArenaSlot = objData->arena->claimSlot();
+        if (mArenaSlot < 0) {
+          std::cerr << "ERROR: no scratch buffer available for voice "
+                    << id() << std::endl;
+        }
+      }
       auto &rootPath = objData->rootPath;
       soundfile.open(File::conformPathToOS(rootPath) + file.get());
       if (!soundfile.opened()) {
@@ -135,6 +217,11 @@ private:
   Color c;
 
   gam::EnvFollow<> mEnvFollow;
+
+  // Soundfile channel sent to the spatializer and voice output channel
+  const size_t inChannel{0};
+  const int outIndex{0};
+  int mArenaSlot{-1};
 };
 
 class SpatialSequencer : public DistributedAppWithState<SharedState> {
@@ -145,6 +232,10 @@ public:
                          TimeMasterMode::TIME_MASTER_UPDATE};
 
   ParameterBool downMix{"downMix"};
+  // Move the sequencer to the MIDI Time Code position when it starts, jumps
+  // or locates
+  ParameterBool chaseMTC{"chaseMTC"};
+  double mtcStart{0}; // Timecode (seconds) of sequencer time 0
 
   PersistentConfig config;
   DownMixer downMixer;
@@ -160,12 +251,13 @@ public:
     mObjectData.rootPath = rootDir;
     mObjectData.audioSampleRate = audioIO().framesPerSecond();
     mObjectData.audioBlockSize = audioIO().framesPerBuffer();
+    mObjectData.arena = &mScratchArena;
     scene.setDefaultUserData(&mObjectData);
 
     if (al::sphere::isSimulatorMachine()) {
     }
     auto sl = al::AlloSphereSpeakerLayoutCompensated();
-    mSpatializer = scene.setSpatializer<Lbap>(sl);
+    mSpatializer = scene.setSpatializer<BlockLbap>(sl);
 
     audioIO().channelsOut(60);
     audioIO().print();
@@ -177,14 +269,20 @@ public:
 
     registerDynamicScene(scene);
     scene.registerSynthClass<AudioObject>(); // Allow AudioObject in sequences
-    scene.allocatePolyphony<AudioObject>(16);
+    scene.allocatePolyphony<AudioObject>(kPolyphony);
+    allocateScratchArena();
 
     // Prepare GUI
     if (isPrimary()) {
       auto guiDomain = GUIDomain::enableGUI(defaultWindowDomain());
       auto &gui = guiDomain->newGUI();
-      gui << downMix << mSequencer << audioDomain()->parameters()[0];
+      gui << downMix << chaseMTC << mSequencer
+          << audioDomain()->parameters()[0];
+      mtcReceiver.bindTo(midiIn);
       gui.drawFunction = [&]() {
+        if (chaseMTC) {
+          ParameterGUI::drawMIDIIn(&midiIn);
+        }
         if (ParameterGUI::drawAudioIO(audioIO())) {
           scene.prepare(audioIO());
           mObjectData.audioSampleRate = audioIO().framesPerSecond();
@@ -195,6 +293,15 @@ public:
     CuttleboneDomain<SharedState>::enableCuttlebone(this);
   }
 
+  // Soundfiles are only opened when their voice is triggered, so the arena
+  // is sized for any file up to kMaxFileChannels channels
+  void allocateScratchArena() {
+    mScratchArena.allocate(kPolyphony,
+                           std::max((size_t)kMaxFramesPerBuffer,
+                                    (size_t)audioIO().framesPerBuffer()),
+                           kMaxFileChannels, 1);
+  }
+
   void onCreate() override {
     // Prepare mesh
     addSphere(mSphereMesh, 0.1);
@@ -207,6 +314,9 @@ public:
   void onAnimate(double dt) override {
     mSequencer.update(dt);
     if (isPrimary()) {
+      if (chaseMTC) {
+        followMTC();
+      }
       auto &values = mMeter.getMeterValues();
       assert(values.size() < 65);
       memcpy(state().meterValues, values.data(), values.size() * sizeof(float));
@@ -254,15 +364,40 @@ public:
 
   void onExit() override {}
 
+  // The sequencer keeps its own time between resyncs. Sequences are short
+  // enough that the drift between the two clocks doesn't matter.
+  void followMTC() {
+    const MTCClock::Snapshot clock = mtcReceiver.clock.snapshot();
+    double time = MTCClock::now();
+    if (clock.status(time) == MTCClock::Status::Stopped) {
+      return;
+    }
+    if (clock.generation != mMTCGeneration) {
+      mMTCGeneration = clock.generation;
+      mSequencer.setTime(float(clock.position(time) - mtcStart));
+    }
+  }
+
 private:
+  static const size_t kPolyphony = 16;
+  // Largest block size offered by ParameterGUI::drawAudioIO()
+  static const size_t kMaxFramesPerBuffer = 2048;
+  // One channel per speaker
+  static const size_t kMaxFileChannels = 60;
+
   VAOMesh mObjectMesh;
   VAOMesh mSphereMesh;
 
   SynthSequencer mSequencer{TimeMasterMode::TIME_MASTER_CPU};
   AudioObjectData mObjectData;
+  AudioScratchArena mScratchArena;
   SpeakerDistanceGainAdjustmentProcessor gainAdjustment;
   Meter mMeter;
   std::shared_ptr<Spatializer> mSpatializer;
+
+  RtMidiIn midiIn;
+  MTCClockReceiver mtcReceiver;
+  uint32_t mMTCGeneration{0};
 };
 
 int main(int argc, char *argv[]) {
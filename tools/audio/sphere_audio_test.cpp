@@ -26,59 +26,58 @@
 #include "Gamma/Noise.h"
 #include "Gamma/scl.h"
 
+#include "../../cookbook/distributed/StateSmoother.hpp"
+#include "../graphics/InstancedMesh.hpp"
+#include "BlockLbap.hpp"
+#include "MeterEngine.hpp"
+
+#include <atomic>
+#include <thread>
+
 using namespace al;
 
 struct SharedState {
   float meterValues[64] = {0};
   Pose pose;
+  double time = 0; // When the primary wrote this state
 };
 
 struct AudioObjectData {
   uint16_t audioSampleRate;
   uint16_t audioBlockSize;
-  Mesh *mesh;
+  InstancedMesh *instances; // Voices add themselves, drawn in one call
 };
 
 class Meter {
 public:
   void init(const Speakers &sl) {
-    addCube(mMesh);
+    Mesh cube;
+    addCube(cube);
+    mInstances.init(cube);
     mSl = sl;
   }
 
-  void processSound(AudioIOData &io) {
+  // Allocate metering buffers. Must be called before audio starts.
+  void prepare(const AudioIOData &io) {
+    mEngine.prepare(io.channelsOut(), io.framesPerBuffer(),
+                    io.framesPerSecond());
+    values.resize(io.channelsOut(), 0.01f);
+  }
 
-    if (tempValues.size() != io.channelsOut()) {
-      tempValues.resize(io.channelsOut());
-      values.resize(io.channelsOut());
-      std::cout << "Resizing Meter buffers" << std::endl;
+  void processSound(AudioIOData &io) {
+    if (!mEngine.prepared(io.channelsOut(), io.framesPerBuffer())) {
+      // Audio configuration changed without a call to prepare()
+      return;
     }
-    for (int i = 0; i < io.channelsOut(); i++) {
-      tempValues[i] = FLT_MIN;
-      auto *outBuf = io.outBuffer(i);
-      auto fpb = io.framesPerBuffer();
-      for (int samp = 0; samp < fpb; samp++) {
-        float val = fabs(*outBuf);
-        if (tempValues[i] < val) {
-          tempValues[i] = val;
-        }
-        outBuf++;
-      }
-      if (tempValues[i] == 0) {
-        tempValues[i] = 0.01;
-      } else {
-        float db = 20.0 * log10(tempValues[i]);
-        if (db < -60) {
-          tempValues[i] = 0.01;
-        } else {
-          tempValues[i] = 0.01 + 0.005 * (60 + db);
-        }
-      }
-      if (values[i] > tempValues[i]) {
-        values[i] = values[i] - 0.05 * (values[i] - tempValues[i]);
-      } else {
-        values[i] = tempValues[i];
-      }
+    mEngine.process(io);
+  }
+
+  // Pick up latest published values. Call from the graphics thread.
+  void update() {
+    if (mEngine.update()) {
+      const auto &snapshot = mEngine.snapshot();
+      values.resize(snapshot.numChannels);
+      mEngine.copyDisplayValues(values.data(), values.size());
     }
   }
 
@@ -86,18 +85,15 @@ public:
     g.polygonLine();
     int index = 0;
     auto spkrIt = mSl.begin();
-    g.color(1);
+    mInstances.clear();
     for (const auto &v : values) {
       if (spkrIt != mSl.end()) {
         // FIXME assumes speakers are sorted by device channel index
         // Should sort inside init()
         if (spkrIt->deviceChannel == index) {
-          g.pushMatrix();
-          g.scale(1 / 5.0f);
-          g.translate(spkrIt->vecGraphics());
-          g.scale(0.1 + v * 5);
-          g.draw(mMesh);
-          g.popMatrix();
+          // Same transform as scale(1/5), translate, scale(0.1 + v * 5)
+          mInstances.add(Vec3f(spkrIt->vecGraphics()) / 5.0f,
+                         (0.1f + v * 5) / 5.0f);
           spkrIt++;
         }
       } else {
@@ -105,27 +101,25 @@ public:
       }
       index++;
     }
+    mInstances.draw(g);
   }
 
   const std::vector<float> &getMeterValues() { return values; }
 
+  // Full snapshot with peak, RMS and true peak in dB
+  const MeterSnapshot &snapshot() const { return mEngine.snapshot(); }
+
   void setMeterValues(float *newValues, size_t count) {
-    if (tempValues.size() != count) {
-      tempValues.resize(count);
+    if (values.size() != count) {
       values.resize(count);
-      std::cout << "Resizing Meter buffers" << std::endl;
-    }
-    count = values.size();
-    for (int i = 0; i < count; i++) {
-      values[i] = *newValues;
-      newValues++;
     }
+    memcpy(values.data(), newValues, count * sizeof(float));
   }
 
 private:
-  Mesh mMesh;
-  std::vector<float> values;
-  std::vector<float> tempValues;
+  InstancedMesh mInstances;
+  MeterEngine mEngine;
+  std::vector<float> values; // Display values, graphics thread only
   Speakers mSl;
 };
 
@@ -202,15 +196,13 @@ public:
   }
 
   void onProcess(Graphics &g) override {
-    auto &mesh = *static_cast<AudioObjectData *>(userData())->mesh;
+    auto &instances = *static_cast<AudioObjectData *>(userData())->instances;
     if (isPrimary()) {
       env = mEnvFollow.value();
     }
-    g.scale(0.5);
-    g.scale(0.1 + gain + env * 10);
-    g.color(c);
-    g.polygonLine();
-    g.draw(mesh);
+    // Queued here and drawn by the app with all other voices in one call
+    instances.add(Vec3f(pose().pos()), 0.5f * (0.1f + gain + env * 10),
+                  c.get());
   }
 
   void onTriggerOn() override {
@@ -239,16 +231,18 @@ public:
 
   void onInit() override {
     // Prepare scene shared data
-    mObjectData.mesh = &this->mObjectMesh;
+    mObjectData.instances = &this->mObjectInstances;
     mObjectData.audioSampleRate = audioIO().framesPerSecond();
     mObjectData.audioBlockSize = audioIO().framesPerBuffer();
     scene.setDefaultUserData(&mObjectData);
 
     auto sl = al::AlloSphereSpeakerLayoutCompensated();
-    mSpatializer = scene.setSpatializer<Lbap>(sl);
+    mSpatializer = scene.setSpatializer<BlockLbap>(sl);
 
     audioIO().channelsOut(60);
     audioIO().print();
+    // Audio starts before onCreate(), so the meter is allocated here
+    mMeter.prepare(audioIO());
 
     mSequencer << scene;
 
@@ -267,6 +261,7 @@ public:
         auto voice = mSequencer.synth().getActiveVoices();
         if (!voice) {
           ImGui::Text("Press 'p' to add a source, 'o' to remove");
+          ImGui::Text("Press 'b' to benchmark the spatializer");
         }
         while (voice) {
           ImGui::PushID(voice->id());
@@ -294,21 +289,29 @@ public:
     // Prepare mesh
     addSphere(mSphereMesh, 0.1);
     mSphereMesh.update();
-    addSphere(mObjectMesh, 0.1, 8, 4);
-    mObjectMesh.update();
+    Mesh objectMesh;
+    addSphere(objectMesh, 0.1, 8, 4);
+    mObjectInstances.init(objectMesh);
     mMeter.init(mSpatializer->speakerLayout());
   }
 
   void onAnimate(double dt) override {
     mSequencer.update(dt);
     if (isPrimary()) {
+      mMeter.update();
       auto &values = mMeter.getMeterValues();
       assert(values.size() < 65);
       memcpy(state().meterValues, values.data(), values.size() * sizeof(float));
       state().pose = nav();
+      state().time = stateTime();
     } else {
-      mMeter.setMeterValues(state().meterValues, 64);
-      nav().set(state().pose);
+      // Draw the state from a fixed delay ago, interpolated between received
+      // frames, so irregular arrival doesn't show as stutter
+      mSmoother.receive(state().time, state());
+      if (mSmoother.sample(mShownState)) {
+        mMeter.setMeterValues(mShownState.meterValues, 64);
+        nav().set(mShownState.pose);
+      }
     }
   }
 
@@ -329,7 +332,10 @@ public:
     }
     mMeter.draw(g);
 
+    mObjectInstances.clear();
     mSequencer.render(g);
+    g.polygonLine();
+    mObjectInstances.draw(g);
     g.popMatrix();
   }
 
@@ -350,14 +356,69 @@ public:
       if (voice) {
         scene.triggerOff(voice->id());
       }
+    } else if (k.key() == 'b') {
+      startBenchmark();
+    } else if (k.key() == 's' && !isPrimary()) {
+      auto &stats = mSmoother.stats();
+      std::cout << "State latency " << stats.latency * 1000 << " ms, jitter "
+                << stats.jitter * 1000 << " ms, " << stats.framesReceived
+                << " frames, " << stats.framesLate << " late, "
+                << stats.samplesExtrapolated << " samples extrapolated, "
+                << stats.samplesHeld << " held" << std::endl;
+      mSmoother.resetStats();
     }
     return true;
   }
 
-  void onExit() override {}
+  void onExit() override {
+    if (mBenchmark.joinable()) {
+      mBenchmark.join();
+    }
+  }
+
+  // Compare block-rate kernel against per-sample Lbap. Takes seconds, so it
+  // runs on its own thread rather than stalling rendering and state updates.
+  void startBenchmark() {
+    if (mBenchmarking) {
+      std::cout << "Benchmark already running" << std::endl;
+      return;
+    }
+    if (mBenchmark.joinable()) {
+      mBenchmark.join();
+    }
+    mBenchmarking = true;
+    int fpb = audioIO().framesPerBuffer();
+    double sr = audioIO().framesPerSecond();
+    mBenchmark = std::thread([this, fpb, sr]() {
+      auto sl = al::AlloSphereSpeakerLayoutCompensated();
+      Lbap lbap(sl);
+      lbap.compile();
+      BlockLbap blockLbap(sl);
+      blockLbap.compile();
+      benchmarkSpatializer(lbap, "Lbap", 60, 256, fpb, sr);
+      benchmarkSpatializer(blockLbap, "BlockLbap", 60, 256, fpb, sr);
+      // With the gains and delays a sphere machine would use, although this
+      // app doesn't compensate its own output
+      SpeakerDistanceGainAdjustmentProcessor adjustment;
+      adjustment.configure(sl, 1.82);
+      benchmarkCompensation(60, 256, fpb, sr,
+                            measureOutputGains(adjustment, 60),
+                            speakerDistanceDelays(sl, sr));
+      mBenchmarking = false;
+    });
+  }
 
 private:
-  VAOMesh mObjectMesh;
+  StateSmoother<SharedState> mSmoother{
+      [](const SharedState &a, const SharedState &b, float t,
+         SharedState &out) {
+        lerpArray(a.meterValues, b.meterValues, t, out.meterValues, 64);
+        out.pose = lerpPose(a.pose, b.pose, t);
+        out.time = b.time;
+      }};
+  SharedState mShownState;
+
+  InstancedMesh mObjectInstances;
   VAOMesh mSphereMesh;
 
   SynthSequencer mSequencer{TimeMasterMode::TIME_MASTER_CPU};
@@ -365,6 +426,9 @@ private:
   SpeakerDistanceGainAdjustmentProcessor gainAdjustment;
   Meter mMeter;
   std::shared_ptr<Spatializer> mSpatializer;
+
+  std::thread mBenchmark;
+  std::atomic<bool> mBenchmarking{false};
 };
 
 int main() {
@@ -0,0 +1,395 @@
+#!/usr/bin/env python3
+"""
+Local cluster harness for DistributedAppWithState apps.
+
+Launches one primary and K renderer instances of an already built app on this
+machine, lets them run for a while and reports per node frame rate, state
+frames and bytes per second, dropped frames, state latency and CPU use.
+See readme_local_cluster.md.
+
+DistributedApp makes the first instance on a machine the primary and the
+following ones renderers, so the primary is started first and given a moment
+to open its ports before the renderers start.
+
+Frame, byte, drop and latency numbers come from the NODESTATS lines apps print
+when AL_NODE_STATS is set (see cookbook/distributed/NodeStats.hpp). CPU use
+and peak memory are read from /proc and are available for any app.
+
+Usage:
+    local_cluster.py [options] path/to/app [app args...]
+
+Exits with 1 if the cluster did not come up (no primary, a node exited early,
+a renderer saw no state) or a --max-* limit was exceeded, so it can gate CI.
+Apps that don't print NODESTATS at all only get a warning and CPU and memory
+numbers, unless a limit that needs the statistics was given.
+"""
+
+import argparse
+import json
+import os
+import shutil
+import signal
+import subprocess
+import sys
+import threading
+import time
+
+CLOCK_TICKS = os.sysconf("SC_CLK_TCK")
+
+
+def parse_args():
+    parser = argparse.ArgumentParser(
+        description="Run a primary and K renderers of a distributed app "
+        "on this machine and report state distribution statistics.")
+    parser.add_argument("app", help="app executable")
+    parser.add_argument("app_args", nargs=argparse.REMAINDER,
+                        help="arguments passed to every instance")
+    parser.add_argument("-k", "--renderers", type=int, default=2,
+                        help="number of renderer instances (default 2)")
+    parser.add_argument("-d", "--duration", type=float, default=20,
+                        help="seconds measured (default 20)")
+    parser.add_argument("--warmup", type=float, default=5,
+                        help="seconds ignored after the last node starts "
+                        "(default 5)")
+    parser.add_argument("--startup", type=float, default=2,
+                        help="seconds between starting the primary and the "
+                        "renderers (default 2)")
+    parser.add_argument("--headless", action="store_true",
+                        help="run the nodes on a private Xvfb display")
+    parser.add_argument("--netns", action="store_true",
+                        help="run the cluster in its own network namespace "
+                        "(rootless, needs unprivileged user namespaces)")
+    parser.add_argument("--delay-ms", type=float, default=0,
+                        help="netem delay on loopback, needs --netns")
+    parser.add_argument("--jitter-ms", type=float, default=0,
+                        help="netem delay variation, needs --delay-ms")
+    parser.add_argument("--loss", type=float, default=0,
+                        help="netem packet loss percent, needs --netns")
+    parser.add_argument("--cwd", default=None,
+                        help="working directory of the nodes (default: the "
+                        "app's directory)")
+    parser.add_argument("--logs", default=None,
+                        help="directory to write each node's output to")
+    parser.add_argument("--json", default=None,
+                        help="write the results to this file")
+    parser.add_argument("--max-latency-ms", type=float, default=None,
+                        help="fail if a renderer's mean latency is higher")
+    parser.add_argument("--max-dropped", type=int, default=None,
+                        help="fail if a renderer dropped more frames")
+    parser.add_argument("--min-fps", type=float, default=None,
+                        help="fail if a node's state frame rate is lower")
+    parser.add_argument("--in-netns", action="store_true",
+                        help=argparse.SUPPRESS)
+    args = parser.parse_args()
+    if (args.delay_ms or args.loss) and not args.netns:
+        parser.error("--delay-ms and --loss need --netns")
+    return args
+
+
+def run(cmd):
+    if subprocess.run(cmd).returncode != 0:
+        sys.exit("Failed: " + " ".join(cmd))
+
+
+def setup_netns(args):
+    """Runs inside the new namespace, where we are root over its devices."""
+    run(["ip", "link", "set", "lo", "up"])
+    # Broadcast state (255.255.255.255) needs a route out of the namespace's
+    # only interface
+    run(["ip", "route", "add", "default", "dev", "lo"])
+    if args.delay_ms or args.loss:
+        netem = ["tc", "qdisc", "add", "dev", "lo", "root", "netem"]
+        if args.delay_ms:
+            netem += ["delay", "%gms" % args.delay_ms]
+            if args.jitter_ms:
+                netem += ["%gms" % args.jitter_ms]
+        if args.loss:
+            netem += ["loss", "%g%%" % args.loss]
+        if subprocess.run(netem).returncode != 0:
+            sys.exit("Could not add netem to loopback (is the sch_netem "
+                     "kernel module available?)")
+
+
+def start_xvfb():
+    if not shutil.which("Xvfb"):
+        sys.exit("--headless needs Xvfb")
+    for display in range(90, 120):
+        if os.path.exists("/tmp/.X11-unix/X%d" % display) or \
+                os.path.exists("/tmp/.X%d-lock" % display):
+            continue
+        xvfb = subprocess.Popen(
+            ["Xvfb", ":%d" % display, "-screen", "0", "1280x720x24",
+             "-nolisten", "tcp"],
+            stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        for _ in range(50):
+            if os.path.exists("/tmp/.X11-unix/X%d" % display):
+                return xvfb, ":%d" % display
+            if xvfb.poll() is not None:
+                break
+            time.sleep(0.1)
+        xvfb.kill()
+    sys.exit("Could not start Xvfb")
+
+
+def cpu_seconds(pid):
+    """User plus system CPU time of a process, None once it is gone."""
+    try:
+        with open("/proc/%d/stat" % pid) as f:
+            # The command name can contain spaces, fields start after it
+            fields = f.read().rsplit(")", 1)[1].split()
+        return (int(fields[11]) + int(fields[12])) / CLOCK_TICKS
+    except (OSError, IndexError, ValueError):
+        return None
+
+
+def peak_memory_mb(pid):
+    try:
+        with open("/proc/%d/status" % pid) as f:
+            for line in f:
+                if line.startswith("VmHWM:"):
+                    return int(line.split()[1]) / 1024
+    except (OSError, ValueError):
+        pass
+    return None
+
+
+class Node:
+    def __init__(self, name, cmd, cwd, env, log_dir):
+        self.name = name
+        self.lines = []  # (time, line)
+        self.log = None
+        if log_dir:
+            self.log = open(os.path.join(log_dir, name + ".log"), "w")
+        self.process = subprocess.Popen(
+            cmd, cwd=cwd, env=env, stdin=subprocess.DEVNULL,
+            stdout=subprocess.PIPE, stderr=subprocess.STDOUT,
+            universal_newlines=True, errors="replace",
+            start_new_session=True)
+        self.reader = threading.Thread(target=self.read, daemon=True)
+        self.reader.start()
+        self.cpu_start = None
+        self.cpu_end = None
+        self.memory = None
+
+    def read(self):
+        for line in self.process.stdout:
+            self.lines.append((time.monotonic(), line.rstrip("\n")))
+            if self.log:
+                self.log.write(line)
+                self.log.flush()
+
+    def running(self):
+        return self.process.poll() is None
+
+    def stop(self):
+        # The whole session, in case the app starts helpers
+        try:
+            if self.running():
+                os.killpg(self.process.pid, signal.SIGINT)
+                self.process.wait(5)
+        except subprocess.TimeoutExpired:
+            os.killpg(self.process.pid, signal.SIGKILL)
+            self.process.wait()
+        except ProcessLookupError:
+            pass
+        self.reader.join(1)
+        if self.log:
+            self.log.close()
+
+    def stats(self, start, end):
+        """NODESTATS samples printed between start and end."""
+        samples = []
+        for t, line in self.lines:
+            if t < start or t > end or not line.startswith("NODESTATS "):
+                continue
+            sample = {}
+            for field in line.split()[1:]:
+                key, _, value = field.partition("=")
+                try:
+                    sample[key] = float(value)
+                except ValueError:
+                    sample[key] = value
+            samples.append(sample)
+        return samples
+
+
+def summarize(node, window):
+    samples = node.stats(*window)
+    result = {"node": node.name, "pid": node.process.pid,
+              "exit_code": node.process.poll(), "samples": len(samples)}
+    if node.cpu_start is not None and node.cpu_end is not None:
+        result["cpu_percent"] = \
+            100 * (node.cpu_end - node.cpu_start) / (window[1] - window[0])
+    if node.memory is not None:
+        result["peak_memory_mb"] = node.memory
+    if samples:
+        roles = [s.get("role") for s in samples]
+        result["role"] = max(set(roles), key=roles.count)
+        n = len(samples)
+        frames = sum(s.get("frames", 0) for s in samples)
+        result["fps"] = sum(s.get("fps", 0) for s in samples) / n
+        result["frames"] = int(frames)
+        result["dropped"] = int(sum(s.get("dropped", 0) for s in samples))
+        result["bytes_per_s"] = sum(s.get("bytes_per_s", 0)
+                                    for s in samples) / n
+        if result["role"] == "renderer" and frames:
+            # Weighted by frames, the samples are means over an interval
+            result["latency_ms"] = sum(
+                s.get("latency_ms", 0) * s.get("frames", 0)
+                for s in samples) / frames
+            result["latency_max_ms"] = max(s.get("latency_max_ms", 0)
+                                           for s in samples)
+    return result
+
+
+def check(results, args):
+    """Returns (failures, warnings)."""
+    failures = []
+    warnings = []
+    limits = [args.min_fps, args.max_dropped, args.max_latency_ms]
+    if not any(r["samples"] for r in results):
+        # An app without NodeStats: only CPU and memory can be checked
+        for r in results:
+            if r["exit_code"] is not None:
+                failures.append("%s exited early with %s"
+                                % (r["node"], r["exit_code"]))
+        message = ("no node printed NODESTATS, only CPU and memory are "
+                   "reported (use NodeStats.hpp in the app for the rest)")
+        if any(limit is not None for limit in limits):
+            failures.append(message + ", the --min/--max limits can't be "
+                            "checked")
+        else:
+            warnings.append(message)
+        return failures, warnings
+    primaries = [r for r in results if r.get("role") == "primary"]
+    if len(primaries) != 1:
+        failures.append("%d primaries reported stats, expected 1"
+                        % len(primaries))
+    for r in results:
+        name = r["node"]
+        if r["exit_code"] is not None:
+            failures.append("%s exited early with %s" % (name, r["exit_code"]))
+        if not r["samples"]:
+            failures.append("%s printed no NODESTATS (run with an app that "
+                            "uses NodeStats.hpp)" % name)
+            continue
+        if r.get("role") == "renderer" and not r.get("frames"):
+            failures.append("%s received no state" % name)
+        if args.min_fps is not None and r.get("fps", 0) < args.min_fps:
+            failures.append("%s: %.1f fps < %g" % (name, r["fps"],
+                                                    args.min_fps))
+        if r.get("role") != "renderer":
+            continue
+        if args.max_dropped is not None and r["dropped"] > args.max_dropped:
+            failures.append("%s: %d dropped frames > %d"
+                            % (name, r["dropped"], args.max_dropped))
+        if args.max_latency_ms is not None and \
+                r.get("latency_ms", 0) > args.max_latency_ms:
+            failures.append("%s: %.2f ms latency > %g ms"
+                            % (name, r["latency_ms"], args.max_latency_ms))
+    return failures, warnings
+
+
+def print_table(results):
+    columns = [("node", "node", 10, "%s"), ("role", "role", 9, "%s"),
+               ("fps", "fps", 7, "%.1f"), ("frames", "frames", 7, "%d"),
+               ("dropped", "dropped", 7, "%d"),
+               ("bytes_per_s", "bytes/s", 11, "%.0f"),
+               ("latency_ms", "lat ms", 8, "%.2f"),
+               ("latency_max_ms", "max ms", 8, "%.2f"),
+               ("cpu_percent", "cpu %", 6, "%.1f"),
+               ("peak_memory_mb", "mem MB", 8, "%.1f")]
+    print("  ".join(title.rjust(width) for _, title, width, _ in columns))
+    for r in results:
+        row = []
+        for key, _, width, fmt in columns:
+            value = r.get(key)
+            row.append((fmt % value if value is not None else "-").rjust(width))
+        print("  ".join(row))
+
+
+def main():
+    args = parse_args()
+    if args.netns and not args.in_netns:
+        # Start over as root of a new user and network namespace
+        cmd = ["unshare", "--user", "--map-root-user", "--net", "--",
+               sys.executable, os.path.abspath(__file__), "--in-netns"]
+        os.execvp(cmd[0], cmd + sys.argv[1:])
+    if args.in_netns:
+        setup_netns(args)
+
+    app = os.path.abspath(args.app)
+    if not os.access(app, os.X_OK):
+        sys.exit("%s is not an executable" % args.app)
+    cwd = args.cwd or os.path.dirname(app)
+    if args.logs:
+        os.makedirs(args.logs, exist_ok=True)
+
+    env = dict(os.environ, AL_NODE_STATS="1")
+    xvfb = None
+    if args.headless:
+        xvfb, env["DISPLAY"] = start_xvfb()
+
+    cmd = [app] + args.app_args
+    nodes = []
+    try:
+        nodes.append(Node("primary", cmd, cwd, env, args.logs))
+        time.sleep(args.startup)
+        for i in range(args.renderers):
+            nodes.append(Node("renderer%d" % (i + 1), cmd, cwd, env,
+                              args.logs))
+            # Let each one claim its role before the next starts
+            time.sleep(0.5)
+
+        time.sleep(args.warmup)
+        start = time.monotonic()
+        for node in nodes:
+            node.cpu_start = cpu_seconds(node.process.pid)
+        while time.monotonic() - start < args.duration:
+            if not all(node.running() for node in nodes):
+                break
+            time.sleep(0.2)
+        end = time.monotonic()
+        for node in nodes:
+            node.cpu_end = cpu_seconds(node.process.pid)
+            node.memory = peak_memory_mb(node.process.pid)
+        # Before stopping them, so exit codes are from nodes that died
+        results = [summarize(node, (start, end)) for node in nodes]
+    finally:
+        for node in nodes:
+            node.stop()
+        if xvfb:
+            xvfb.terminate()
+            xvfb.wait()
+
+    setup = "%d renderers, %.0f s" % (args.renderers, end - start)
+    if args.netns:
+        setup += ", network namespace"
+        if args.delay_ms:
+            setup += ", delay %g ms" % args.delay_ms
+            if args.jitter_ms:
+                setup += " +- %g ms" % args.jitter_ms
+        if args.loss:
+            setup += ", loss %g%%" % args.loss
+    print("%s: %s" % (os.path.basename(app), setup))
+    print_table(results)
+
+    failures, warnings = check(results, args)
+    for warning in warnings:
+        print("WARNING: " + warning)
+    for failure in failures:
+        print("FAIL: " + failure)
+
+    if args.json:
+        with open(args.json, "w") as f:
+            json.dump({"app": app, "renderers": args.renderers,
+                       "duration": end - start, "netns": args.netns,
+                       "delay_ms": args.delay_ms,
+                       "jitter_ms": args.jitter_ms, "loss": args.loss,
+                       "nodes": results, "failures": failures,
+                       "warnings": warnings}, f, indent=2)
+    return 1 if failures else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
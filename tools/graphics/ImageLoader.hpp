@@ -0,0 +1,416 @@
+#pragma once
+#ifndef ImageLoader_H
+#define ImageLoader_H
+
+// Loads images into textures without stalling the graphics thread.
+//
+// Decoding a large image with al::Image and submitting it in one go can take
+// hundreds of milliseconds on the graphics thread. Here the work is split:
+//
+//  * ImageLoader decodes files on a small pool of worker threads into
+//    staging memory (plain RGBA8 pixels).
+//  * StreamedTexture uploads a decoded image from the graphics thread
+//    through a pixel buffer object, a slice of rows at a time, into a second
+//    texture. The texture being drawn doesn't change until the new one is
+//    complete, then the two are swapped.
+//  * TextureUploadBudget limits how many bytes, and how much time, all
+//    uploads may take per frame. It is shared by every StreamedTexture and
+//    reset once per frame, so switching several images at once spreads the
+//    uploads over a few frames instead of dropping one.
+//
+//   loader.load(filename)          // any thread
+//   budget.beginFrame();           // graphics thread, once per frame
+//   picture.update(budget);        // graphics thread, before drawing
+//   g.quad(picture.texture(), ...);
+//
+// The loader can also build the mip chain of an image on the worker, for
+// TextureResidency.hpp.
+
+#include "al/graphics/al_Graphics.hpp"
+#include "al/graphics/al_Image.hpp"
+#include "al/graphics/al_Texture.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// A decoded image in staging memory. Written by a worker, read by the
+// graphics thread once status is Ready.
+struct DecodedImage {
+  enum Status { Pending, Ready, Failed, Cancelled };
+
+  std::string filename;
+  std::vector<uint8_t> pixels; // RGBA8, rows from the top
+  unsigned int width{0};
+  unsigned int height{0};
+  std::atomic<int> status{Pending};
+  double decodeTime{0}; // Seconds spent decoding
+
+  // Levels 1 and up, each half the size of the previous one down to 1x1,
+  // if the loader was asked for them. Levels finer than firstLevel may
+  // have been freed (pixels for level 0).
+  bool wantMipmaps{false};
+  std::vector<std::vector<uint8_t>> mipmaps;
+  int firstLevel{0};
+
+  bool done() const {
+    return status.load(std::memory_order_acquire) != Pending;
+  }
+  size_t rowBytes() const { return size_t(width) * 4; }
+
+  int levels() const { return 1 + int(mipmaps.size()); }
+  unsigned int levelWidth(int level) const {
+    return std::max(1u, width >> level);
+  }
+  unsigned int levelHeight(int level) const {
+    return std::max(1u, height >> level);
+  }
+  size_t levelBytes(int level) const {
+    return size_t(levelWidth(level)) * levelHeight(level) * 4;
+  }
+  const uint8_t *levelPixels(int level) const {
+    return level == 0 ? pixels.data() : mipmaps[level - 1].data();
+  }
+  // Bytes of staging memory in use
+  size_t stagingBytes() const {
+    size_t bytes = 0;
+    for (int level = firstLevel; level < levels(); level++) {
+      bytes += levelBytes(level);
+    }
+    return bytes;
+  }
+  // Free the levels finer than a level. The coarsest is always kept.
+  void dropLevelsBelow(int level) {
+    level = std::min(level, levels() - 1);
+    for (int l = firstLevel; l < level; l++) {
+      std::vector<uint8_t> &data = l == 0 ? pixels : mipmaps[l - 1];
+      std::vector<uint8_t>().swap(data);
+    }
+    firstLevel = std::max(firstLevel, level);
+  }
+};
+
+class ImageLoader {
+public:
+  // 0 threads picks half the hardware threads, between 1 and 4
+  explicit ImageLoader(unsigned int threads = 0) {
+    if (threads == 0) {
+      threads = std::thread::hardware_concurrency() / 2;
+      threads = std::min(4u, std::max(1u, threads));
+    }
+    for (unsigned int i = 0; i < threads; i++) {
+      mWorkers.emplace_back([this]() { run(); });
+    }
+  }
+
+  ~ImageLoader() {
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      mStop = true;
+    }
+    mCondition.notify_all();
+    for (auto &worker : mWorkers) {
+      worker.join();
+    }
+  }
+
+  // Queue a file for decoding, and building its mip chain if asked. Files
+  // are decoded in the order requested.
+  std::shared_ptr<DecodedImage> load(const std::string &filename,
+                                     bool mipmaps = false) {
+    auto image = std::make_shared<DecodedImage>();
+    image->filename = filename;
+    image->wantMipmaps = mipmaps;
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      mQueue.push_back(image);
+    }
+    mCondition.notify_one();
+    return image;
+  }
+
+  // Images waiting for or being decoded
+  size_t pending() const {
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mQueue.size() + mBusy;
+  }
+
+private:
+  void run() {
+    while (true) {
+      std::shared_ptr<DecodedImage> image;
+      {
+        std::unique_lock<std::mutex> lock(mMutex);
+        mCondition.wait(lock, [this]() { return mStop || !mQueue.empty(); });
+        if (mStop) {
+          return;
+        }
+        image = mQueue.front();
+        mQueue.pop_front();
+        mBusy++;
+      }
+      // Nobody is waiting for it any more
+      if (image.use_count() == 1) {
+        image->status = DecodedImage::Cancelled;
+      } else {
+        decode(*image);
+      }
+      std::lock_guard<std::mutex> lock(mMutex);
+      mBusy--;
+    }
+  }
+
+  static void decode(DecodedImage &image) {
+    auto begin = std::chrono::steady_clock::now();
+    al::Image decoded(image.filename);
+    image.width = decoded.width();
+    image.height = decoded.height();
+    image.pixels = std::move(decoded.array());
+    image.decodeTime = std::chrono::duration<double>(
+                           std::chrono::steady_clock::now() - begin)
+                           .count();
+    bool ok = image.width > 0 && image.height > 0 &&
+              image.pixels.size() >= image.rowBytes() * image.height;
+    if (ok && image.wantMipmaps) {
+      buildMipmaps(image);
+    }
+    image.status.store(ok ? DecodedImage::Ready : DecodedImage::Failed,
+                       std::memory_order_release);
+  }
+
+  // Box filter each level from the previous one. An odd last row or column
+  // is folded into its neighbour: the last texel of the level averages three
+  // rows or columns instead of two, so no source texel is dropped.
+  static void buildMipmaps(DecodedImage &image) {
+    unsigned int width = image.width;
+    unsigned int height = image.height;
+    const uint8_t *src = image.pixels.data();
+    while (width > 1 || height > 1) {
+      unsigned int w = std::max(1u, width / 2);
+      unsigned int h = std::max(1u, height / 2);
+      std::vector<uint8_t> level(size_t(w) * h * 4);
+      for (unsigned int y = 0; y < h; y++) {
+        unsigned int y0 = 2 * y;
+        unsigned int y1 = y + 1 < h ? y0 + 2 : height;
+        uint8_t *dst = level.data() + size_t(y) * w * 4;
+        for (unsigned int x = 0; x < w; x++) {
+          unsigned int x0 = 2 * x;
+          unsigned int x1 = x + 1 < w ? x0 + 2 : width;
+          unsigned int count = (x1 - x0) * (y1 - y0);
+          unsigned int sum[4] = {count / 2, count / 2, count / 2, count / 2};
+          for (unsigned int sy = y0; sy < y1; sy++) {
+            const uint8_t *row = src + (size_t(sy) * width + x0) * 4;
+            for (unsigned int i = 0; i < (x1 - x0) * 4; i++) {
+              sum[i % 4] += row[i];
+            }
+          }
+          for (int c = 0; c < 4; c++) {
+            dst[x * 4 + c] = uint8_t(sum[c] / count);
+          }
+        }
+      }
+      image.mipmaps.push_back(std::move(level));
+      src = image.mipmaps.back().data();
+      width = w;
+      height = h;
+    }
+  }
+
+  mutable std::mutex mMutex;
+  std::condition_variable mCondition;
+  std::deque<std::shared_ptr<DecodedImage>> mQueue;
+  size_t mBusy{0};
+  bool mStop{false};
+  std::vector<std::thread> mWorkers;
+};
+
+// Bytes and time all texture uploads may use in one frame. A slice is always
+// allowed at the start of a frame, so large images still make progress with a
+// small budget.
+class TextureUploadBudget {
+public:
+  size_t bytesPerFrame{8 << 20};
+  double secondsPerFrame{0.002};
+
+  void beginFrame() {
+    mBytes = 0;
+    mSeconds = 0;
+  }
+
+  // Rows of rowBytes that may be uploaded now, 0 if the budget is spent
+  size_t rows(size_t rowBytes) const {
+    if (mBytes == 0 && mSeconds == 0) {
+      return std::max(size_t(1), bytesPerFrame / rowBytes);
+    }
+    if (mBytes >= bytesPerFrame || mSeconds >= secondsPerFrame) {
+      return 0;
+    }
+    return (bytesPerFrame - mBytes) / rowBytes;
+  }
+
+  void spend(size_t bytes, double seconds) {
+    mBytes += bytes;
+    mSeconds += seconds;
+    mTotalBytes += bytes;
+  }
+
+  size_t bytesThisFrame() const { return mBytes; }
+  size_t totalBytes() const { return mTotalBytes; }
+
+private:
+  size_t mBytes{0};
+  double mSeconds{0};
+  size_t mTotalBytes{0};
+};
+
+// Copies pixels into texture levels through a pixel buffer object, a slice
+// of rows at a time within a TextureUploadBudget.
+class PixelUploader {
+public:
+  ~PixelUploader() {
+    if (mPbo) {
+      glDeleteBuffers(1, &mPbo);
+    }
+  }
+
+  // Start a new set of uploads of up to this many bytes. The previous
+  // storage is orphaned, as the GPU may still be copying from it.
+  void begin(size_t bytes) {
+    if (!mPbo) {
+      glGenBuffers(1, &mPbo);
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, mPbo);
+    glBufferData(GL_PIXEL_UNPACK_BUFFER, GLsizeiptr(bytes), nullptr,
+                 GL_STREAM_DRAW);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+  }
+
+  // Upload the rows of a texture level from row on, staged at offset in
+  // the buffer, until they are done or the budget is spent. Returns the
+  // next row to upload.
+  size_t upload(GLuint texture, int level, unsigned int width,
+                unsigned int height, const uint8_t *pixels, size_t offset,
+                size_t row, TextureUploadBudget &budget) {
+    size_t rowBytes = size_t(width) * 4;
+    size_t rows = std::min(budget.rows(rowBytes), size_t(height) - row);
+    while (rows > 0) {
+      auto start = std::chrono::steady_clock::now();
+      size_t source = row * rowBytes;
+      size_t bytes = rows * rowBytes;
+      glBindBuffer(GL_PIXEL_UNPACK_BUFFER, mPbo);
+      // Each slice goes to its own range of a freshly allocated buffer, so
+      // nothing the GPU still reads is overwritten
+      void *dst = glMapBufferRange(
+          GL_PIXEL_UNPACK_BUFFER, GLintptr(offset + source),
+          GLsizeiptr(bytes),
+          GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT |
+              GL_MAP_UNSYNCHRONIZED_BIT);
+      if (dst) {
+        memcpy(dst, pixels + source, bytes);
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+      } else {
+        glBufferSubData(GL_PIXEL_UNPACK_BUFFER, GLintptr(offset + source),
+                        GLsizeiptr(bytes), pixels + source);
+      }
+      glBindTexture(GL_TEXTURE_2D, texture);
+      glTexSubImage2D(GL_TEXTURE_2D, level, 0, GLint(row), GLsizei(width),
+                      GLsizei(rows), GL_RGBA, GL_UNSIGNED_BYTE,
+                      reinterpret_cast<const void *>(offset + source));
+      glBindTexture(GL_TEXTURE_2D, 0);
+      glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+      budget.spend(bytes, std::chrono::duration<double>(
+                              std::chrono::steady_clock::now() - start)
+                              .count());
+      row += rows;
+      rows = std::min(budget.rows(rowBytes), size_t(height) - row);
+    }
+    return row;
+  }
+
+private:
+  GLuint mPbo{0};
+};
+
+// Texture whose image is replaced in the background. Only update() and
+// texture() touch GL, so they must be called from the graphics thread.
+class StreamedTexture {
+public:
+  // Start loading a file. The current texture stays until it is ready. A
+  // previous request that hasn't finished uploading is abandoned.
+  void load(ImageLoader &loader, const std::string &filename) {
+    mPending = loader.load(filename);
+    mRow = 0;
+  }
+
+  // Upload as much of a pending image as the budget allows. Returns true
+  // when a new image became current.
+  bool update(TextureUploadBudget &budget) {
+    if (!mPending || !mPending->done()) {
+      return false;
+    }
+    DecodedImage &image = *mPending;
+    if (image.status != DecodedImage::Ready) {
+      std::cout << "failed to load image " << image.filename << std::endl;
+      mPending.reset();
+      return false;
+    }
+    if (mRow == 0) {
+      if (budget.rows(image.rowBytes()) == 0) {
+        return false;
+      }
+      begin(image);
+    }
+
+    mRow = mUploader.upload(back().id(), 0, image.width, image.height,
+                            image.pixels.data(), 0, mRow, budget);
+    if (mRow < image.height) {
+      return false;
+    }
+    mCurrent = 1 - mCurrent;
+    mAspectRatio = image.width / float(image.height);
+    mFilename = image.filename;
+    mPending.reset();
+    mRow = 0;
+    return true;
+  }
+
+  // The complete texture to draw. Check ready() first.
+  al::Texture &texture() { return mTextures[mCurrent]; }
+  bool ready() const { return !mFilename.empty(); }
+  bool loading() const { return mPending != nullptr; }
+  float aspectRatio() const { return mAspectRatio; }
+  // File of the current texture
+  const std::string &filename() const { return mFilename; }
+
+private:
+  al::Texture &back() { return mTextures[1 - mCurrent]; }
+
+  void begin(const DecodedImage &image) {
+    al::Texture &tex = back();
+    if (tex.width() != image.width || tex.height() != image.height) {
+      tex.create2D(image.width, image.height);
+      tex.filter(al::Texture::LINEAR);
+    }
+    mUploader.begin(image.rowBytes() * image.height);
+  }
+
+  al::Texture mTextures[2];
+  int mCurrent{0};
+  float mAspectRatio{1.0f};
+  std::string mFilename;
+
+  std::shared_ptr<DecodedImage> mPending;
+  size_t mRow{0}; // Rows of the pending image uploaded so far
+  PixelUploader mUploader;
+};
+
+#endif
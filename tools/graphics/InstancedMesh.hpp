@@ -0,0 +1,234 @@
+#pragma once
+#ifndef InstancedMesh_H
+#define InstancedMesh_H
+
+// Draws many copies of one mesh with a single instanced draw call.
+//
+// Instead of pushMatrix/translate/scale/draw/popMatrix per object, each
+// instance is described by a position, a uniform scale and a color. The
+// instances are packed into one buffer that is uploaded once per draw, and
+// the vertex shader places each copy. Typical use:
+//
+//   instances.init(mesh);          // once
+//   instances.clear();             // every frame
+//   instances.add(pos, scale, color);
+//   instances.draw(g);             // one draw call
+//
+// Polygon mode (e.g. g.polygonLine()) and the current model view matrix
+// apply to all instances. With lighting enabled a single directional light is
+// applied using the mesh normals.
+
+#include "al/graphics/al_Graphics.hpp"
+#include "al/graphics/al_Mesh.hpp"
+#include "al/graphics/al_Shader.hpp"
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+class InstancedMesh {
+public:
+  struct Instance {
+    al::Vec3f pos;
+    float scale;
+    al::Color color;
+  };
+
+  InstancedMesh() = default;
+  ~InstancedMesh() { release(); }
+  // Owns GL objects
+  InstancedMesh(const InstancedMesh &) = delete;
+  InstancedMesh &operator=(const InstancedMesh &) = delete;
+
+  // Set the geometry. GPU objects are created on the next draw().
+  void init(const al::Mesh &mesh) {
+    mPositions = mesh.vertices();
+    mNormals = mesh.normals();
+    mIndices = mesh.indices();
+    mPrimitive = mesh.primitive();
+    mGeometryDirty = true;
+  }
+
+  void clear() { mInstances.clear(); }
+  void reserve(size_t n) { mInstances.reserve(n); }
+
+  void add(const al::Vec3f &pos, float scale = 1,
+           const al::Color &color = al::Color(1)) {
+    mInstances.push_back({pos, scale, color});
+  }
+
+  size_t size() const { return mInstances.size(); }
+
+  // Light direction in model space (toward the light)
+  void lighting(bool on, const al::Vec3f &lightDir = al::Vec3f(1, 1, 1)) {
+    mLighting = on;
+    mLightDir = lightDir.normalized();
+  }
+
+  void draw(al::Graphics &g) {
+    if (mInstances.empty() || mPositions.empty()) {
+      return;
+    }
+    if (!mShaderCompiled) {
+      mShaderCompiled = mShader.compile(vertexCode(), fragmentCode());
+    }
+    if (mGeometryDirty) {
+      uploadGeometry();
+    }
+
+    // Orphan the instance buffer so the upload doesn't wait for the previous
+    // draw
+    glBindBuffer(GL_ARRAY_BUFFER, mInstanceBuffer);
+    size_t bytes = mInstances.size() * sizeof(Instance);
+    if (bytes > mInstanceCapacity) {
+      mInstanceCapacity = bytes * 2;
+    }
+    glBufferData(GL_ARRAY_BUFFER, mInstanceCapacity, nullptr, GL_STREAM_DRAW);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, bytes, mInstances.data());
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    g.shader(mShader);
+    g.shader().uniform("lighting", mLighting ? 1.0f : 0.0f);
+    g.shader().uniform("lightDir", mLightDir);
+    // Set the matrix uniforms for the current transform
+    g.update();
+
+    glBindVertexArray(mVao);
+    if (mIndices.empty()) {
+      glDrawArraysInstanced(mPrimitive, 0, mPositions.size(),
+                            mInstances.size());
+    } else {
+      glDrawElementsInstanced(mPrimitive, mIndices.size(), GL_UNSIGNED_INT,
+                              nullptr, mInstances.size());
+    }
+    glBindVertexArray(0);
+  }
+
+private:
+  // Attribute locations. 0 and 3 match al::Graphics (position and normal).
+  static const int kPositionLoc = 0;
+  static const int kNormalLoc = 3;
+  static const int kOffsetScaleLoc = 5;
+  static const int kColorLoc = 6;
+
+  void release() {
+    if (mVao == 0) {
+      return;
+    }
+    glDeleteBuffers(1, &mPositionBuffer);
+    glDeleteBuffers(1, &mNormalBuffer);
+    glDeleteBuffers(1, &mIndexBuffer);
+    glDeleteBuffers(1, &mInstanceBuffer);
+    glDeleteVertexArrays(1, &mVao);
+    mVao = 0;
+  }
+
+  void uploadGeometry() {
+    if (mVao == 0) {
+      glGenVertexArrays(1, &mVao);
+      glGenBuffers(1, &mPositionBuffer);
+      glGenBuffers(1, &mNormalBuffer);
+      glGenBuffers(1, &mIndexBuffer);
+      glGenBuffers(1, &mInstanceBuffer);
+    }
+    glBindVertexArray(mVao);
+
+    glBindBuffer(GL_ARRAY_BUFFER, mPositionBuffer);
+    glBufferData(GL_ARRAY_BUFFER, mPositions.size() * sizeof(al::Vec3f),
+                 mPositions.data(), GL_STATIC_DRAW);
+    glEnableVertexAttribArray(kPositionLoc);
+    glVertexAttribPointer(kPositionLoc, 3, GL_FLOAT, GL_FALSE, 0, nullptr);
+
+    // Meshes without normals get an array of (0, 0, 1). A constant
+    // attribute value would be context state and leak into other draws.
+    if (mNormals.size() != mPositions.size()) {
+      mNormals.assign(mPositions.size(), al::Vec3f(0, 0, 1));
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, mNormalBuffer);
+    glBufferData(GL_ARRAY_BUFFER, mNormals.size() * sizeof(al::Vec3f),
+                 mNormals.data(), GL_STATIC_DRAW);
+    glEnableVertexAttribArray(kNormalLoc);
+    glVertexAttribPointer(kNormalLoc, 3, GL_FLOAT, GL_FALSE, 0, nullptr);
+
+    // One Instance per copy: vec4 (position, scale) followed by vec4 color
+    glBindBuffer(GL_ARRAY_BUFFER, mInstanceBuffer);
+    glEnableVertexAttribArray(kOffsetScaleLoc);
+    glVertexAttribPointer(kOffsetScaleLoc, 4, GL_FLOAT, GL_FALSE,
+                          sizeof(Instance), (void *)offsetof(Instance, pos));
+    glVertexAttribDivisor(kOffsetScaleLoc, 1);
+    glEnableVertexAttribArray(kColorLoc);
+    glVertexAttribPointer(kColorLoc, 4, GL_FLOAT, GL_FALSE, sizeof(Instance),
+                          (void *)offsetof(Instance, color));
+    glVertexAttribDivisor(kColorLoc, 1);
+
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    // The element buffer binding is VAO state, bind it while the VAO is bound
+    if (!mIndices.empty()) {
+      glBindVertexArray(mVao);
+      glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mIndexBuffer);
+      glBufferData(GL_ELEMENT_ARRAY_BUFFER,
+                   mIndices.size() * sizeof(unsigned int), mIndices.data(),
+                   GL_STATIC_DRAW);
+      glBindVertexArray(0);
+    }
+    mGeometryDirty = false;
+  }
+
+  static std::string vertexCode() {
+    return R"(
+#version 330
+uniform mat4 al_ModelViewMatrix;
+uniform mat4 al_ProjectionMatrix;
+uniform float lighting;
+uniform vec3 lightDir;
+
+layout (location = 0) in vec3 position;
+layout (location = 3) in vec3 normal;
+layout (location = 5) in vec4 offsetScale;
+layout (location = 6) in vec4 instanceColor;
+
+out vec4 color;
+
+void main() {
+  vec3 p = position * offsetScale.w + offsetScale.xyz;
+  gl_Position = al_ProjectionMatrix * al_ModelViewMatrix * vec4(p, 1.);
+  float shade = 1.;
+  if (lighting > 0.5) {
+    shade = 0.3 + 0.7 * max(dot(normalize(normal), lightDir), 0.);
+  }
+  color = vec4(instanceColor.rgb * shade, instanceColor.a);
+}
+)";
+  }
+
+  static std::string fragmentCode() {
+    return R"(
+#version 330
+in vec4 color;
+layout (location = 0) out vec4 fragColor;
+void main() { fragColor = color; }
+)";
+  }
+
+  std::vector<al::Vec3f> mPositions;
+  std::vector<al::Vec3f> mNormals;
+  std::vector<unsigned int> mIndices;
+  unsigned int mPrimitive{GL_TRIANGLES};
+  bool mGeometryDirty{false};
+
+  std::vector<Instance> mInstances;
+  size_t mInstanceCapacity{0};
+
+  bool mLighting{false};
+  al::Vec3f mLightDir{0, 0, 1};
+
+  GLuint mVao{0};
+  GLuint mPositionBuffer{0}, mNormalBuffer{0}, mIndexBuffer{0},
+      mInstanceBuffer{0};
+  al::ShaderProgram mShader;
+  bool mShaderCompiled{false};
+};
+
+#endif
@@ -0,0 +1,164 @@
+#pragma once
+#ifndef LibavVideoSource_H
+#define LibavVideoSource_H
+
+// VideoSource (VideoStream.hpp) decoding with FFmpeg's libraries.
+//
+// al_ext's VideoDecoder paces frames against its own clock and returns them
+// without their time stamps, so frames can't be decoded ahead and then
+// picked by time. This reads the stream directly: frames come out in
+// presentation order with their PTS (relative to the stream start) and are
+// converted to RGBA with swscale. Decoding uses the codec's own threads.
+// Audio is ignored.
+
+#include "VideoStream.hpp"
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libswscale/swscale.h>
+}
+
+#include <algorithm>
+#include <iostream>
+
+class LibavVideoSource : public VideoSource {
+public:
+  ~LibavVideoSource() { close(); }
+
+  bool open(const std::string &filename) override {
+    close();
+    if (avformat_open_input(&mFormat, filename.c_str(), nullptr, nullptr) < 0 ||
+        avformat_find_stream_info(mFormat, nullptr) < 0) {
+      std::cerr << "Can't read video file " << filename << std::endl;
+      close();
+      return false;
+    }
+    mStreamIndex =
+        av_find_best_stream(mFormat, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+    if (mStreamIndex < 0) {
+      std::cerr << "No video stream in " << filename << std::endl;
+      close();
+      return false;
+    }
+    AVStream *stream = mFormat->streams[mStreamIndex];
+    const AVCodec *codec = avcodec_find_decoder(stream->codecpar->codec_id);
+    mCodec = avcodec_alloc_context3(codec);
+    if (!codec || !mCodec ||
+        avcodec_parameters_to_context(mCodec, stream->codecpar) < 0) {
+      std::cerr << "No decoder for " << filename << std::endl;
+      close();
+      return false;
+    }
+    mCodec->thread_count = 0; // As many as there are cores
+    if (avcodec_open2(mCodec, codec, nullptr) < 0) {
+      std::cerr << "Can't open decoder for " << filename << std::endl;
+      close();
+      return false;
+    }
+
+    mWidth = unsigned(mCodec->width);
+    mHeight = unsigned(mCodec->height);
+    mTimeBase = av_q2d(stream->time_base);
+    mStartTime = stream->start_time != AV_NOPTS_VALUE ? stream->start_time : 0;
+    AVRational rate = av_guess_frame_rate(mFormat, stream, nullptr);
+    mFrameDuration = 1.0 / 30.0;
+    if (rate.num > 0 && rate.den > 0) {
+      mFrameDuration = 1.0 / av_q2d(rate);
+    }
+    mDuration = mFormat->duration != AV_NOPTS_VALUE
+                    ? mFormat->duration / double(AV_TIME_BASE)
+                    : 0.0;
+    mScale = sws_getContext(mCodec->width, mCodec->height, mCodec->pix_fmt,
+                            mCodec->width, mCodec->height, AV_PIX_FMT_RGBA,
+                            SWS_BILINEAR, nullptr, nullptr, nullptr);
+    mFrame = av_frame_alloc();
+    mPacket = av_packet_alloc();
+    if (!mScale || !mFrame || !mPacket) {
+      close();
+      return false;
+    }
+    mFlushed = false;
+    mLastPts = -mFrameDuration;
+    return true;
+  }
+
+  unsigned int width() const override { return mWidth; }
+  unsigned int height() const override { return mHeight; }
+  double frameDuration() const override { return mFrameDuration; }
+  double duration() const override { return mDuration; }
+
+  bool seek(double seconds) override {
+    int64_t timestamp =
+        mStartTime + int64_t(std::max(0.0, seconds) / mTimeBase);
+    if (av_seek_frame(mFormat, mStreamIndex, timestamp, AVSEEK_FLAG_BACKWARD) <
+        0) {
+      return false;
+    }
+    avcodec_flush_buffers(mCodec);
+    mFlushed = false;
+    mLastPts = seconds - mFrameDuration;
+    return true;
+  }
+
+  bool decode(VideoFrame &frame) override {
+    while (true) {
+      int result = avcodec_receive_frame(mCodec, mFrame);
+      if (result == 0) {
+        int64_t pts = mFrame->best_effort_timestamp;
+        // Frames without a time stamp follow the previous one
+        frame.pts = pts != AV_NOPTS_VALUE ? (pts - mStartTime) * mTimeBase
+                                          : mLastPts + mFrameDuration;
+        mLastPts = frame.pts;
+        uint8_t *pixels[1] = {frame.pixels.data()};
+        int lineSize[1] = {int(mWidth * 4)};
+        sws_scale(mScale, mFrame->data, mFrame->linesize, 0, int(mHeight),
+                  pixels, lineSize);
+        av_frame_unref(mFrame);
+        return true;
+      }
+      if (result != AVERROR(EAGAIN) || mFlushed) {
+        return false; // End of stream or error
+      }
+      // The decoder needs more input
+      if (av_read_frame(mFormat, mPacket) < 0) {
+        // Drain the frames the decoder still holds
+        avcodec_send_packet(mCodec, nullptr);
+        mFlushed = true;
+        continue;
+      }
+      if (mPacket->stream_index == mStreamIndex) {
+        avcodec_send_packet(mCodec, mPacket);
+      }
+      av_packet_unref(mPacket);
+    }
+  }
+
+private:
+  void close() {
+    sws_freeContext(mScale);
+    mScale = nullptr;
+    av_packet_free(&mPacket);
+    av_frame_free(&mFrame);
+    avcodec_free_context(&mCodec);
+    avformat_close_input(&mFormat);
+  }
+
+  AVFormatContext *mFormat{nullptr};
+  AVCodecContext *mCodec{nullptr};
+  SwsContext *mScale{nullptr};
+  AVFrame *mFrame{nullptr};
+  AVPacket *mPacket{nullptr};
+  int mStreamIndex{-1};
+  bool mFlushed{false}; // The end of the file was sent to the decoder
+
+  unsigned int mWidth{0};
+  unsigned int mHeight{0};
+  double mTimeBase{0};
+  int64_t mStartTime{0};
+  double mFrameDuration{1.0 / 30.0};
+  double mDuration{0};
+  double mLastPts{0};
+};
+
+#endif
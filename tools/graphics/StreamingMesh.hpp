@@ -0,0 +1,200 @@
+#pragma once
+#ifndef StreamingMesh_H
+#define StreamingMesh_H
+
+// Mesh whose vertex positions are read from memory owned by someone else,
+// e.g. an array in the distributed state.
+//
+// Drawing a Mesh whose vertices change every frame means copying them into
+// mesh.vertices() and then uploading the whole mesh, indices included, on
+// every draw. StreamingMesh uploads the indices once. Positions are read
+// straight from a span set with positions() and copied only to the GPU,
+// once per update no matter how many times the mesh is drawn (stereo,
+// omni).
+//
+// Where buffer storage is available (GL 4.4), positions go into a
+// persistently mapped buffer split into three regions used in turn, with
+// a fence per region so the CPU never writes one the GPU is still reading.
+// Elsewhere each region is updated with glBufferSubData.
+//
+// There is no shader of its own. draw() uses the current Graphics shader
+// (g.color(), g.polygonLine(), omni rendering all apply), with the
+// positions at attribute location 0.
+
+#include "al/graphics/al_Graphics.hpp"
+#include "al/graphics/al_Mesh.hpp"
+
+#include <cstring>
+#include <vector>
+
+class StreamingMesh {
+public:
+  StreamingMesh() = default;
+  ~StreamingMesh() { release(); }
+  // Owns GL objects
+  StreamingMesh(const StreamingMesh &) = delete;
+  StreamingMesh &operator=(const StreamingMesh &) = delete;
+
+  void primitive(unsigned int p) { mPrimitive = p; }
+
+  // Static indices, uploaded on the next draw()
+  void indices(const std::vector<unsigned int> &indices) {
+    mIndices = indices;
+    mIndicesDirty = true;
+  }
+
+  // Positions for the following draws. The data is not copied here, so it
+  // must stay valid until the next draw().
+  void positions(const al::Vec3f *data, size_t count) {
+    mSpan = data;
+    mCount = count;
+    mSpanDirty = true;
+  }
+
+  // True if positions go through a persistently mapped buffer
+  bool persistent() const { return mMapped != nullptr; }
+
+  void draw(al::Graphics &g) {
+    if (!mSpan || mCount == 0) {
+      return;
+    }
+    if (mVao == 0 || mCount > mCapacity) {
+      allocate(mCount);
+    }
+    if (mIndicesDirty) {
+      uploadIndices();
+    }
+    if (mSpanDirty) {
+      uploadPositions();
+      mSpanDirty = false;
+    }
+
+    // Set the shader and matrices of the current mode
+    g.update();
+    glBindVertexArray(mVao);
+    GLint baseVertex = GLint(mRegion * mCapacity);
+    if (mIndices.empty()) {
+      glDrawArrays(mPrimitive, baseVertex, GLsizei(mCount));
+    } else {
+      glDrawElementsBaseVertex(mPrimitive, GLsizei(mIndices.size()),
+                               GL_UNSIGNED_INT, nullptr, baseVertex);
+    }
+    glBindVertexArray(0);
+#ifdef GL_VERSION_4_4
+    if (mMapped) {
+      if (mFences[mRegion]) {
+        glDeleteSync(mFences[mRegion]);
+      }
+      mFences[mRegion] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
+#endif
+  }
+
+private:
+  static const int kRegions = 3;
+
+  void allocate(size_t count) {
+    release();
+    mCapacity = count;
+    glGenVertexArrays(1, &mVao);
+    glGenBuffers(1, &mPositionBuffer);
+    glGenBuffers(1, &mIndexBuffer);
+    glBindVertexArray(mVao);
+    glBindBuffer(GL_ARRAY_BUFFER, mPositionBuffer);
+    GLsizeiptr bytes = kRegions * mCapacity * sizeof(al::Vec3f);
+#ifdef GL_VERSION_4_4
+    if (GLAD_GL_VERSION_4_4) {
+      GLbitfield flags =
+          GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+      glBufferStorage(GL_ARRAY_BUFFER, bytes, nullptr, flags);
+      mMapped = static_cast<al::Vec3f *>(
+          glMapBufferRange(GL_ARRAY_BUFFER, 0, bytes, flags));
+    }
+#endif
+    if (!mMapped) {
+      glBufferData(GL_ARRAY_BUFFER, bytes, nullptr, GL_STREAM_DRAW);
+    }
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, nullptr);
+    // The element buffer binding is VAO state
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mIndexBuffer);
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    mIndicesDirty = true;
+  }
+
+  void release() {
+    if (mVao == 0) {
+      return;
+    }
+#ifdef GL_VERSION_4_4
+    for (auto &fence : mFences) {
+      if (fence) {
+        glDeleteSync(fence);
+        fence = 0;
+      }
+    }
+#endif
+    if (mMapped) {
+      glBindBuffer(GL_ARRAY_BUFFER, mPositionBuffer);
+      glUnmapBuffer(GL_ARRAY_BUFFER);
+      glBindBuffer(GL_ARRAY_BUFFER, 0);
+      mMapped = nullptr;
+    }
+    glDeleteBuffers(1, &mPositionBuffer);
+    glDeleteBuffers(1, &mIndexBuffer);
+    glDeleteVertexArrays(1, &mVao);
+    mVao = 0;
+  }
+
+  void uploadIndices() {
+    glBindVertexArray(mVao);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER,
+                 mIndices.size() * sizeof(unsigned int), mIndices.data(),
+                 GL_STATIC_DRAW);
+    glBindVertexArray(0);
+    mIndicesDirty = false;
+  }
+
+  void uploadPositions() {
+    mRegion = (mRegion + 1) % kRegions;
+    size_t bytes = mCount * sizeof(al::Vec3f);
+#ifdef GL_VERSION_4_4
+    if (mMapped) {
+      // Wait until the GPU is done with the draws from three updates ago
+      if (mFences[mRegion]) {
+        glClientWaitSync(mFences[mRegion], GL_SYNC_FLUSH_COMMANDS_BIT,
+                         1000000000);
+        glDeleteSync(mFences[mRegion]);
+        mFences[mRegion] = 0;
+      }
+      memcpy(mMapped + mRegion * mCapacity, mSpan, bytes);
+      return;
+    }
+#endif
+    glBindBuffer(GL_ARRAY_BUFFER, mPositionBuffer);
+    glBufferSubData(GL_ARRAY_BUFFER, mRegion * mCapacity * sizeof(al::Vec3f),
+                    bytes, mSpan);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+  }
+
+  unsigned int mPrimitive{GL_TRIANGLES};
+  std::vector<unsigned int> mIndices;
+  bool mIndicesDirty{false};
+
+  const al::Vec3f *mSpan{nullptr};
+  size_t mCount{0};
+  bool mSpanDirty{false};
+
+  size_t mCapacity{0}; // Vertices per region
+  int mRegion{0};
+  al::Vec3f *mMapped{nullptr};
+#ifdef GL_VERSION_4_4
+  GLsync mFences[kRegions]{};
+#endif
+
+  GLuint mVao{0};
+  GLuint mPositionBuffer{0}, mIndexBuffer{0};
+};
+
+#endif
@@ -0,0 +1,431 @@
+#pragma once
+#ifndef TextureResidency_H
+#define TextureResidency_H
+
+// Keeps the textures of many panels within a GPU memory cap.
+//
+// A ManagedTexture is told every frame how large it is drawn, in pixels
+// along its longer side. Its image is decoded and its mip chain built on
+// the ImageLoader's threads, and only the mip levels that size needs are
+// on the GPU: a panel drawn 300 pixels wide from a 4096 pixel image gets
+// levels 3 (512 pixels) and coarser, 1/64 of the full chain. Panels that
+// aren't drawn keep a small thumbnail level.
+//
+// Once per frame TextureResidency::update():
+//
+//  * picks the finest level each texture needs,
+//  * if they don't fit gpuBudget, evicts textures that aren't drawn and
+//    then lowers the level of the textures with the most texels per drawn
+//    pixel, one level at a time,
+//  * streams levels in, coarsest first, through a PBO within the frame's
+//    TextureUploadBudget. A texture changes only when its new set of
+//    levels is complete, as with StreamedTexture, so for a moment both
+//    sets are on the GPU.
+//
+// Decoded chains stay in staging memory to change levels without decoding
+// again. Above stagingBudget the finer levels of the textures that need
+// them least are freed, and decoded again if they are needed later, so
+// stagingBudget should be well above gpuBudget.
+//
+//   residency.update(budget);      // graphics thread, once per frame
+//   picture.load(residency, file);
+//   picture.drawnSize(pixels);     // every frame
+//   if (picture.texture()) g.quad(*picture.texture(), ...);
+
+#include "al/graphics/al_Graphics.hpp"
+#include "al/graphics/al_Texture.hpp"
+
+#include "ImageLoader.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+class TextureResidency;
+
+class ManagedTexture {
+public:
+  ~ManagedTexture();
+
+  // Start loading a file. The current texture stays until the new one has
+  // its first levels on the GPU.
+  void load(TextureResidency &residency, const std::string &filename);
+
+  // Size the texture is drawn at this frame, in pixels along its longer
+  // side. 0 if it isn't drawn.
+  void drawnSize(float pixels) { mDrawnSize = pixels; }
+
+  // The texture to draw, nullptr if nothing is resident
+  al::Texture *texture() {
+    return mResident >= 0 ? &mTextures[mCurrent] : nullptr;
+  }
+  float aspectRatio() const { return mAspectRatio; }
+  // Finest mip level of the image on the GPU, -1 if none
+  int residentLevel() const { return mResident; }
+  size_t gpuBytes() const { return mBytes[0] + mBytes[1]; }
+
+private:
+  friend class TextureResidency;
+
+  al::Texture &back() { return mTextures[1 - mCurrent]; }
+
+  TextureResidency *mResidency{nullptr};
+  std::string mFilename;
+  std::shared_ptr<DecodedImage> mPending; // Being decoded
+  std::shared_ptr<DecodedImage> mImage;   // Mip chain in staging memory
+  float mDrawnSize{0};
+  float mAspectRatio{1.0f};
+  int mTarget{-1}; // Finest level wanted on the GPU, -1 for none
+
+  al::Texture mTextures[2];
+  size_t mBytes[2]{0, 0};
+  int mCurrent{0};
+  int mResident{-1};
+  std::string mResidentFile;
+
+  // Levels being uploaded into the back texture
+  std::shared_ptr<DecodedImage> mUploadImage;
+  int mUploadBase{-1};
+  int mUploadLevel{-1};
+  size_t mUploadRow{0};
+  PixelUploader mUploader;
+};
+
+class TextureResidency {
+public:
+  struct Stats {
+    uint64_t decodes{0};   // Files decoded, including decoding again
+    uint64_t evictions{0}; // Textures removed from the GPU
+    uint64_t swaps{0};     // Level sets completed
+  };
+
+  size_t gpuBudget{size_t(512) << 20};
+  size_t stagingBudget{size_t(2048) << 20};
+  // Textures that aren't drawn keep the first level at most this large
+  unsigned int thumbnailSize{64};
+
+  explicit TextureResidency(ImageLoader &loader) : mLoader(loader) {}
+
+  // Graphics thread, once per frame after the drawn sizes are set
+  void update(TextureUploadBudget &budget) {
+    for (ManagedTexture *t : mTextures) {
+      receive(*t);
+    }
+    for (ManagedTexture *t : mTextures) {
+      t->mTarget = t->mImage ? wantedLevel(*t) : -1;
+    }
+    fitGpuBudget();
+    fitStagingBudget();
+
+    // Largest first, so the budget goes where it is most visible
+    std::vector<ManagedTexture *> order = mTextures;
+    std::stable_sort(order.begin(), order.end(),
+                     [](const ManagedTexture *a, const ManagedTexture *b) {
+                       return a->mDrawnSize > b->mDrawnSize;
+                     });
+    for (ManagedTexture *t : order) {
+      stream(*t, budget);
+    }
+  }
+
+  size_t gpuBytes() const {
+    size_t bytes = 0;
+    for (const ManagedTexture *t : mTextures) {
+      bytes += t->gpuBytes();
+    }
+    return bytes;
+  }
+
+  size_t stagingBytes() const {
+    size_t bytes = 0;
+    for (const ManagedTexture *t : mTextures) {
+      if (t->mImage) {
+        bytes += t->mImage->stagingBytes();
+      }
+    }
+    return bytes;
+  }
+
+  const Stats &stats() const { return mStats; }
+
+private:
+  friend class ManagedTexture;
+
+  void add(ManagedTexture *t) { mTextures.push_back(t); }
+
+  void remove(ManagedTexture *t) {
+    mTextures.erase(std::remove(mTextures.begin(), mTextures.end(), t),
+                    mTextures.end());
+  }
+
+  void decode(ManagedTexture &t) {
+    t.mPending = mLoader.load(t.mFilename, true);
+    mStats.decodes++;
+  }
+
+  void receive(ManagedTexture &t) {
+    if (!t.mPending || !t.mPending->done()) {
+      return;
+    }
+    if (t.mPending->status == DecodedImage::Ready) {
+      t.mImage = t.mPending;
+    } else if (t.mPending->status == DecodedImage::Failed) {
+      std::cout << "failed to load image " << t.mPending->filename
+                << std::endl;
+    }
+    t.mPending.reset();
+  }
+
+  // Bytes of levels base and coarser
+  static size_t chainBytes(const DecodedImage &image, int base) {
+    size_t bytes = 0;
+    for (int level = base; level < image.levels(); level++) {
+      bytes += image.levelBytes(level);
+    }
+    return bytes;
+  }
+
+  int thumbnailLevel(const DecodedImage &image) const {
+    int level = 0;
+    while (level < image.levels() - 1 &&
+           std::max(image.levelWidth(level), image.levelHeight(level)) >
+               thumbnailSize) {
+      level++;
+    }
+    return level;
+  }
+
+  int wantedLevel(const ManagedTexture &t) const {
+    const DecodedImage &image = *t.mImage;
+    int thumbnail = thumbnailLevel(image);
+    if (t.mDrawnSize <= 0) {
+      return thumbnail;
+    }
+    // At least one texel per drawn pixel
+    float lod = std::log2(std::max(image.width, image.height) / t.mDrawnSize);
+    int level = std::max(0, std::min(int(std::floor(lod)), thumbnail));
+    // Go coarser only once clearly past a level, so textures don't switch
+    // back and forth as panels move
+    if (t.mResident >= 0 && level > t.mResident &&
+        lod < t.mResident + 1.5f) {
+      level = t.mResident;
+    }
+    return level;
+  }
+
+  void fitGpuBudget() {
+    size_t total = 0;
+    for (const ManagedTexture *t : mTextures) {
+      if (t->mTarget >= 0) {
+        total += chainBytes(*t->mImage, t->mTarget);
+      }
+    }
+    if (total <= gpuBudget) {
+      return;
+    }
+    // Textures that aren't drawn go first, largest first
+    std::vector<ManagedTexture *> hidden;
+    for (ManagedTexture *t : mTextures) {
+      if (t->mTarget >= 0 && t->mDrawnSize <= 0) {
+        hidden.push_back(t);
+      }
+    }
+    std::sort(hidden.begin(), hidden.end(),
+              [](const ManagedTexture *a, const ManagedTexture *b) {
+                return chainBytes(*a->mImage, a->mTarget) >
+                       chainBytes(*b->mImage, b->mTarget);
+              });
+    for (ManagedTexture *t : hidden) {
+      if (total <= gpuBudget) {
+        return;
+      }
+      total -= chainBytes(*t->mImage, t->mTarget);
+      t->mTarget = -1;
+    }
+    // Then lower the texture with the most texels per drawn pixel
+    while (total > gpuBudget) {
+      ManagedTexture *coarsest = nullptr;
+      double most = 0;
+      for (ManagedTexture *t : mTextures) {
+        if (t->mTarget < 0 || t->mTarget >= t->mImage->levels() - 1) {
+          continue;
+        }
+        double texels = double(t->mImage->levelWidth(t->mTarget)) *
+                        t->mImage->levelHeight(t->mTarget);
+        double density = texels / (double(t->mDrawnSize) * t->mDrawnSize);
+        if (density > most) {
+          most = density;
+          coarsest = t;
+        }
+      }
+      if (!coarsest) {
+        break; // Everything is at its smallest level
+      }
+      size_t before = chainBytes(*coarsest->mImage, coarsest->mTarget);
+      coarsest->mTarget++;
+      total -= before - chainBytes(*coarsest->mImage, coarsest->mTarget);
+    }
+  }
+
+  void fitStagingBudget() {
+    size_t total = stagingBytes();
+    if (total > stagingBudget) {
+      // Free levels finer than needed, textures drawn smallest first
+      std::vector<ManagedTexture *> order;
+      for (ManagedTexture *t : mTextures) {
+        if (t->mImage) {
+          order.push_back(t);
+        }
+      }
+      std::sort(order.begin(), order.end(),
+                [](const ManagedTexture *a, const ManagedTexture *b) {
+                  return a->mDrawnSize < b->mDrawnSize;
+                });
+      for (ManagedTexture *t : order) {
+        if (total <= stagingBudget) {
+          break;
+        }
+        DecodedImage &image = *t->mImage;
+        int keep = t->mTarget >= 0 ? t->mTarget : thumbnailLevel(image);
+        // Levels being uploaded are still read
+        if (t->mUploadImage == t->mImage) {
+          keep = std::min(keep, t->mUploadBase);
+        }
+        size_t before = image.stagingBytes();
+        image.dropLevelsBelow(keep);
+        total -= before - image.stagingBytes();
+      }
+    }
+    // Decode again where levels that are needed were freed
+    for (ManagedTexture *t : mTextures) {
+      if (t->mImage && !t->mPending && t->mTarget >= 0 &&
+          t->mTarget < t->mImage->firstLevel) {
+        decode(*t);
+      }
+    }
+  }
+
+  void stream(ManagedTexture &t, TextureUploadBudget &budget) {
+    if (!t.mImage) {
+      return;
+    }
+    if (t.mTarget < 0) {
+      if (t.mResident >= 0 || t.mUploadBase >= 0) {
+        t.mTextures[0].destroy();
+        t.mTextures[1].destroy();
+        t.mBytes[0] = t.mBytes[1] = 0;
+        t.mResident = -1;
+        t.mUploadBase = -1;
+        t.mUploadImage.reset();
+        mStats.evictions++;
+      }
+      return;
+    }
+
+    // Only the levels in staging memory can go up now, finer ones follow
+    // once decoded again
+    int base = std::max(t.mTarget, t.mImage->firstLevel);
+    bool current =
+        t.mResident == base && t.mResidentFile == t.mImage->filename;
+    if (current && t.mUploadBase < 0) {
+      return;
+    }
+    if (current) {
+      // Back where it was, drop the upload
+      t.back().destroy();
+      t.mBytes[1 - t.mCurrent] = 0;
+      t.mUploadBase = -1;
+      t.mUploadImage.reset();
+      return;
+    }
+    if (t.mUploadBase != base || t.mUploadImage != t.mImage) {
+      const DecodedImage &image = *t.mImage;
+      if (budget.rows(size_t(image.levelWidth(image.levels() - 1)) * 4) ==
+          0) {
+        return;
+      }
+      allocate(t, image, base);
+    }
+
+    const DecodedImage &image = *t.mUploadImage;
+    while (t.mUploadLevel >= t.mUploadBase) {
+      int level = t.mUploadLevel;
+      size_t offset = chainBytes(image, level + 1);
+      t.mUploadRow = t.mUploader.upload(
+          t.back().id(), level - t.mUploadBase, image.levelWidth(level),
+          image.levelHeight(level), image.levelPixels(level), offset,
+          t.mUploadRow, budget);
+      if (t.mUploadRow < image.levelHeight(level)) {
+        return; // Budget spent
+      }
+      t.mUploadLevel--;
+      t.mUploadRow = 0;
+    }
+
+    // Complete, swap and free the previous levels
+    t.mCurrent = 1 - t.mCurrent;
+    t.back().destroy();
+    t.mBytes[1 - t.mCurrent] = 0;
+    t.mResident = t.mUploadBase;
+    t.mResidentFile = image.filename;
+    t.mAspectRatio = image.width / float(image.height);
+    t.mUploadBase = -1;
+    t.mUploadImage.reset();
+    mStats.swaps++;
+  }
+
+  // Create the back texture with storage for levels base and coarser
+  void allocate(ManagedTexture &t, const DecodedImage &image, int base) {
+    al::Texture &tex = t.back();
+    tex.destroy();
+    tex.create2D(image.levelWidth(base), image.levelHeight(base));
+    int levels = image.levels() - base;
+    glBindTexture(GL_TEXTURE_2D, tex.id());
+    for (int level = 1; level < levels; level++) {
+      glTexImage2D(GL_TEXTURE_2D, level, GL_RGBA8,
+                   GLsizei(image.levelWidth(base + level)),
+                   GLsizei(image.levelHeight(base + level)), 0, GL_RGBA,
+                   GL_UNSIGNED_BYTE, nullptr);
+    }
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, levels - 1);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    tex.filterMin(al::Texture::LINEAR_MIPMAP_LINEAR);
+    tex.filterMag(al::Texture::LINEAR);
+
+    t.mBytes[1 - t.mCurrent] = chainBytes(image, base);
+    // Coarsest level first in the buffer, as it is uploaded first
+    t.mUploader.begin(chainBytes(image, base));
+    t.mUploadImage = t.mImage;
+    t.mUploadBase = base;
+    t.mUploadLevel = image.levels() - 1;
+    t.mUploadRow = 0;
+  }
+
+  ImageLoader &mLoader;
+  std::vector<ManagedTexture *> mTextures;
+  Stats mStats;
+};
+
+inline ManagedTexture::~ManagedTexture() {
+  if (mResidency) {
+    mResidency->remove(this);
+  }
+}
+
+inline void ManagedTexture::load(TextureResidency &residency,
+                                 const std::string &filename) {
+  if (mResidency != &residency) {
+    if (mResidency) {
+      mResidency->remove(this);
+    }
+    residency.add(this);
+    mResidency = &residency;
+  }
+  mFilename = filename;
+  residency.decode(*this);
+}
+
+#endif
@@ -0,0 +1,459 @@
+#pragma once
+#ifndef VideoStream_H
+#define VideoStream_H
+
+// Plays a video into a texture from a decode thread.
+//
+// A decode thread fills a ring of decoded RGBA frames a little ahead of the
+// playhead. Each frame carries its presentation time stamp (PTS), and the
+// graphics thread shows the frame whose PTS is nearest the playhead, so the
+// picture follows whatever time it is given: the primary's clock, or a
+// currentTime received from the primary on a renderer.
+//
+// Frames are uploaded through two pixel buffer objects used in turn, so
+// writing one frame never waits for the GPU to finish copying the previous
+// one.
+//
+// When the playhead leaves what the ring can reach (a seek, or a renderer
+// that starts late), the decode thread seeks and pre-rolls: it decodes from
+// the key frame before the target without showing anything until it reaches
+// the target. The last frame stays on screen meanwhile. Renderers pass a
+// seek lead, so they pre-roll to where the playhead will be once decoding
+// has caught up instead of chasing it.
+//
+//   video.open(std::unique_ptr<VideoSource>(new LibavVideoSource), file);
+//   video.playhead(time, lead);    // graphics thread, every frame
+//   video.update(&budget);         // graphics thread, uploads a new frame
+//   if (video.hasFrame()) g.quad(video.texture(), ...);
+//
+// Decoding itself is done by a VideoSource (LibavVideoSource.hpp).
+
+#include "al/graphics/al_Graphics.hpp"
+#include "al/graphics/al_Texture.hpp"
+
+#include "ImageLoader.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct VideoFrame {
+  double pts{0};   // Presentation time in seconds
+  uint64_t id{0};  // Decode order, to tell frames apart
+  std::vector<uint8_t> pixels; // RGBA8, rows from the top
+};
+
+// Decodes frames in presentation order. Used only from the decode thread
+// once opened.
+class VideoSource {
+public:
+  virtual ~VideoSource() {}
+  virtual bool open(const std::string &filename) = 0;
+  virtual unsigned int width() const = 0;
+  virtual unsigned int height() const = 0;
+  virtual double frameDuration() const = 0;
+  // Seconds, 0 if unknown
+  virtual double duration() const = 0;
+  // Go to the key frame at or before a time
+  virtual bool seek(double seconds) = 0;
+  // Decode the next frame into frame.pixels (width * height * 4 bytes) and
+  // set frame.pts. False at the end of the stream.
+  virtual bool decode(VideoFrame &frame) = 0;
+};
+
+// Fixed set of frame buffers shared by one producer (the decode thread) and
+// one consumer (the graphics thread). Ready frames are kept in PTS order.
+class VideoFrameRing {
+public:
+  void allocate(size_t slots, size_t bytes) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mSlots.resize(slots);
+    mReady.clear();
+    mFree.clear();
+    for (size_t i = 0; i < slots; i++) {
+      mSlots[i].pixels.resize(bytes);
+      mFree.push_back(int(i));
+    }
+    mSelected = -1;
+    mSelectedFlushed = false;
+  }
+
+  // Producer: a frame to decode into, or nullptr if all are in use
+  VideoFrame *acquire() {
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (mFree.empty()) {
+      return nullptr;
+    }
+    int slot = mFree.back();
+    mFree.pop_back();
+    return &mSlots[slot];
+  }
+
+  // Producer: make an acquired frame available
+  void publish(VideoFrame *frame) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mReady.push_back(index(frame));
+  }
+
+  // Producer: give back an acquired frame unused
+  void discard(VideoFrame *frame) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mFree.push_back(index(frame));
+  }
+
+  // Drop all ready frames. The one the consumer selected last is only
+  // freed on its next select(), as it may still be uploading it.
+  void flush() {
+    std::lock_guard<std::mutex> lock(mMutex);
+    for (int slot : mReady) {
+      if (slot == mSelected) {
+        mSelectedFlushed = true;
+      } else {
+        mFree.push_back(slot);
+      }
+    }
+    mReady.clear();
+  }
+
+  // Consumer: the frame to show at a time, the latest one whose PTS is
+  // within tolerance of it. Older frames are released. nullptr if the
+  // earliest frame is still in the future. The frame stays valid until the
+  // next select().
+  const VideoFrame *select(double time, double tolerance) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (mSelectedFlushed) {
+      mFree.push_back(mSelected);
+      mSelectedFlushed = false;
+    }
+    mSelected = -1;
+    while (mReady.size() > 1 && mSlots[mReady[1]].pts <= time + tolerance) {
+      mFree.push_back(mReady.front());
+      mReady.pop_front();
+      mReleased++;
+    }
+    if (mReady.empty() || mSlots[mReady.front()].pts > time + tolerance) {
+      return nullptr;
+    }
+    mSelected = mReady.front();
+    return &mSlots[mSelected];
+  }
+
+  // PTS range of the ready frames. False if there are none.
+  bool range(double &oldest, double &newest) const {
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (mReady.empty()) {
+      return false;
+    }
+    oldest = mSlots[mReady.front()].pts;
+    newest = mSlots[mReady.back()].pts;
+    return true;
+  }
+
+  bool hasFree() const {
+    std::lock_guard<std::mutex> lock(mMutex);
+    return !mFree.empty();
+  }
+
+  // Frames released by select() (shown or skipped)
+  uint64_t released() const {
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mReleased;
+  }
+
+private:
+  int index(const VideoFrame *frame) const {
+    return int(frame - mSlots.data());
+  }
+
+  mutable std::mutex mMutex;
+  std::vector<VideoFrame> mSlots;
+  std::deque<int> mReady;
+  std::vector<int> mFree;
+  int mSelected{-1};
+  bool mSelectedFlushed{false};
+  uint64_t mReleased{0};
+};
+
+class VideoStream {
+public:
+  struct Stats {
+    uint64_t decoded{0};   // Frames decoded
+    uint64_t prerolled{0}; // Decoded before a seek target, not shown
+    uint64_t late{0};      // Decoded after the playhead had passed them
+    uint64_t shown{0};     // Frames uploaded
+    uint64_t seeks{0};
+  };
+
+  size_t ringSize{6};
+  // How far ahead of the playhead frames are decoded
+  double lookahead{0.2};
+  // Seek instead of decoding forward if the playhead is this far ahead of
+  // the last decoded frame
+  double seekAhead{1.0};
+
+  ~VideoStream() {
+    close();
+    if (mPbos[0]) {
+      glDeleteBuffers(2, mPbos);
+    }
+  }
+
+  // Open a file with a source and start decoding from the beginning. The
+  // texture is created on the next update().
+  bool open(std::unique_ptr<VideoSource> source, const std::string &filename) {
+    close();
+    if (!source->open(filename)) {
+      return false;
+    }
+    mSource = std::move(source);
+    mWidth = mSource->width();
+    mHeight = mSource->height();
+    mFrameDuration = mSource->frameDuration();
+    mRing.allocate(ringSize, size_t(mWidth) * mHeight * 4);
+    mStats = Stats();
+    // The last frame of a previous file stays until the first new one
+    mShownId = 0;
+    mPlayhead = 0;
+    mDecodePosition = 0;
+    mSeekTarget = 0;
+    mSeekLead = 0;
+    mEnded = false;
+    mStop = false;
+    mThread = std::thread([this]() { run(); });
+    return true;
+  }
+
+  void close() {
+    if (mThread.joinable()) {
+      {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mStop = true;
+      }
+      mCondition.notify_all();
+      mThread.join();
+    }
+    mSource.reset();
+  }
+
+  bool isOpen() const { return mSource != nullptr; }
+
+  // Set the time to show, from the graphics thread. If the decode thread has
+  // to seek to reach it, it seeks to time + seekLead.
+  void playhead(double time, double seekLead = 0) {
+    if (!mSource) {
+      return;
+    }
+    // What the ring holds, or will soon
+    double start, newest;
+    double end = mDecodePosition;
+    if (!mRing.range(start, newest)) {
+      start = end - mSeekLead - lookahead;
+    }
+    // Until the playhead reaches a target it seeked ahead to, frames are
+    // expected to be up to the lead ahead of it
+    if (time >= mSeekTarget) {
+      mSeekLead = 0;
+    }
+    double tolerance = 2 * mFrameDuration;
+    bool before = time < start - mSeekLead - tolerance;
+    bool after = time > end + seekAhead &&
+                 !(mEnded && duration() > 0 && time >= duration());
+    if (before || after) {
+      seek(time + seekLead, seekLead);
+    }
+    mPlayhead = time;
+    mCondition.notify_one();
+  }
+
+  // Upload the frame for the playhead if it isn't shown yet. Returns true
+  // if the texture changed. Uploaded bytes count against the budget, so
+  // image uploads in the same frame get less.
+  bool update(TextureUploadBudget *budget = nullptr) {
+    if (!mSource) {
+      return false;
+    }
+    const VideoFrame *frame = mRing.select(mPlayhead, mFrameDuration / 2);
+    if (!frame || (mHasFrame && frame->id == mShownId)) {
+      return false;
+    }
+    auto start = std::chrono::steady_clock::now();
+    if (mTexture.width() != mWidth || mTexture.height() != mHeight) {
+      mTexture.create2D(mWidth, mHeight);
+      mTexture.filter(al::Texture::LINEAR);
+      mTexture.wrap(al::Texture::CLAMP_TO_EDGE, al::Texture::CLAMP_TO_EDGE,
+                    al::Texture::CLAMP_TO_EDGE);
+    }
+    size_t bytes = size_t(mWidth) * mHeight * 4;
+    if (!mPbos[0]) {
+      glGenBuffers(2, mPbos);
+    }
+    // Write into the buffer not used by the previous upload
+    mPbo = 1 - mPbo;
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, mPbos[mPbo]);
+    glBufferData(GL_PIXEL_UNPACK_BUFFER, GLsizeiptr(bytes), nullptr,
+                 GL_STREAM_DRAW);
+    void *dst = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, GLsizeiptr(bytes),
+                                 GL_MAP_WRITE_BIT |
+                                     GL_MAP_INVALIDATE_BUFFER_BIT);
+    if (dst) {
+      memcpy(dst, frame->pixels.data(), bytes);
+      glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+    } else {
+      glBufferSubData(GL_PIXEL_UNPACK_BUFFER, 0, GLsizeiptr(bytes),
+                      frame->pixels.data());
+    }
+    glBindTexture(GL_TEXTURE_2D, mTexture.id());
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, GLsizei(mWidth), GLsizei(mHeight),
+                    GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    if (budget) {
+      budget->spend(bytes, std::chrono::duration<double>(
+                               std::chrono::steady_clock::now() - start)
+                               .count());
+    }
+    mShownId = frame->id;
+    mShownPts = frame->pts;
+    mHasFrame = true;
+    mStats.shown++;
+    return true;
+  }
+
+  // True if decoding has reached a time, i.e. the stream isn't seeking or
+  // pre-rolling there
+  bool ready(double time) const {
+    double oldest, newest;
+    return mRing.range(oldest, newest) && newest >= time;
+  }
+
+  bool hasFrame() const { return mHasFrame; }
+  al::Texture &texture() { return mTexture; }
+  // PTS of the frame in the texture
+  double shownTime() const { return mShownPts; }
+  bool ended() const { return mEnded; }
+
+  unsigned int width() const { return mWidth; }
+  unsigned int height() const { return mHeight; }
+  double duration() const { return mSource ? mSource->duration() : 0; }
+
+  Stats stats() const {
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mStats;
+  }
+
+private:
+  // Graphics thread
+  void seek(double target, double lead) {
+    mSeekTarget = target;
+    mSeekLead = lead;
+    mDecodePosition = target;
+    mSeekSerial++;
+  }
+
+  void run() {
+    uint32_t serial = 0;
+    double target = 0;
+    uint64_t id = 0;
+    while (true) {
+      {
+        // Decoding is woken by playhead(), the timeout covers frames
+        // released by the graphics thread in between
+        std::unique_lock<std::mutex> lock(mMutex);
+        mCondition.wait_for(lock, std::chrono::milliseconds(5), [&]() {
+          return mStop || mSeekSerial != serial || canDecode();
+        });
+        if (mStop) {
+          return;
+        }
+        if (mSeekSerial == serial && !canDecode()) {
+          continue;
+        }
+      }
+      if (mSeekSerial != serial) {
+        serial = mSeekSerial;
+        target = mSeekTarget;
+        mSource->seek(target);
+        mRing.flush();
+        mEnded = false;
+        std::lock_guard<std::mutex> lock(mMutex);
+        mStats.seeks++;
+      }
+
+      VideoFrame *frame = mRing.acquire();
+      if (!frame) {
+        continue;
+      }
+      if (!mSource->decode(*frame)) {
+        mRing.discard(frame);
+        mEnded = true;
+        continue;
+      }
+      frame->id = ++id;
+      std::lock_guard<std::mutex> lock(mMutex);
+      mStats.decoded++;
+      // Pre-roll from the key frame to the seek target
+      if (frame->pts + mFrameDuration / 2 < target) {
+        mRing.discard(frame);
+        mStats.prerolled++;
+        continue;
+      }
+      // A frame from before a seek that was just requested must not move
+      // the position away from the new target
+      if (serial == mSeekSerial) {
+        mDecodePosition = frame->pts;
+      }
+      // The graphics thread has already moved past it
+      if (frame->pts + mFrameDuration < mPlayhead) {
+        mRing.discard(frame);
+        mStats.late++;
+        continue;
+      }
+      mRing.publish(frame);
+    }
+  }
+
+  bool canDecode() const {
+    if (mEnded || !mRing.hasFree()) {
+      return false;
+    }
+    double oldest, newest;
+    return !mRing.range(oldest, newest) || newest < mPlayhead + lookahead;
+  }
+
+  std::unique_ptr<VideoSource> mSource;
+  unsigned int mWidth{0};
+  unsigned int mHeight{0};
+  double mFrameDuration{1.0 / 30.0};
+
+  VideoFrameRing mRing;
+  std::thread mThread;
+  mutable std::mutex mMutex; // Wakes the decode thread, guards mStats
+  std::condition_variable mCondition;
+  bool mStop{false};
+  Stats mStats;
+
+  std::atomic<double> mPlayhead{0};
+  std::atomic<double> mDecodePosition{0}; // PTS of the last decoded frame
+  std::atomic<double> mSeekTarget{0};
+  std::atomic<double> mSeekLead{0};
+  std::atomic<uint32_t> mSeekSerial{0};
+  std::atomic<bool> mEnded{false};
+
+  // Graphics thread
+  al::Texture mTexture;
+  GLuint mPbos[2]{0, 0};
+  int mPbo{0};
+  uint64_t mShownId{0};
+  double mShownPts{0};
+  bool mHasFrame{false};
+};
+
+#endif
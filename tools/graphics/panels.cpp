@@ -11,12 +11,15 @@
 #include "al_ext/statedistribution/al_CuttleboneDomain.hpp"
 #include "al_ext/statedistribution/al_CuttleboneStateSimulationDomain.hpp"
 
+#include <Gamma/Noise.h>
+
+#include "ImageLoader.hpp"
+#include "TextureResidency.hpp"
+
 #ifdef AL_EXT_LIBAV
-#include "al_ext/video/al_VideoDecoder.hpp"
+#include "LibavVideoSource.hpp"
 #endif
 
-#include <Gamma/Noise.h>
-
 using namespace al;
 
 #include <iostream> // cout
@@ -40,6 +43,8 @@ static const char *videoPath = "Sensorium/videos/";
 
 struct VoiceSharedData {
   std::string *dataRoot{nullptr};
+  TextureResidency *textureResidency{nullptr};
+  TextureUploadBudget *uploadBudget{nullptr};
 };
 
 class Panel : public PositionedVoice {
@@ -104,8 +109,15 @@ public:
     bundle.addParameter(billboard);
   }
 
+  // Texture to draw, or nullptr if there is nothing to show yet
+  virtual Texture *currentTexture() { return &tex; }
+
   virtual void onProcess(Graphics &g) {
     file.processChange();
+    Texture *texture = currentTexture();
+    if (!texture) {
+      return;
+    }
     g.pushMatrix();
     if (billboard.get() == 1) {
       Vec3f forward = pose().pos();
@@ -114,7 +126,7 @@ public:
       g.rotate(rot);
     }
     g.tint(1.0, alpha);
-    g.quad(tex, -0.5 * aspectRatio, 0.5, aspectRatio, -1, false);
+    g.quad(*texture, -0.5 * aspectRatio, 0.5, aspectRatio, -1, false);
     g.popMatrix();
   }
 };
@@ -131,33 +143,48 @@ public:
 
         std::string filename = rootPath + imagePath + value;
 
-        auto imageData = Image(filename);
-
-        if (imageData.array().size() == 0) {
-          std::cout << "failed to load image " << filename << std::endl;
-        }
-        std::cout << "loaded image size: " << imageData.width() << ", "
-                  << imageData.height() << std::endl;
-
-        tex.create2D(imageData.width(), imageData.height());
-        tex.submit(imageData.array().data(), GL_RGBA, GL_UNSIGNED_BYTE);
-
-        tex.filter(Texture::LINEAR);
-        aspectRatio = imageData.width() / (float)imageData.height();
+        // Decoded on the loader's threads, the previous picture stays
+        // until the new one is uploaded
+        picture.load(*data->textureResidency, filename);
         currentlyLoadedFile = value;
       }
     });
   }
+
+  // Tell the residency manager how many pixels the picture covers, from its
+  // angular size seen from the eye
+  void updateDrawnSize(const Vec3d &eye, double pixelsPerRadian) {
+    double distance = (pose().pos() - eye).mag();
+    float size = parameterSize().get();
+    if (alpha.get() <= 0.0f || size <= 0.0f || distance <= 0.0) {
+      picture.drawnSize(0.0f);
+      return;
+    }
+    double extent = size * std::max(1.0f, aspectRatio);
+    picture.drawnSize(float(extent / distance * pixelsPerRadian));
+  }
+
+  Texture *currentTexture() override {
+    Texture *texture = picture.texture();
+    if (texture) {
+      aspectRatio = picture.aspectRatio();
+    }
+    return texture;
+  }
+
+private:
+  ManagedTexture picture;
 };
 
 class VideoPanel : public Panel {
 public:
-  //  double wallTime{0.0};
-  double previousTime{0.0};
-
   ParameterBool playing{"playing", "", false};
   Parameter currentTime{"currentTime", "", 0.0};
 
+  // How far ahead of currentTime a renderer pre-rolls when it has to seek
+  // while playing, so its frames are ready when currentTime gets there
+  double prerollLead{0.5};
+
   virtual void init() {
     Panel::init();
 
@@ -170,31 +197,21 @@ public:
     file.registerChangeCallback([&](std::string value) {
       if (value != currentlyLoadedFile) {
 #ifdef AL_EXT_LIBAV
-        videoDecoder.stop();
-
-        videoDecoder.init();
         auto data = static_cast<VoiceSharedData *>(userData());
         std::string rootPath = *(data->dataRoot);
 
         std::string filename = rootPath + videoPath + value;
 
-        if (!videoDecoder.load(filename.c_str())) {
+        if (!video.open(std::unique_ptr<VideoSource>(new LibavVideoSource),
+                        filename)) {
           std::cerr << "Error loading video file: " << filename << std::endl;
-          //            quit();
+          return;
         }
-        // generate texture
-        tex.filter(Texture::LINEAR);
-        tex.wrap(Texture::REPEAT, Texture::CLAMP_TO_EDGE,
-                 Texture::CLAMP_TO_EDGE);
-        tex.create2D(videoDecoder.width(), videoDecoder.height(),
-                     Texture::RGBA8, Texture::RGBA, Texture::UBYTE);
-        videoDecoder.enableAudio(false);
-        aspectRatio = videoDecoder.width() / (double)videoDecoder.height();
+        aspectRatio = video.width() / (double)video.height();
         currentTime = 0.0;
-        currentTime.max(3000); // TODO set from video length
+        currentTime.max(video.duration() > 0 ? video.duration() : 3000);
         playing = 1.0;
-        videoDecoder.start();
-
+        currentlyLoadedFile = value;
 #else
         std::cerr << "ERROR: video extension al_ext/video not built. Video "
                      "will not play back"
@@ -206,49 +223,32 @@ public:
 
   void update(double dt) {
 #ifdef AL_EXT_LIBAV
-    bool timeChanged = false;
+    if (!video.isOpen()) {
+      return;
+    }
+    bool play = playing.get() == 1.0f;
     if (isPrimary()) {
-      if (playing.get() == 1.0f) {
+      // Hold the clock while the stream pre-rolls, so renderers never get
+      // ahead of what the primary shows
+      if (play && video.ready(currentTime)) {
         currentTime = currentTime.get() + dt;
-        timeChanged = true;
-      }
-    }
-    if (currentTime - previousTime < -3.0 / 30.0) {
-      videoDecoder.stream_seek((int64_t)(currentTime * AV_TIME_BASE), -10);
-      timeChanged = true;
-    } else if (currentTime - previousTime > 3.0 / 30.0) {
-      videoDecoder.stream_seek((int64_t)(currentTime * AV_TIME_BASE), 10);
-      timeChanged = true;
-    } else if (currentTime != previousTime) {
-      timeChanged = true;
-    }
-    if (timeChanged) {
-      uint8_t *frame = videoDecoder.getVideoFrame(currentTime);
-      if (frame) {
-        tex.submit(frame);
       }
-      previousTime = currentTime;
+      video.playhead(currentTime);
+    } else {
+      video.playhead(currentTime, play ? prerollLead : 0.0);
     }
+    auto data = static_cast<VoiceSharedData *>(userData());
+    video.update(data->uploadBudget);
 #endif
   }
 
-  virtual void onProcess(Graphics &g) {
-    file.processChange();
-    g.pushMatrix();
-    if (billboard.get() == 1) {
-      Vec3f forward = pose().pos();
-      forward.normalize();
-      Quatf rot = Quatf::getBillboardRotation(-forward, Vec3f{0.f, 1.f, 0.f});
-      g.rotate(rot);
-    }
-    g.tint(1.0, alpha);
-    g.quad(tex, -0.5 * aspectRatio, 0.5, aspectRatio, -1, false);
-    g.popMatrix();
+#ifdef AL_EXT_LIBAV
+  Texture *currentTexture() override {
+    return video.hasFrame() ? &video.texture() : nullptr;
   }
 
 private:
-#ifdef AL_EXT_LIBAV
-  VideoDecoder videoDecoder;
+  VideoStream video;
 #endif
 };
 
@@ -269,9 +269,16 @@ public:
   VAOMesh sphereMesh;
   ParameterString skyboxFile{"skyboxFile"};
   ParameterPose skyboxPose{"skyboxPose"};
-  Texture skyboxTexture;
+  StreamedTexture skyboxTexture;
   std::string currentSkyboxFile;
 
+  // Image decoding, the texture uploads of all panels per frame and the
+  // mip levels of the pictures on the GPU
+  ImageLoader imageLoader;
+  TextureUploadBudget uploadBudget;
+  TextureResidency textureResidency{imageLoader};
+  ParameterInt textureMemory{"textureMemoryMB", "", 512, 16, 16384};
+
   DistributedScene scene{TimeMasterMode::TIME_MASTER_CPU};
   FileList imageFiles;
   FileList videoFiles;
@@ -287,6 +294,8 @@ public:
 
   void onInit() override {
     voiceData.dataRoot = &this->dataRoot;
+    voiceData.textureResidency = &textureResidency;
+    voiceData.uploadBudget = &uploadBudget;
     assert(voiceData.dataRoot);
 
     // Enable cuttlebone for state distribution
@@ -332,19 +341,7 @@ public:
 
           std::string filename = dataRoot + imagePath + value;
 
-          auto imageData = Image(filename);
-
-          if (imageData.array().size() == 0) {
-            std::cout << "failed to load image " << filename << std::endl;
-          }
-          std::cout << "SKYBOX loaded image size: " << imageData.width() << ", "
-                    << imageData.height() << std::endl;
-
-          skyboxTexture.create2D(imageData.width(), imageData.height());
-          skyboxTexture.submit(imageData.array().data(), GL_RGBA,
-                               GL_UNSIGNED_BYTE);
-
-          skyboxTexture.filter(Texture::LINEAR);
+          skyboxTexture.load(imageLoader, filename);
           currentSkyboxFile = value;
         }
       });
@@ -352,9 +349,17 @@ public:
                         << rotatePhase;
     }
 
+    // GPU memory for pictures
+    textureMemory.registerChangeCallback([&](int32_t value) {
+      textureResidency.gpuBudget = size_t(value) << 20;
+    });
+    textureResidency.gpuBudget = size_t(textureMemory.get()) << 20;
+    parameterServer() << textureMemory;
+
     if (isPrimary()) {
       // Persistent configuration
       config.registerParameter(bgColor);
+      config.registerParameter(textureMemory);
       config.read();
 
       presets << bgColor << skyboxFile << skybox << skyboxPose << rotateSpeed;
@@ -389,7 +394,7 @@ public:
     *gui << presets;
 
     *gui << skybox << skyboxFile << skyboxPose << rotateSpeed;
-    *gui << stereo;
+    *gui << stereo << textureMemory;
 
     for (size_t i = 0; i < numPictures; i++) {
       *gui << pictures[i].bundle;
@@ -402,8 +407,21 @@ public:
   }
 
   void onAnimate(double dt) override {
+    uploadBudget.beginFrame();
     skyboxFile.processChange();
     stereo.processChange();
+    if (skyboxTexture.update(uploadBudget)) {
+      std::cout << "SKYBOX loaded image size: "
+                << skyboxTexture.texture().width() << ", "
+                << skyboxTexture.texture().height() << std::endl;
+    }
+
+    // Mip levels follow the pictures' size on screen
+    double pixelsPerRadian = height() / (lens().fovy() * M_PI / 180.0);
+    for (size_t i = 0; i < numPictures; i++) {
+      pictures[i].updateDrawnSize(nav().pos(), pixelsPerRadian);
+    }
+    textureResidency.update(uploadBudget);
 
     scene.update(dt);
     if (isPrimary()) {
@@ -424,15 +442,15 @@ public:
     g.pushMatrix();
     g.rotate(rotatePhase, 0, 1, 0);
 
-    if (skybox.get() == 1.0) {
+    if (skybox.get() == 1.0 && skyboxTexture.ready()) {
       g.pushMatrix();
       g.texture();
       g.tint(1.f, 1.f);
       g.translate(skyboxPose.get().pos());
       g.rotate(skyboxPose.get().quat());
-      skyboxTexture.bind();
+      skyboxTexture.texture().bind();
       g.draw(sphereMesh);
-      skyboxTexture.unbind();
+      skyboxTexture.texture().unbind();
       g.popMatrix();
     }
 
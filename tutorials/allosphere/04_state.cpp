@@ -32,6 +32,16 @@ You should use parameters when you need near instantaneous updates (usually
 good for audio), or if your state is getting large and you don't require
 updating values on every frame.
 
+State frames don't arrive at renderers at perfectly regular intervals. If
+renderers use state() directly, a late frame shows as a stutter. Here the
+primary stamps each frame with the time it was written, and renderers draw the
+state as it was a short fixed time ago, interpolated between the frames
+received around that time (see StateSmoother.hpp). Renderers print the
+measured latency and jitter every 600 frames.
+
+To measure state distribution with several renderers on one machine, run the
+built app with tools/cluster/local_cluster.py.
+
 */
 
 #include "Gamma/Oscillator.h"
@@ -40,12 +50,19 @@ updating values on every frame.
 #include "al/ui/al_ControlGUI.hpp"
 #include "al/ui/al_Parameter.hpp"
 
+#include "../../cookbook/distributed/NodeStats.hpp"
+#include "../../cookbook/distributed/StateSmoother.hpp"
+
+#include <iostream>
+
 using namespace al;
 
 struct CommonState {
   float xPosition = 0.0;
   float mod = 0.5; // modulation value
   Nav nav;
+  double time = 0; // When the primary wrote this state
+  uint32_t frame = 0;
 };
 
 class MyApp : public DistributedAppWithState<CommonState> {
@@ -61,6 +78,21 @@ public:
   Parameter mod{"mod", "", 0.5};
   ControlGUI gui;
 
+  // State as drawn. On renderers this is smoothed, on the primary a copy of
+  // state().
+  CommonState shown;
+  StateSmoother<CommonState> smoother{
+      [](const CommonState &a, const CommonState &b, float t,
+         CommonState &out) {
+        out = b;
+        out.xPosition = a.xPosition + (b.xPosition - a.xPosition) * t;
+        out.mod = a.mod + (b.mod - a.mod) * t;
+        out.nav.set(lerpPose(a.nav, b.nav, t));
+      }};
+  unsigned frameCount{0};
+  // Printed when run by tools/cluster/local_cluster.py
+  NodeStats nodeStats;
+
   void onInit() override {}
   void onCreate() override {
     addIcosphere(m);
@@ -88,19 +120,36 @@ public:
 
       state().xPosition = factor * 10;
       state().nav = nav();
+      state().time = stateTime();
+      state().frame++;
+      shown = state();
+      nodeStats.sent(sizeof(CommonState));
     } else {
-      nav() = state().nav;
+      nodeStats.received(state().frame, state().time, sizeof(CommonState));
+      smoother.receive(state().time, state());
+      smoother.sample(shown);
+      nav() = shown.nav;
+
+      if (++frameCount % 600 == 0) {
+        auto &stats = smoother.stats();
+        std::cout << "State latency " << stats.latency * 1000 << " ms, jitter "
+                  << stats.jitter * 1000 << " ms, " << stats.framesLate
+                  << " late frames, " << stats.samplesExtrapolated
+                  << " extrapolated" << std::endl;
+        smoother.resetStats();
+      }
     }
   }
 
   void onDraw(Graphics &g) override {
     g.clear(0);
     g.pushMatrix();
-    // Notice that I query variables through state(). In the case of the primary
-    // node, this is local data, in the case of renderers, this is data
-    // received through state synchronization.
-    g.translate(state().xPosition, 0, -4);
-    g.scale(state().mod);
+    // Notice that I query variables through state() (here through its
+    // smoothed copy). In the case of the primary node, this is local data, in
+    // the case of renderers, this is data received through state
+    // synchronization.
+    g.translate(shown.xPosition, 0, -4);
+    g.scale(shown.mod);
     g.polygonLine();
     g.draw(m);
     if (hasCapability(Capability::CAP_2DGUI)) {